@@ -11,19 +11,11 @@ greaterThan(QT_MAJOR_VERSION, 4): QT += widgets
 TARGET = BilkonSdCardCreater
 TEMPLATE = app
 
+include(engine.pri)
 
 SOURCES += main.cpp\
-        mainwindow.cpp \
-    cardassistant.cpp \
-    json/jsonhelper.cpp \
-    json/qjsonmodel.cpp
+        mainwindow.cpp
 
-HEADERS  += mainwindow.h \
-    cardassistant.h \
-    json/jsonhelper.h \
-    json/qjsonmodel.h
+HEADERS  += mainwindow.h
 
 FORMS    += mainwindow.ui
-
-QMAKE_CXXFLAGS += -std=c++11
-
@@ -1,22 +1,77 @@
 #include "cardassistant.h"
+#include "processrunner.h"
+#include "device/mbr.h"
+#include "device/blockwriter.h"
+#include "device/imagecache.h"
+#include "device/sparseimage.h"
+#include "device/fanoutwriter.h"
+#include "device/cardverifier.h"
+#include "device/hotplugmonitor.h"
+#include "device/resumejournal.h"
+#include "release/tarextractor.h"
+#include "release/releaseindex.h"
+#include "release/ubootscript.h"
+#include "release/downloader.h"
+#include "release/releaseingest.h"
+#include "mac/macpool.h"
+#include "util/tracer.h"
+#include "util/logger.h"
 
 #include <QDir>
 #include <QUuid>
 #include <QFile>
+#include <QMutex>
+#include <QFileInfo>
+#include <QDateTime>
+#include <QTemporaryFile>
 #include <QTime>
 #include <QDebug>
 #include <QJsonValue>
-#include <QMessageBox>
-#include <QInputDialog>
 #include <QNetworkRequest>
 #include <QNetworkInterface>
 
+#include <stdio.h>
+#include <unistd.h>
+
+/* per step process timeouts */
+#define INSTALL_TIMEOUT	(30 * 60 * 1000)
+#define DOWNLOAD_CHUNK	(64 * 1024)
+/* script output kept in the log when a step fails */
+#define OUTPUT_TAIL_LINES	40
+
 CardAssistant::CardAssistant()
 {
 	filename = "creater.json";
 	json = new JsonHelper(filename);
+	downloader = NULL;
+	ingest = NULL;
+	managerConnected = false;
+	initLog();
+
+	p = new ProcessRunner();
+	connect(p, SIGNAL(errorDetected(QString)), SLOT(processErrorLine(QString)));
+}
 
-	p = new QProcess();
+/*
+ * Worker instance bound to a single card. The json helper is shared with the
+ * gui instance, so every worker sees the same release and recipe selection.
+ */
+CardAssistant::CardAssistant(JsonHelper *helper, const QString &media)
+{
+	json = helper;
+	device = media;
+	downloader = NULL;
+	ingest = NULL;
+	managerConnected = false;
+	initLog();
+
+	p = new ProcessRunner();
+	connect(p, SIGNAL(errorDetected(QString)), SLOT(processErrorLine(QString)));
+}
+
+CardAssistant::~CardAssistant()
+{
+	delete p;
 }
 
 QStringList CardAssistant::getReleaseList()
@@ -26,34 +81,147 @@ QStringList CardAssistant::getReleaseList()
 
 int CardAssistant::downloadReleaseList()
 {
-	if(!QDir::setCurrent(json->value("folder.binaries"))) {
+	if(changeDirectory(json->value("folder.binaries"))) {
 		logFile("CreateConfig: not change directory");
 		return -3;
 	}
 
-	QUrl url("http://fourier.bilkon.arge/releases/file_list.txt");
+	QUrl url(QString("%1/file_list.txt").arg(releaseUrl()));
 	startDownload(url);
+	return 0;
+}
+
+QString CardAssistant::releaseUrl()
+{
+	QString url = json->value("release_url");
+	if (url.isEmpty())
+		url = "http://fourier.bilkon.arge/releases";
+	return url;
+}
+
+/*
+ * Fetches <release_url>/<release> into folder.binaries. By default the
+ * tarball is inflated and extracted while it downloads and indexed at the
+ * end, "download_ingest":"off" downloads in parallel range segments only.
+ * An interrupted download resumes from its .part.json sidecar,
+ * <release>.sha256 (or .sha1/.md5 style digest) is checked when the
+ * server has one.
+ */
+int CardAssistant::downloadRelease(const QString &release)
+{
+	if(changeDirectory(json->value("folder.binaries"))) {
+		logFile("DownloadRelease: not change directory");
+		return -3;
+	}
+	if ((downloader && downloader->isRunning()) || (ingest && ingest->isRunning())) {
+		logFile("DownloadRelease: a download is already running");
+		return -1;
+	}
+	/* pipeline queues are single use */
+	if (ingest)
+		ingest->deleteLater();
+	ingest = NULL;
+
+	Downloader *loader;
+	if (json->value("download_ingest") != "off") {
+		ingest = new ReleaseIngest(workdir, this);
+		connect(ingest, SIGNAL(progress(qint64,qint64)), SLOT(writeProgress(qint64,qint64)));
+		connect(ingest, SIGNAL(finished(int)), SLOT(releaseDownloadFinished(int)));
+		loader = ingest->downloader();
+	} else {
+		if (!downloader) {
+			downloader = new Downloader(this);
+			connect(downloader, SIGNAL(progress(qint64,qint64)), SLOT(writeProgress(qint64,qint64)));
+			connect(downloader, SIGNAL(finished(int)), SLOT(releaseDownloadFinished(int)));
+		}
+		loader = downloader;
+	}
+	QString segments = json->value("download_segments");
+	if (!segments.isEmpty())
+		loader->setSegments(segments.toInt());
+	/* line PCs are small, the release must not end up in RAM */
+	QString memory = json->value("download_memory_mb");
+	if (!memory.isEmpty())
+		loader->setMemoryLimit(memory.toLongLong() * 1024 * 1024);
+	QUrl url(QString("%1/%2").arg(releaseUrl()).arg(release));
+	loader->setChecksumUrl(QUrl(url.toString() + ".sha256"));
+	downloadTarget = release;
+	showProgressBar();
+	logFile(QString("DownloadRelease: %1%2").arg(url.toString()).arg(ingest ? " (ingest)" : ""));
+	if (ingest)
+		return ingest->start(url, QDir(workdir).filePath(release));
+	return loader->start(url, QDir(workdir).filePath(release));
+}
+
+void CardAssistant::releaseDownloadFinished(int err)
+{
+	Downloader *loader = ingest ? ingest->downloader() : downloader;
+	if (err) {
+		logFile(QString("DownloadRelease: %1 failed: %2").arg(downloadTarget)
+				.arg(ingest ? ingest->errorString() : loader->errorString()));
+		emit releaseDownloaded(downloadTarget, err);
+		return;
+	}
+	logFile(QString("DownloadRelease: %1 done, %2 bytes, %3 MB/s, peak rss %4 MB").arg(downloadTarget)
+			.arg(loader->size()).arg(loader->throughput(), 0, 'f', 1)
+			.arg(Downloader::peakRss() / (1024 * 1024)));
+	if (ingest) {
+		/* already extracted, only the index entry is missing */
+		releaseMembers = ingest->extractor()->members();
+		releaseInfo = ingest->extractor()->memberInfo();
+		releaseHash = ingest->archiveHash();
+		ReleaseIndex index(json->value("folder.binaries"));
+		err = indexRelease(index, downloadTarget);
+		logFile(QString("DownloadRelease: %1 extracted, %2 members").arg(downloadTarget).arg(releaseMembers.size()));
+	}
+	progress(99);
+	emit releaseDownloaded(downloadTarget, err);
 }
 
 int CardAssistant::downloadMac()
 {
-	if(!QDir::setCurrent(json->value("folder.tools"))) {
+	if(changeDirectory(json->value("folder.tools"))) {
 		logFile("CreateConfig: not change directory");
 		return -3;
 	}
 
 	QUrl url("http://fourier.bilkon.arge/MAC/random_mac_list.txt");
-	startDownload(url);
+	startDownload(url, QDir(json->value("folder.tools")).filePath("macs.txt"));
+	return 0;
 }
 
-QNetworkReply* CardAssistant::startDownload(QUrl url)
+/*
+ * With a target the reply is streamed to <target>.part as it arrives and
+ * renamed when complete, nothing bigger than the read buffer is held.
+ */
+QNetworkReply* CardAssistant::startDownload(QUrl url, const QString &target)
 {
-	connect(&manager, SIGNAL(finished(QNetworkReply*)), SLOT(downloadFinished(QNetworkReply*)));
+	/* once, every call used to stack another handler */
+	if (!managerConnected) {
+		connect(&manager, SIGNAL(finished(QNetworkReply*)), SLOT(downloadFinished(QNetworkReply*)));
+		managerConnected = true;
+	}
 	QNetworkReply *reply = manager.get(QNetworkRequest(url));
+	if (!target.isEmpty()) {
+		QFile *file = new QFile(target + ".part", reply);
+		if (!file->open(QIODevice::WriteOnly | QIODevice::Truncate))
+			logFile(QString("Download: could not open %1").arg(file->fileName()));
+		reply->setProperty("target", target);
+		reply->setReadBufferSize(DOWNLOAD_CHUNK);
+		connect(reply, SIGNAL(readyRead()), SLOT(downloadReadyRead()));
+	}
 	qDebug() << "starting download";
 	return reply;
 }
 
+void CardAssistant::downloadReadyRead()
+{
+	QNetworkReply *reply = qobject_cast<QNetworkReply *>(sender());
+	QFile *file = reply ? reply->findChild<QFile *>() : NULL;
+	if (file && file->isOpen())
+		saveDownloadFile(reply, file);
+}
+
 int CardAssistant::getUserPass()
 {
 	QString pass = json->value("PASS");
@@ -62,25 +230,34 @@ int CardAssistant::getUserPass()
 	return 0;
 }
 
-int CardAssistant::saveDownloadFile(QIODevice* data, QString targetname)
+/* copies what data has now through one fixed chunk */
+int CardAssistant::saveDownloadFile(QIODevice* data, QIODevice *file)
 {
-	QFile file(targetname);
-	if (!file.open(QIODevice::WriteOnly)) {
-		logFile( "Could not open writing");
-		return -2;
+	char chunk[DOWNLOAD_CHUNK];
+	qint64 n;
+	while ((n = data->read(chunk, sizeof(chunk))) > 0) {
+		if (file->write(chunk, n) != n) {
+			logFile("Could not write download file");
+			return -2;
+		}
 	}
-	file.write(data->readAll());
-	file.close();
 	return 0;
 }
 
 void CardAssistant::downloadFinished(QNetworkReply* reply)
 {
 	if(reply->error() == QNetworkReply::NoError){
-		if (reply->url().toString().contains("mac_list.txt"))
+		if (reply->url().toString().contains("mac_list.txt")) {
 			logFile("Mac address Download finished");
-			if (saveDownloadFile(reply, "macs.txt"))
-				return;
+			QFile *file = reply->findChild<QFile *>();
+			QString target = reply->property("target").toString();
+			if (file && file->isOpen() && !saveDownloadFile(reply, file)) {
+				file->close();
+				QFile::remove(target);
+				if (!file->rename(target))
+					logFile(QString("Download: could not rename %1").arg(file->fileName()));
+			}
+		}
 		if (reply->url().toString().contains("file_list.txt")) {
 			releaseList.clear();
 			logFile("Release Download finished");
@@ -93,94 +270,605 @@ void CardAssistant::downloadFinished(QNetworkReply* reply)
 					continue;
 				releaseList << tmp;
 			}
-			/*qDebug() <<*/ QInputDialog::getItem(parentWidget(), "Select Release File", "Releases", releaseList);
+			/* the front end picks one and calls downloadRelease() */
+			emit releaseListReady(releaseList);
 		}
 	} else {
 		qDebug() << reply->errorString();
 	}
+	reply->deleteLater();
 }
 
 int CardAssistant::runProgramLoader(const QString &script)
 {
-	QString type = json->value(QString("list.%1").arg(script));
-	showProgressBar(bar);
-
-	int err;
-	if (type == "rescue_erase.txt") {
-		err = runInstallSd();
-		progress(bar, 99);
+	CardPlan plan;
+	stageClock.start();
+	int err = stage("prepare", prepareCard(script, plan));
+	if (err)
 		return err;
+	return programCard(plan);
+}
+
+/*
+ * Host side of programming a card: needs neither the card nor the reader,
+ * so the scheduler runs it for the next card while the reader is still
+ * busy writing the current one.
+ */
+int CardAssistant::prepareCard(const QString &script, CardPlan &plan)
+{
+	Logger::setContext(mediaName(), script);
+	if (Tracer::isEnabled())
+		Tracer::setContext(mediaName(), script);
+	TRACE_SPAN("prepare");
+	plan.script = script;
+	plan.type = json->value(QString("list.%1").arg(script));
+	plan.key.clear();
+	plan.macdir.clear();
+	if (plan.type.isEmpty()) {
+		logFile(QString("Prepare: unknown recipe %1").arg(script));
+		return -1;
 	}
-	if (type == "boot_zero_SD_mac.txt") {
 
+	/* release files, config.sh and the compiled u-boot script */
+	foreach (QString name, QStringList() << "release.ramdisk" << "release.rootfs" << "release.uimage") {
+		if (!QFile::exists(json->value(name))) {
+			logFile(QString("Prepare: %1 '%2' not found").arg(name).arg(json->value(name)));
+			return -3;
+		}
 	}
-	if (type == "boot_zero_prog.txt") {
-		err = runInstallNand();					//
-		progress(bar, 99);
+	int err = createConfigScript(script);
+	if (err)
 		return err;
+	plan.stages = recipeStages(plan.type);
+
+	/*
+	 * every card gets its own addresses, leased before the reader is free
+	 * into a directory of this plan only: the card before it on the same
+	 * reader may still be running with its own lease
+	 */
+	if (plan.stages.contains("add_mac_prog")) {
+		plan.macdir = QDir(json->value("folder.tools")).filePath(
+					QString("mgen/%1-%2").arg(QFileInfo(mediaName()).fileName())
+					.arg(QUuid::createUuid().toString().mid(1, 8)));
+		err = createMacfile(1, plan.macdir);
+		if (err) {
+			dropPlan(plan);
+			return err;
+		}
 	}
-	if (type == "boot_zero_sd.txt") {
-		err = runInstallSd();						//
-		progress(bar, 99);
-		return err;
+
+	/* mac cards carry per card files, they can not be cloned */
+	if (!plan.macdir.isEmpty() || json->value("golden_cache") == "off" || !rawAccess())
+		return 0;
+	/* an erase is quicker than any clone of the erased card */
+	if (plan.type.startsWith("rescue_erase"))
+		return 0;
+	ImageCache cache(json->value("folder.binaries"));
+	plan.key = cache.key(QStringList() << json->value("release.ramdisk")
+						 << json->value("release.rootfs")
+						 << json->value("release.uimage")
+						 << QDir(json->value("folder.uboot_scripts")).filePath(plan.type)
+						 << QDir(json->value("folder.sdcard_prog")).filePath("install_sd.sh")
+						 << QDir(json->value("folder.sdcard_prog")).filePath("install_nand.sh"),
+						 plan.type);
+	return 0;
+}
+
+/*
+ * Whatever prepareCard() left on the host for this plan only, once the
+ * card is done or the plan is thrown away. Leased addresses are not given
+ * back, they may be on a card already.
+ */
+void CardAssistant::dropPlan(const CardPlan &plan)
+{
+	if (!plan.macdir.isEmpty())
+		QDir(plan.macdir).removeRecursively();
+}
+
+/* the steps that need the card, in the order the reader runs them */
+int CardAssistant::programCard(const CardPlan &plan)
+{
+	Logger::setContext(mediaName(), plan.script);
+	if (Tracer::isEnabled())
+		Tracer::setContext(mediaName(), plan.script);
+	TRACE_SPAN("program_loader");
+	showProgressBar();
+	stageClock.start();
+
+	ImageCache cache(json->value("folder.binaries"));
+	/* partitions follow the capacity, so does the image */
+	QString key = plan.key.isEmpty() ? QString() : cache.cardKey(plan.key, cardSize());
+	QString image = cloneImage(plan.key);
+	if (!image.isEmpty()) {
+		logFile(QString("ProgramLoader: cloning golden image %1%2").arg(key)
+				.arg(image.endsWith(".simg") ? " (sparse)" : ""));
+		int err = stage("write_image", runWriteImage(image));
+		if (!err)
+			err = stage("verify", runVerify(cache.imagePath(key)));
+		if (!err) {
+			progress(99);
+			return 0;
+		}
+		logFile("ProgramLoader: golden image failed, running full install");
+		showProgressBar();
 	}
-	if (type == "boot_zero_sd_prog.txt") {
-		err = runInstallNand();
-		progress(bar, 78);
-		if(!err) {
-			err = runAddNewNandProg();
-			progress(bar, 99);
-			return err;
+
+	int err = runStages(plan);
+	if (!err && !key.isEmpty() && !cache.contains(key)) {
+		int captured = cache.capture(devicePath(), key);
+		if (captured > 0)
+			logFile(QString("ProgramLoader: golden image %1 is captured by another card").arg(key));
+		else if (stage("capture", captured))
+			logFile(QString("ProgramLoader: golden image not saved: %1").arg(cache.errorString()));
+		else
+			logFile(QString("ProgramLoader: golden image %1 saved").arg(key));
+		if (cache.contains(key) && json->value("sparse_image") != "off") {
+			int built = cache.buildSparse(key);
+			if (built > 0)
+				logFile(QString("ProgramLoader: sparse image %1 is built by another card").arg(key));
+			else if (stage("sparse_build", built))
+				logFile(QString("ProgramLoader: sparse image not built: %1").arg(cache.errorString()));
 		}
-		else return err;
-	}
-	if (type == "rescue_erase_cammgr.txt") {
-		err = runInstallNand();
-		progress(bar, 99);
-	}
-	if (type == "boot_zero_sd_new_mtd.txt") {
-		err = runInstallNand();
-		progress(bar, 81);
-		if(!err) {
-			err = runAddNewNandProg();
-			progress(bar, 99);
-			return err;
+	}
+	return err;
+}
+
+/*
+ * The golden image programCard() writes for key onto this card, empty
+ * when the card is installed instead. Only reads sysfs and the cache, the
+ * scheduler asks it for the cards it dispatches.
+ */
+QString CardAssistant::cloneImage(const QString &key)
+{
+	if (key.isEmpty())
+		return QString();
+	ImageCache cache(json->value("folder.binaries"));
+	QString card = cache.cardKey(key, cardSize());
+	if (!cache.contains(card))
+		return QString();
+	if (json->value("sparse_image") != "off" && cache.containsSparse(card))
+		return cache.sparsePath(card);
+	return cache.imagePath(card);
+}
+
+/*
+ * Device stages of a recipe. Install scripts partition and fill the card
+ * themselves; the rescue recipes erase and format in process when the
+ * name u-boot loads the script by is known.
+ */
+QStringList CardAssistant::recipeStages(const QString &type)
+{
+	QStringList stages;
+	bool raw = rawAccess();
+	if (!raw)
+		logFile(QString("Install: no read/write access to %1, see README.md, the scripts do every stage")
+				.arg(devicePath()));
+	bool native = raw && json->value("native_install") == "on" && !json->value("boot_script_name").isEmpty();
+	if (raw && json->value("native_install") == "on" && !native)
+		logFile("Install: boot_script_name is not set, installing with the install script");
+	QString sdInstall = native ? "native_install" : "install_sd";
+	if (type.startsWith("rescue_erase")) {
+		/* u-boot loads the script by a name only the sdk knows, without it the scripts erase */
+		if (raw && json->value("fast_erase") != "off" && !json->value("boot_script_name").isEmpty())
+			stages << "fast_erase";
+		else {
+			if (raw && json->value("fast_erase") != "off")
+				logFile("Erase: boot_script_name is not set, erasing with the install script");
+			stages << (type == "rescue_erase.txt" ? "install_sd" : "install_nand");
 		}
-		else return err;
+	} else if (type == "boot_zero_sd.txt")
+		stages << sdInstall;
+	else if (type == "boot_zero_SD_mac.txt")
+		stages << sdInstall << "add_mac_prog";
+	else if (type == "boot_zero_prog.txt")
+		stages << "install_nand";
+	else if (type == "boot_zero_sd_prog.txt" || type == "boot_zero_sd_new_mtd.txt")
+		stages << "install_nand" << "add_nand_prog";
+	else
+		return stages;
+	QString mode = json->value("verify");
+	if (raw && (mode == "full" || mode == "sampled"))
+		stages << "verify";
+	return stages;
+}
+
+/*
+ * The in process stages (format, erase, image write, verify) open the card
+ * itself instead of running a script through sudo; the station user needs
+ * the udev rule of README.md for that.
+ */
+bool CardAssistant::rawAccess()
+{
+	return ::access(QFile::encodeName(devicePath()).constData(), R_OK | W_OK) == 0;
+}
+
+/* a stage returning more than 0 was skipped, the card goes on */
+int CardAssistant::runStages(const CardPlan &plan)
+{
+	if (plan.stages.isEmpty()) {
+		logFile(QString("ProgramLoader: %1 has no stages").arg(plan.type));
+		return -1;
+	}
+	/* filled in by the stages that place the release themselves */
+	cardLayout = CardLayout();
+	for (int i = 0; i < plan.stages.size(); i++) {
+		int err = runStage(plan.stages.at(i), plan);
+		if (err < 0)
+			return err;
+		progress(99 * (i + 1) / plan.stages.size());
+	}
+	return 0;
+}
+
+int CardAssistant::runStage(const QString &name, const CardPlan &plan)
+{
+	if (name == "format")
+		return stage(name, runFormat("green", mediaName()));
+	if (name == "fast_erase")
+		return runFastErase(plan.type);
+	if (name == "native_install")
+		return stage(name, runNativeInstall(plan.type));
+	if (name == "install_sd")
+		return stage(name, runInstallSd());
+	if (name == "install_nand")
+		return stage(name, runInstallNand());
+	if (name == "add_nand_prog")
+		return stage(name, runAddNewNandProg());
+	if (name == "add_mac_prog")
+		return stage(name, runAddMacProg(plan.macdir));
+	if (name == "verify")
+		return stage(name, runVerifyPayloads());
+	logFile(QString("ProgramLoader: unknown stage %1").arg(name));
+	return stage(name, -1);
+}
+
+/*
+ * Rescue cards only have to boot the erase ramdisk: the whole card is
+ * dropped with a discard (secure erase or zeroing where the card can not
+ * discard), formatted in process and kernel, ramdisk and the compiled
+ * boot script are copied onto the boot partition, the script under
+ * "boot_script_name" as u-boot of these boards looks for it. No install
+ * script runs.
+ */
+int CardAssistant::runFastErase(const QString &type)
+{
+	TRACE_SPAN("fast_erase");
+	QTime t;
+	t.start();
+	BlockWriter w(devicePath());
+	int err = w.open();
+	QString method;
+	qint64 bytes = w.size();
+	if (!err)
+		err = w.erase(0, bytes, json->value("erase_secure") == "on", &method);
+	if (err)
+		logFile(QString("Erase: %1").arg(w.errorString()));
+	w.close();
+	if (stage("erase", err))
+		return err;
+	logFile(QString("Erase: %1 %2 bytes by %3 in %4 ms").arg(devicePath()).arg(bytes)
+			.arg(method).arg(t.elapsed()));
+	progress(30);
+
+	QString uimage = json->value("release.uimage");
+	QString ramdisk = json->value("release.ramdisk");
+	QString script = QDir(json->value("folder.uboot_scripts")).filePath(UbootScript::scriptName(type));
+	if (uimage.isEmpty() || ramdisk.isEmpty()) {
+		logFile("Release versiyonlari yazilmamış seçili versiyon yok.");
+		return stage("format", -3);
+	}
+	CardFormatter formatter(devicePath());
+	formatter.setDiscard(false);
+	formatter.addBootFile(uimage, QFileInfo(uimage).fileName());
+	formatter.addBootFile(ramdisk, QFileInfo(ramdisk).fileName());
+	formatter.addBootFile(script, json->value("boot_script_name"));
+	err = formatter.format();
+	if (err)
+		logFile(QString("Format: %1").arg(formatter.errorString()));
+	cardLayout = err ? CardLayout() : formatter.layout();
+	return stage("format", err);
+}
+
+/*
+ * First install without install_sd.sh ("native_install": "on"): the card
+ * is partitioned and formatted in process with kernel, ramdisk and the
+ * compiled boot script (as "boot_script_name") on the boot partition and
+ * rootfs.tar.gz in the root of the system partition. Every file goes out
+ * once, sequentially, with O_DIRECT; where it went is kept for the verify
+ * stage. The target may be a plain file as well.
+ */
+int CardAssistant::runNativeInstall(const QString &type)
+{
+	TRACE_SPAN("native_install");
+	QTime t;
+	t.start();
+	cardLayout = CardLayout();
+	QString uimage = json->value("release.uimage");
+	QString ramdisk = json->value("release.ramdisk");
+	QString rootfs = json->value("release.rootfs");
+	QString script = QDir(json->value("folder.uboot_scripts")).filePath(UbootScript::scriptName(type));
+	if (uimage.isEmpty() || ramdisk.isEmpty() || rootfs.isEmpty()) {
+		logFile("Release versiyonlari yazilmamış seçili versiyon yok.");
+		return -3;
+	}
+	CardFormatter formatter(devicePath());
+	formatter.setDiscard(json->value("format_discard") != "off");
+	connect(&formatter, SIGNAL(progress(int,int)), SLOT(formatProgress(int,int)));
+	formatter.addBootFile(uimage, QFileInfo(uimage).fileName());
+	formatter.addBootFile(ramdisk, QFileInfo(ramdisk).fileName());
+	formatter.addBootFile(script, json->value("boot_script_name"));
+	formatter.addSystemFile(rootfs, QFileInfo(rootfs).fileName());
+	int err = formatter.format();
+	if (err) {
+		logFile(QString("NativeInstall: %1").arg(formatter.errorString()));
+		return err;
+	}
+	cardLayout = formatter.layout();
+	qint64 bytes = 0;
+	foreach (CardPayload payload, cardLayout.payloads)
+		bytes += payload.size;
+	logFile(QString("NativeInstall: %1, %2 bytes in %3 ms").arg(devicePath()).arg(bytes).arg(t.elapsed()));
+	return 0;
+}
+
+/*
+ * Steps run one after the other, so the time since the previous stage
+ * ended is the duration of this one. Returns err for chaining.
+ */
+int CardAssistant::stage(const QString &name, int err)
+{
+	int ms = stageClock.restart();
+	QVariantMap fields;
+	fields.insert("stage", name);
+	fields.insert("err", err);
+	fields.insert("ms", ms);
+	Logger::log("Stage", fields);
+	emit stageFinished(name, err, ms);
+	return err;
+}
+
+/*
+ * Puts a raw card image on /dev/<media> without going through the
+ * install scripts. The target may also be a plain file, which is how the
+ * writer is measured without a card. A .simg is written sparse.
+ */
+int CardAssistant::runWriteImage(const QString &image)
+{
+	TRACE_SPAN("write_image");
+	imageHoles.clear();
+	if (json->value("fanout") != "off")
+		return runWriteFanout(image);
+	if (image.endsWith(".simg"))
+		return runWriteSparse(image);
+	QString target = devicePath();
+
+	BlockWriter writer(target);
+	connect(&writer, SIGNAL(progress(qint64,qint64)), SLOT(writeProgress(qint64,qint64)));
+	if (writer.open()) {
+		logFile(QString("WriteImage: %1").arg(writer.errorString()));
+		return -3;
+	}
+	qint64 len = QFile(image).size();
+	if (writer.size() > 0 && len > writer.size()) {
+		logFile(QString("WriteImage: %1 does not fit on %2").arg(image).arg(target));
+		return -6;
+	}
+	writer.addExtent(image, 0);
+	if (writer.write()) {
+		logFile(QString("WriteImage: %1").arg(writer.errorString()));
+		return -5;
+	}
+	logFile(QString("WriteImage: %1 -> %2, %3 bytes, %4 MB/s%5")
+			.arg(image).arg(target).arg(writer.bytesWritten())
+			.arg(writer.throughput(), 0, 'f', 1)
+			.arg(writer.isDirect() ? "" : " (buffered)"));
+	return 0;
+}
+
+/*
+ * Cards writing the same image at the same time share one read of it,
+ * see FanoutWriter. A single card gets the reads overlapped with its
+ * writes.
+ */
+int CardAssistant::runWriteFanout(const QString &image)
+{
+	if (!json->value("fanout_wait").isEmpty())
+		FanoutWriter::setGatherTime(json->value("fanout_wait").toInt());
+	if (!json->value("fanout_buffers").isEmpty())
+		FanoutWriter::setBuffers(json->value("fanout_buffers").toInt());
+	QString target = devicePath();
+	FanoutWriter writer(image);
+	connect(&writer, SIGNAL(progress(qint64,qint64)), SLOT(writeProgress(qint64,qint64)));
+	/* a card pulled halfway continues behind its last synced extent */
+	QString card = json->value("resume") != "off" ? cardId() : QString();
+	/*
+	 * golden images are named by their content key already, size and mtime
+	 * tell a rebuilt one apart; no rehash of the image for every card
+	 */
+	QFileInfo info(image);
+	QString id = QString("%1:%2:%3").arg(info.fileName()).arg(info.size())
+			.arg(info.lastModified().toMSecsSinceEpoch());
+	ResumeJournal journal(json->value("folder.binaries"), card, id);
+	if (!card.isEmpty())
+		writer.setJournal(&journal);
+	else if (json->value("resume") != "off")
+		logFile(QString("WriteImage: %1 has no card id, the write can not be resumed").arg(target));
+	if (writer.write(target)) {
+		logFile(QString("WriteImage: %1").arg(writer.errorString()));
+		return -5;
+	}
+	if (writer.bytesResumed())
+		logFile(QString("WriteImage: resumed %1, %2 bytes were already on the card")
+				.arg(target).arg(writer.bytesResumed()));
+	if (image.endsWith(".simg")) {
+		SparseImage sparse(image);
+		if (!sparse.open())
+			imageHoles = sparse.holes();
+	}
+	logFile(QString("WriteImage: %1 -> %2 (%3 cards), %4 bytes, %5 MB/s%6")
+			.arg(image).arg(target).arg(writer.cards()).arg(writer.bytesWritten())
+			.arg(writer.throughput(), 0, 'f', 1)
+			.arg(writer.isDirect() ? "" : " (buffered)"));
+	return 0;
+}
+
+/* bytes on the card from sysfs, image files are opened; 0 when unknown */
+qint64 CardAssistant::cardSize()
+{
+	if (!mediaName().startsWith("/"))
+		return HotplugMonitor::device(mediaName()).size;
+	BlockWriter w(devicePath());
+	if (w.open())
+		return 0;
+	return w.size();
+}
+
+/*
+ * The CID an SD host controller shows in sysfs. USB readers do not pass
+ * it on and their serial numbers name the reader, not the card, so those
+ * cards get no id.
+ */
+QString CardAssistant::cardId()
+{
+	return HotplugMonitor::device(mediaName()).cid;
+}
+
+/* only the mapped ranges of the image go to the card, see SparseImage */
+int CardAssistant::runWriteSparse(const QString &image)
+{
+	QString target = devicePath();
+	SparseImage sparse(image);
+	if (sparse.open()) {
+		logFile(QString("WriteImage: %1").arg(sparse.errorString()));
+		return -3;
+	}
+	BlockWriter writer(target);
+	connect(&writer, SIGNAL(progress(qint64,qint64)), SLOT(writeProgress(qint64,qint64)));
+	if (writer.open()) {
+		logFile(QString("WriteImage: %1").arg(writer.errorString()));
+		return -3;
+	}
+	if (writer.size() > 0 && sparse.imageSize() > writer.size()) {
+		logFile(QString("WriteImage: %1 does not fit on %2").arg(image).arg(target));
+		return -6;
+	}
+	/* "sparse_discard": "on" hands the old contents back to the card first, only a hint */
+	if (json->value("sparse_discard") == "on" && writer.discard(0, writer.size()) < 0)
+		logFile(QString("WriteImage: %1").arg(writer.errorString()));
+	if (sparse.write(&writer)) {
+		logFile(QString("WriteImage: %1").arg(sparse.errorString()));
+		return -5;
+	}
+	imageHoles = sparse.holes();
+	logFile(QString("WriteImage: %1 -> %2, %3 of %4 bytes, %5 zeroed, %6 MB/s%7")
+			.arg(image).arg(target).arg(sparse.dataBytes()).arg(sparse.imageSize())
+			.arg(sparse.zeroBytes()).arg(writer.throughput(), 0, 'f', 1)
+			.arg(writer.isDirect() ? "" : " (buffered)"));
+	return 0;
+}
+
+/*
+ * Optional read back after a card was written from an image, "verify" in
+ * creater.json is "full", "sampled" or absent/"off".
+ */
+int CardAssistant::runVerify(const QString &image)
+{
+	TRACE_SPAN("verify");
+	QString mode = json->value("verify");
+	if (mode != "full" && mode != "sampled")
+		return 0;
+
+	CardVerifier verifier(devicePath(), image);
+	verifier.setMode(CardVerifier::mode(mode));
+	verifier.setIgnored(imageHoles);
+	if (!json->value("verify_samples").isEmpty())
+		verifier.setSamples(json->value("verify_samples").toInt());
+	connect(&verifier, SIGNAL(progress(qint64,qint64)), SLOT(writeProgress(qint64,qint64)));
+	showProgressBar();
+	int err = verifier.verify();
+	if (err) {
+		logFile(QString("Verify: %1").arg(verifier.errorString()));
+		return err == -5 ? -8 : -2;
+	}
+	logFile(QString("Verify: %1 %2 ok, %3 bytes, %4 MB/s").arg(mode).arg(devicePath())
+			.arg(verifier.bytesRead()).arg(verifier.throughput(), 0, 'f', 1));
+	return 0;
+}
+
+/*
+ * Read back of a card made by the stages, against the source files: the
+ * release files are hashed where the formatter put them. The install
+ * scripts do not tell where their copies went, a card they made is not
+ * compared (returns 1). A golden image is only captured from a card that
+ * passed, its clones are compared with the image by runVerify().
+ */
+int CardAssistant::runVerifyPayloads()
+{
+	TRACE_SPAN("verify");
+	QString mode = json->value("verify");
+	if (mode != "full" && mode != "sampled")
+		return 0;
+	if (cardLayout.payloads.isEmpty()) {
+		logFile(QString("Verify: %1 was made by the install scripts, nothing to compare").arg(devicePath()));
+		return 1;
+	}
+
+	CardVerifier verifier(devicePath(), QString());
+	verifier.setMode(CardVerifier::mode(mode));
+	foreach (CardPayload payload, cardLayout.payloads)
+		verifier.addPayload(payload.source, payload.offset, payload.from, payload.size);
+	if (!json->value("verify_samples").isEmpty())
+		verifier.setSamples(json->value("verify_samples").toInt());
+	connect(&verifier, SIGNAL(progress(qint64,qint64)), SLOT(writeProgress(qint64,qint64)));
+	int err = verifier.verify();
+	if (err) {
+		logFile(QString("Verify: %1").arg(verifier.errorString()));
+		return err == -5 ? -8 : -2;
 	}
+	logFile(QString("Verify: %1 %2 ok against %3 release file pieces, %4 bytes, %5 MB/s").arg(mode)
+			.arg(devicePath()).arg(cardLayout.payloads.size()).arg(verifier.bytesRead())
+			.arg(verifier.throughput(), 0, 'f', 1));
 	return 0;
 }
 
-int CardAssistant::runAddMacProg(const qint8 numberOfSd)
+void CardAssistant::writeProgress(qint64 written, qint64 total)
 {
-	if(!QDir::setCurrent(json->value("folder.sdcard_prog"))) {
+	if (total > 0)
+		progress(written * 99 / total);
+}
+
+int CardAssistant::runAddMacProg(const QString &macdir)
+{
+	TRACE_SPAN("add_mac_prog");
+	if(changeDirectory(json->value("folder.sdcard_prog"))) {
 		logFile("CreateConfig: not change directory");
 		return -3;
 	}
 
-	if (numberOfSd == 0) {
-		logFile("Error number of sd");
+	if (QDir(macdir).entryList(QDir::Files).isEmpty()) {
+		logFile(QString("Error no mac file in %1").arg(macdir));
 		return -6;
 	}
 
 	QString pass = json->value("PASS");
-	QString device = QString("%1-2").arg(json->value("current.media")).remove("-");
-	QString cmd = QString("echo %1 | sudo -S ./add_macprog_sd.sh /dev/%2 ../mgen %3 2>&1").arg(pass).arg(device).arg(QString::number(numberOfSd));
+	QString device = QString("%1-2").arg(mediaName()).remove("-");
+	/* the card's own lease is file 1 of its directory */
+	QString cmd = QString("echo %1 | sudo -S ./add_macprog_sd.sh /dev/%2 %3 1 2>&1").arg(pass).arg(device).arg(macdir);
 
-	int err = processRun(cmd);
+	int err = processRun(cmd, INSTALL_TIMEOUT, QStringList() << "cp --help" << "wrong fs type");
 	if (err) {
-		logFile("Process Error");
-		return -2;
+		logFile(err == -7 ? "Process Timeout" : "Process Error");
+		return err == -7 ? -7 : -2;
 	} else
 		logFile(QString("Process %1").arg(cmd));
 	QString data = p->readAllStandardOutput().data();
 	if(data.contains("cp --help")) {
 		logFile("Copy Error");
-		logFile(data);
+		logOutput(data);
 		return -5;
 	} else if(data.contains("wrong fs type")) {
 		logFile("Mount Error");
-		logFile(data);
+		logOutput(data);
 		return -5;
 	}
 	return 0;
@@ -188,29 +876,30 @@ int CardAssistant::runAddMacProg(const qint8 numberOfSd)
 
 int CardAssistant::runAddNewNandProg()
 {
-	if(!QDir::setCurrent(json->value("folder.sdcard_prog"))) {
+	TRACE_SPAN("add_new_nand_prog");
+	if(changeDirectory(json->value("folder.sdcard_prog"))) {
 		logFile("CreateConfig: not change directory");
 		return -3;
 	}
 
 	QString pass = json->value("PASS");
-	QString device = QString("%1-2").arg(json->value("current.media")).remove("-");
+	QString device = QString("%1-2").arg(mediaName()).remove("-");
 	QString cmd = QString("echo %1 | sudo -S ./add_newnandprog_sd.sh /dev/%2 2>&1").arg(pass).arg(device);
 
-	int err = processRun(cmd);
+	int err = processRun(cmd, INSTALL_TIMEOUT, QStringList() << "cp --help" << "wrong fs type");
 	if (err) {
-		logFile("Process Error");
-		return -2;
+		logFile(err == -7 ? "Process Timeout" : "Process Error");
+		return err == -7 ? -7 : -2;
 	} else
 		logFile(QString("Process %1").arg(cmd));
 	QString data = p->readAllStandardOutput().data();
 	if(data.contains("cp --help")) {
 		logFile("Copy Error");
-		logFile(data);
+		logOutput(data);
 		return -5;
 	} else if(data.contains("wrong fs type")) {
 		logFile("Mount Error");
-		logFile(data);
+		logOutput(data);
 		return -5;
 	}
 	return 0;
@@ -218,29 +907,30 @@ int CardAssistant::runAddNewNandProg()
 
 int CardAssistant::runAddNandProg()
 {
-	if(!QDir::setCurrent(json->value("folder.sdcard_prog"))) {
+	TRACE_SPAN("add_nand_prog");
+	if(changeDirectory(json->value("folder.sdcard_prog"))) {
 		logFile("CreateConfig: not change directory");
 		return -3;
 	}
 
 	QString pass = json->value("PASS");
-	QString device = QString("%1-2").arg(json->value("current.media")).remove("-");
+	QString device = QString("%1-2").arg(mediaName()).remove("-");
 	QString cmd = QString("echo %1 | sudo -S ./add_nandprog_sd.sh /dev/%2 2>&1").arg(pass).arg(device);
 
-	int err = processRun(cmd);
+	int err = processRun(cmd, INSTALL_TIMEOUT, QStringList() << "cp --help" << "wrong fs type");
 	if (err) {
-		logFile("Process Error");
-		return -2;
+		logFile(err == -7 ? "Process Timeout" : "Process Error");
+		return err == -7 ? -7 : -2;
 	} else
 		logFile(QString("Process %1").arg(cmd));
 	QString data = p->readAllStandardOutput().data();
 	if(data.contains("cp --help")) {
 		logFile("Copy Error");
-		logFile(data);
+		logOutput(data);
 		return -5;
 	} else if(data.contains("wrong fs type")) {
 		logFile("Mount Error");
-		logFile(data);
+		logOutput(data);
 		return -5;
 	}
 	return 0;
@@ -248,25 +938,25 @@ int CardAssistant::runAddNandProg()
 
 int CardAssistant::runInstallNand()
 {
-	if(!QDir::setCurrent(json->value("folder.sdcard_prog"))) {
+	TRACE_SPAN("install_nand");
+	if(changeDirectory(json->value("folder.sdcard_prog"))) {
 		logFile("CreateConfig: not change directory");
 		return -3;
 	}
 
 	QString pass = json->value("PASS");
-	QString device = json->value("current.media");
-	QString cmd = QString("echo %1 | sudo -S ./install_nand.sh /dev/%2 2>&1").arg(pass).arg(device);
+	QString cmd = QString("echo %1 | sudo -S ./install_nand.sh %2 2>&1").arg(pass).arg(devicePath());
 
-	int err = processRun(cmd);
+	int err = processRun(cmd, INSTALL_TIMEOUT, QStringList() << "missing" << "error" << "target");
 	if (err) {
-		logFile("Process Error");
-		return -2;
+		logFile(err == -7 ? "Process Timeout" : "Process Error");
+		return err == -7 ? -7 : -2;
 	} else
 		logFile(QString("Process %1").arg(cmd));
 	QString data = p->readAllStandardOutput().data();
 	if (data.contains("missing") | data.contains("error") | data.contains("target")) {
 		logFile("Install Sd Scripts Error");
-		logFile(data);
+		logOutput(data);
 		return -4;
 	}
 	return 0;
@@ -274,84 +964,80 @@ int CardAssistant::runInstallNand()
 
 int CardAssistant::runInstallSd()
 {
-	if(!QDir::setCurrent(json->value("folder.sdcard_prog"))) {
+	TRACE_SPAN("install_sd");
+	if(changeDirectory(json->value("folder.sdcard_prog"))) {
 		logFile("CreateConfig: not change directory");
 		return -3;
 	}
 	QString pass = json->value("PASS");
-	QString device = json->value("current.media");
-	QString cmd = QString("echo %1 | sudo -S ./install_sd.sh /dev/%2 2>&1").arg(pass).arg(device);
+	QString cmd = QString("echo %1 | sudo -S ./install_sd.sh %2 2>&1").arg(pass).arg(devicePath());
 
-	int err = processRun(cmd);
+	int err = processRun(cmd, INSTALL_TIMEOUT, QStringList() << "missing" << "error" << "target");
 	if (err) {
-		logFile("Process Error");
-		return -2;
+		logFile(err == -7 ? "Process Timeout" : "Process Error");
+		return err == -7 ? -7 : -2;
 	} else
 		logFile(QString("Process %1").arg(cmd));
 
 	QString data = p->readAllStandardOutput().data();
 	if (data.contains("missing") | data.contains("error") | data.contains("target")) {
 		logFile("Install Sd Scripts Error");
-		logFile(data);
+		logOutput(data);
 		return -4;
 	}
 	return 0;
 }
 
-int CardAssistant::createMacfile(const QString &numOfMacFile)
-{
-	json->insert("current.num_of_mac_files", numOfMacFile);
+/* host workers of this process lease one at a time, other processes wait on the pool's flock */
+static QMutex macLock;
 
-	if(!QDir::setCurrent(json->value("folder.tools"))) {
+/* leases files of 250 addresses each into outdir, replacing what was there */
+int CardAssistant::createMacfile(int files, const QString &outdir)
+{
+	TRACE_SPAN("create_mac_file");
+	QMutexLocker locker(&macLock);
+	if(changeDirectory(json->value("folder.tools"))) {
 		logFile("Format: not change directory");
 		return -3;
 	}
 
-	if(processRun("rm -rf mgen"))
+	MacPool pool(workdir);
+	if (pool.open()) {
+		logFile(QString("Create Mac File: Error ~ %1").arg(pool.errorString()));
 		return -2;
-	if (!processRun("cat macs.txt | wc -l")) {
-		QString number = p->readAllStandardOutput().data();
-		if (numOfMacFile.toInt() * 250 > number.toInt()) {
-			logFile("Create Mac File: Error ~  insufficient number of mac");
-			return -6;
+	}
+	/* a freshly downloaded list goes into the pool first */
+	QString macs = QDir(workdir).filePath("macs.txt");
+	if (QFile::exists(macs)) {
+		int imported = pool.importText(macs);
+		if (imported < 0) {
+			logFile(QString("Create Mac File: Error ~ %1").arg(pool.errorString()));
+			return -2;
 		}
+		logFile(QString("Create Mac File: %1 mac imported").arg(imported));
 	}
 
-	QString cmd = QString("./create_macaddr.sh macs.txt mgen/ 250 %1").arg(numOfMacFile);
-	int err = processRun(cmd);
-	if(err) {
-		logFile("Process Error");
-		return -2;
-	} else
-		logFile(QString("Process %1").arg(cmd));
-
-	QString data = p->readAllStandardOutput().data();
-	if(data.contains("Destination already exists, doing nothing")) {
-		logFile("Create Mac File: Error ~ Destination already exists, doing nothing");
-		return -4;
-	}
-	if (data.contains("Please select a source file")) {
-		logFile("Create Mac File: Error ~ Please select a source file");
-		return -5;
-	}
-	if (!processRun("ls mgen/ | wc -l")) {
-		QString number = p->readAllStandardOutput().data();
-		if (number.toInt() != numOfMacFile.toInt()) {
-			logFile("Create Mac File: Error ~  insufficient number of mac");
-			return -6;
-		}
+	int numberOfFiles = files;
+	if (numberOfFiles * 250 > pool.available()) {
+		logFile("Create Mac File: Error ~  insufficient number of mac");
+		return -6;
 	}
 
-	qint16 numberOfMacs = 250 * numOfMacFile.toInt();
-	if(!processRun(QString("head -%1 macs.txt >> oldmacs.txt 2>&1").arg(QString::number(numberOfMacs)))) {
-		qDebug() << p->readAllStandardOutput().data();
-		if (!processRun(QString("sed -i '1,%1d' macs.txt 2>&1").arg(numberOfMacs))) {
-			qDebug() << QString("sed -i '1,%1d' macs.txt").arg(numberOfMacs);
-			logFile("Deleting Macs and fixed...");
-		} else
-			return -2;
-	} else
+	QDir mgen(outdir);
+	if (mgen.exists() && !mgen.removeRecursively())
+		return -2;
+	QString pattern = json->value("mac_file_pattern");
+	if (pattern.isEmpty())
+		pattern = "mac%1.txt";
+	int err = pool.lease(numberOfFiles, 250, mgen.path(), pattern);
+	if (err == -6) {
+		logFile("Create Mac File: Error ~  insufficient number of mac");
+		return -6;
+	} else if (err) {
+		logFile(QString("Create Mac File: Error ~ %1").arg(pool.errorString()));
 		return -2;
+	}
+	logFile(QString("Create Mac File: %1 files, %2 mac left").arg(numberOfFiles).arg(pool.available()));
 	return 0;
 }
 
@@ -365,31 +1051,24 @@ void CardAssistant::timeout()
 
 }
 
-QWidget *CardAssistant::parentWidget()
-{
-	return (QWidget *)parent();
-}
-
 void CardAssistant::finished(int state)
 {
 	if (state == 0)
 		emit finishedJob();
 }
 
+/*
+ * config.sh is read by the install scripts of every reader, so it is
+ * replaced in one rename; one recipe per station at a time.
+ */
 int CardAssistant::createConfigScript(const QString &script)
 {
-	if(!QDir::setCurrent(json->value("folder.sdcard_prog"))) {
+	TRACE_SPAN("create_config_script");
+	if(changeDirectory(json->value("folder.sdcard_prog"))) {
 		logFile("CreateConfig: not change directory");
 		return -3;
 	}
-	QString config = "config.sh";
-	QFile f(config);
-	if (!f.open(QIODevice::WriteOnly | QIODevice::Text)) {
-		logFile(QString("error writing test script '%1'").arg(config));
-		return -2;
-	}
-	f.write("#!/bin/bash\n\n");
-	f.write("\n");
+	QString config = QDir(workdir).filePath("config.sh");
 
 	/* Versiyon check */
 	QString ramdisk = json->value("release.ramdisk");
@@ -400,9 +1079,6 @@ int CardAssistant::createConfigScript(const QString &script)
 		logFile("Release versiyonlari yazilmamış seçili versiyon yok.");
 		return -3;
 	}
-	f.write(QString("ramdisk=%1\n").arg(ramdisk).toUtf8());
-	f.write(QString("rootfs=%1\n").arg(rootfs).toUtf8());
-	f.write(QString("kernel=%1\n").arg(uimage).toUtf8());
 
 	/* uboot_scripts check */
 	int err = ubootScriptsCreate(script);
@@ -411,179 +1087,310 @@ int CardAssistant::createConfigScript(const QString &script)
 		return -4;
 	}
 	QString ubootscr = json->value(QString("list.%1").arg(script)).replace("txt", "scr");
+
+	QTemporaryFile f(config + ".XXXXXX.tmp");
+	if (!f.open()) {
+		logFile(QString("error writing test script '%1'").arg(config));
+		return -2;
+	}
+	f.write("#!/bin/bash\n\n");
+	f.write("\n");
+	f.write(QString("ramdisk=%1\n").arg(ramdisk).toUtf8());
+	f.write(QString("rootfs=%1\n").arg(rootfs).toUtf8());
+	f.write(QString("kernel=%1\n").arg(uimage).toUtf8());
 	f.write("\n");
 	f.write(QString("ubootscr=u-boot-scripts/%1\n").arg(ubootscr).toUtf8());
-
-	f.close();
+	f.flush();
+	if (!f.setPermissions(f.permissions() | QFile::ReadOther | QFile::ReadGroup) ||
+			::rename(QFile::encodeName(f.fileName()).constData(), QFile::encodeName(config).constData())) {
+		logFile(QString("error writing test script '%1'").arg(config));
+		return -2;
+	}
+	f.setAutoRemove(false);
 	return 0;
 }
 
 int CardAssistant::ubootScriptsCreate(const QString &script)
 {
-	if(!QDir::setCurrent(json->value("folder.uboot_scripts"))) {
+	TRACE_SPAN("uboot_script");
+	if(changeDirectory(json->value("folder.uboot_scripts"))) {
 		logFile("U-boot-Create: not change directory");
 		return -3;
 	}
 	QString bootTxt = json->value(QString("list.%1").arg(script));
-	QString tmp = bootTxt;
-	QString bootScr = tmp.replace("txt", "scr");
-	processRun(QString("rm %1").arg(bootScr));
-
-	QString compileBootCmd = QString("mkimage -A arm -O linux -T script -d %1 %2").arg(bootTxt).arg(bootScr);
 
-	int err = processRun(compileBootCmd);
-	if(err)
-		logFile("Process error");
+	/* cached by source hash, normally already built by releaseParse() */
+	UbootScript uboot(workdir);
+	if (uboot.compile(bootTxt)) {
+		logFile(QString("Error = uboot Scripts Create: %1").arg(uboot.errorString()));
+		return -1;
+	}
+	json->insert("current.sd_types", script);
+	return 0;
+}
 
-	QString data = p->readAllStandardOutput().data();
-	if (data.contains("ARM Linux Script")) {
-		json->insert("current.sd_types", script);
-		return 0;
+/* every recipe of list.* at once, so picking one later costs nothing */
+int CardAssistant::ubootScriptsCompileAll()
+{
+	TRACE_SPAN("uboot_scripts_all");
+	if(changeDirectory(json->value("folder.uboot_scripts"))) {
+		logFile("U-boot-Create: not change directory");
+		return -3;
 	}
-	else {
-		logFile("Error = uboot Scripts Create");
+	QStringList txts;
+	QJsonObject list = json->valueObject("list");
+	foreach (QString key, list.keys())
+		txts << list.value(key).toString();
+
+	UbootScript uboot(workdir);
+	if (uboot.compileAll(txts)) {
+		logFile(QString("Error = uboot Scripts Create: %1").arg(uboot.errorString()));
 		return -1;
 	}
+	return 0;
 }
 
 int CardAssistant::releaseParse(QString release)
 {
-	int tarstate;
-	int filestate = checkReleaseFile(release);
+	TRACE_SPAN("release_parse");
+	ReleaseIndex index(json->value("folder.binaries"));
+	ubootScriptsCompileAll();
+	/* indekste varsa ve dosyalar sağlamsa tekrar açma */
+	if (!useRelease(index, release))
+		return 0;
+
 	/* dosya yok ise hatalıysa */
-	if (filestate)
-		tarstate = untarRelease(release);
-	else
-		return getConfigPath(release);
-	/* tar açma hatalı değilse */
-	if (!tarstate)
-		return getConfigPath(release);
-	return -1;
+	if (untarRelease(release))
+		return -1;
+	return indexRelease(index, release);
+}
+
+/* config paths and index entry of a just extracted release */
+int CardAssistant::indexRelease(ReleaseIndex &index, const QString &release)
+{
+	int err = getConfigPath(release);
+	if (err)
+		return err;
+	if (index.record(release, releaseHash, releaseInfo,
+					 json->value("current.firmware_version"), json->value("current.date")))
+		logFile("ReleaseParse: release index not saved");
+	return 0;
+}
+
+/* takes the release paths and version from the index, -1 if it is unknown */
+int CardAssistant::useRelease(ReleaseIndex &index, const QString &release)
+{
+	QJsonObject entry = index.lookup(release);
+	if (entry.isEmpty())
+		return -1;
+	QString ramdisk = index.memberPath(release, "ramdisk_zero.gz");
+	QString rootfs = index.memberPath(release, "rootfs.tar.gz");
+	QString uimage = index.memberPath(release, "uImage");
+	if (ramdisk.isEmpty() | rootfs.isEmpty() | uimage.isEmpty())
+		return -1;
+
+	json->insert("current.date", entry.value("date").toString());
+	json->insert("current.firmware_version", entry.value("firmware_version").toString());
+	json->insert("release.uimage", uimage);
+	json->insert("release.rootfs", rootfs);
+	json->insert("release.ramdisk", ramdisk);
+	logFile(QString("ReleaseParse: %1 from index").arg(release));
+	return 0;
 }
 
 int CardAssistant::checkReleaseFile(const QString release)
 {
-	if(!QDir::setCurrent(json->value("folder.binaries"))) {
+	if(changeDirectory(json->value("folder.binaries"))) {
 		logFile("CheckReleaseFile: not change directory");
 		return -3;
 	}
 
 	QString releasename = release.split(".").first();
-	int err = processRun(QString("ls %1/ramdisk_zero.gz %1/rootfs.tar.gz %1/uImage | wc -l").arg(releasename));
-	if (err)
-		logFile("Process error");
-	QString data = p->readAllStandardOutput().data();
-	if (data.split("\n").first() == "3") {
-		logFile("CheckReleaseFile: File is open");
-		return 0;
-	}
-	else return -1;
+	if (releasePath(releasename, "ramdisk_zero.gz").isEmpty() |
+			releasePath(releasename, "rootfs.tar.gz").isEmpty() |
+			releasePath(releasename, "uImage").isEmpty())
+		return -1;
+	logFile("CheckReleaseFile: File is open");
+	return 0;
 }
 
 int CardAssistant::untarRelease(QString release)
 {
-	QDir dir;
-	QString path = json->value("folder.binaries");
-	dir.setCurrent(path);
+	TRACE_SPAN("untar_release");
+	if(changeDirectory(json->value("folder.binaries"))) {
+		logFile("UntarRelease: not change directory");
+		return -3;
+	}
 
-	int err = p->execute("tar", QStringList() << "xf" << release);
-	return err;
+	QTime t;
+	t.start();
+	showProgressBar();
+	TarExtractor tar(QDir(workdir).filePath(release), workdir);
+	connect(&tar, SIGNAL(progress(qint64,qint64)), SLOT(writeProgress(qint64,qint64)));
+	if (tar.extract()) {
+		logFile(QString("UntarRelease: %1").arg(tar.errorString()));
+		return -2;
+	}
+	releaseMembers = tar.members();
+	releaseInfo = tar.memberInfo();
+	releaseHash = tar.archiveHash();
+	logFile(QString("UntarRelease: %1 members, %2 bytes in %3 ms")
+			.arg(releaseMembers.size()).arg(tar.bytesExtracted()).arg(t.elapsed()));
+	progress(99);
+	return 0;
+}
+
+/*
+ * Full path of a release file. Right after an extraction the member list
+ * answers this, otherwise the file system does.
+ */
+QString CardAssistant::releasePath(const QString &releasename, const QString &file)
+{
+	QString member = QString("%1/%2").arg(releasename).arg(file);
+	QString path = QDir(json->value("folder.binaries")).filePath(member);
+	if (!releaseMembers.isEmpty()) {
+		if (releaseMembers.contains(member) || releaseMembers.contains("./" + member))
+			return path;
+	}
+	if (QFile::exists(path))
+		return path;
+	return QString();
 }
 
 int CardAssistant::getConfigPath(QString release)
 {
-	QString path = json->value("folder.binaries");
-	if(!QDir::setCurrent(json->value("folder.binaries"))) {
+	TRACE_SPAN("config_path");
+	if(changeDirectory(json->value("folder.binaries"))) {
 		logFile("ConfigPath: not change directory");
 		return -3;
 	}
-	QString ramdisk;
-	QString rootfs;
-	QString uimage;
 	QString releasename = release.split(".").first(); /* split tar */
 	/* Get release_date */
 	json->insert("current.date",releasename.split("_").at(1));
 
 	/* Get Firmware_version */
-	processRun(QString("cat %1/encsoft/device_info.json | grep -i \"firmware_version\"").arg(releasename));
-	QString firmware = p->readAllStandardOutput().data();
+	QString firmware;
+	QFile info(QDir(workdir).filePath(QString("%1/encsoft/device_info.json").arg(releasename)));
+	if (info.open(QIODevice::ReadOnly | QIODevice::Text)) {
+		foreach (QString line, QString(info.readAll()).split("\n")) {
+			if (line.contains("firmware_version", Qt::CaseInsensitive)) {
+				firmware = line + "\n";
+				break;
+			}
+		}
+	}
 	if (firmware.isEmpty())
 		json->insert("current.firmware_version", releasename);
 	else
 		json->insert("current.firmware_version", firmware.split(":").at(1));
-	/* ramdisk_zero path */
-	int err = processRun(QString("ls %1/ramdisk_zero.gz").arg(releasename));
-	if (err)
-		logFile("Process Error");
-	QString data = p->readAllStandardOutput().data();
-	if (!data.isEmpty())
-		ramdisk = QString("%1/%2").arg(path).arg(data);
-	/* rootfs path*/
-	err = processRun(QString("ls %1/rootfs.tar.gz").arg(releasename));
-	if (err)
-		logFile("Process Error");
-	data = p->readAllStandardOutput().data();
-	if(!data.isEmpty())
-		rootfs = QString("%1/%2").arg(path).arg(data);
-	/* uImage path */
-	err = processRun(QString("ls %1/uImage").arg(releasename));
-	if (err)
-		logFile("Process Error");
-	data = p->readAllStandardOutput().data();
-	if(!data.isEmpty())
-		uimage = QString("%1/%2").arg(path).arg(data);
 
-	err = json->insert("release.uimage", uimage.split("\n").at(0));
+	QString ramdisk = releasePath(releasename, "ramdisk_zero.gz");
+	QString rootfs = releasePath(releasename, "rootfs.tar.gz");
+	QString uimage = releasePath(releasename, "uImage");
+
+	int err = json->insert("release.uimage", uimage);
 	if (err)
 		return -3;
-	err = json->insert("release.rootfs", rootfs.split("\n").at(0));
+	err = json->insert("release.rootfs", rootfs);
 	if (err)
 		return -3;
-	err = json->insert("release.ramdisk", ramdisk.split("\n").at(0));
+	err = json->insert("release.ramdisk", ramdisk);
 	if (err)
 		return -3;
 	return 0;
 }
 
+/*
+ * Partitions and formats the card with the sdk's format.sh through sudo.
+ * With "format": "inprocess" and write access to the card (README.md)
+ * CardFormatter does it instead.
+ */
 int CardAssistant::runFormat(const QString &status, const QString &cardtype)
 {
+	TRACE_SPAN("format");
 	if (status.contains("gray"))
 		return -1;
 	QTime t;
 	t.start();
-	showProgressBar(bar);
-	if(!QDir::setCurrent(json->value("folder.sdcard_prog"))) {
-		logFile("Format: not change directory");
-		return -3;
-	}
+	showProgressBar();
 
+	/* "sdb 29,7G": the size is only shown, any capacity is formatted */
 	QStringList flds = cardtype.split(" ");
 	flds.removeAll("");
+	if (flds.isEmpty())
+		return -1;
 	QString card = flds.at(0);
-	QString size = flds.at(1);
+	QString target = card.startsWith("/") ? card : QString("/dev/%1").arg(card);
+	cardLayout = CardLayout();
+	if (json->value("format") != "inprocess")
+		return runFormatScript(card, target);
+	if (::access(QFile::encodeName(target).constData(), R_OK | W_OK)) {
+		logFile(QString("Format: no read/write access to %1, see README.md, formatting with format.sh")
+				.arg(target));
+		return runFormatScript(card, target);
+	}
 
-	if (size.split(",").at(0).toInt() > 8)
-		return -1;
-	QString pass = json->value("PASS");
-	QString cmdFormat = QString("./format.sh /dev/%1").arg(card);
-	int err =  processRun(QString("echo %1 | sudo -S %2 2>&1").arg(pass).arg(cmdFormat));
-	if (err)
-		logFile("Process Error ");
-	while(!p->readAllStandardOutput().isEmpty()) {
-		progress(bar, t.elapsed());
+	CardFormatter formatter(target);
+	formatter.setDiscard(json->value("format_discard") != "off");
+	connect(&formatter, SIGNAL(progress(int,int)), SLOT(formatProgress(int,int)));
+	int err = formatter.format();
+	if (err) {
+		logFile(QString("Format: %1").arg(formatter.errorString()));
+		return err;
+	}
+	cardLayout = formatter.layout();
+	QStringList parts;
+	for (int i = 0; i < cardLayout.partitions.size(); i++) {
+		MbrPartition p = cardLayout.partitions[i];
+		parts << QString("%1:%2@%3+%4").arg(p.index).arg(cardLayout.filesystems.value(i))
+				 .arg(p.start).arg(p.size);
 	}
+	logFile(QString("Format: %1 %2 in %3 ms").arg(target).arg(parts.join(" ")).arg(t.elapsed()));
+	progress(99);
+	return 0;
+}
 
-	int i = 0;
-	foreach (QString tmp, insertMediaInit()) {
-		if (tmp.contains(card))
-			i++;
+int CardAssistant::runFormatScript(const QString &card, const QString &target)
+{
+	QTime t;
+	t.start();
+	if(changeDirectory(json->value("folder.sdcard_prog"))) {
+		logFile("Format: not change directory");
+		return -3;
 	}
-	if (i == 4) {
-		progress(bar, 99);
+	QString pass = json->value("PASS");
+	QString cmdFormat = QString("./format.sh %1").arg(target);
+	outputLines = 0;
+	connect(p, SIGNAL(lineReady(QString)), SLOT(outputProgress()));
+	int err =  processRun(QString("echo %1 | sudo -S %2 2>&1").arg(pass).arg(cmdFormat), INSTALL_TIMEOUT);
+	disconnect(p, SIGNAL(lineReady(QString)), this, SLOT(outputProgress()));
+	if (err)
+		logFile("Process Error ");
+	logFile(QString("Format: %1 ms").arg(t.elapsed()));
+
+	/* format.sh lays out three partitions, read them back from the MBR */
+	cardLayout.partitions = readMbr(target);
+	/* no read access to the card, ask the kernel instead */
+	int parts = cardLayout.partitions.size();
+	if (!parts && !card.startsWith("/"))
+		parts = HotplugMonitor::device(card).partitions.size();
+	if (parts == 3) {
+		progress(99);
 		return 0;
 	} else return -1;
 }
 
+/* partitions of the last runFormat(), empty when it failed */
+CardLayout CardAssistant::formatLayout()
+{
+	return cardLayout;
+}
+
+void CardAssistant::formatProgress(int done, int total)
+{
+	progress(done * 99 / qMax(1, total));
+}
+
 QStringList CardAssistant::versionTypesInit()
 {
 	QStringList versiontypes;
@@ -610,23 +1417,19 @@ QStringList CardAssistant::SDCardTypesInit()
 	return cardtypes;
 }
 
+/*
+ * Same "name size" lines lsblk used to give us, read from sysfs so the
+ * hotplug refresh does not spawn a process.
+ */
 QStringList CardAssistant::insertMediaInit()
 {
-	int err = processRun("lsblk -o NAME,SIZE");
-	if (err)
-		logFile("Process Error ");
-	QString data = p->readAllStandardOutput().data();
-	QStringList flds = data.split("\n");
+	TRACE_SPAN("media_scan");
 	QStringList mediaList;
-	foreach (QString tmp, flds) {
-		tmp.remove("└─");
-		tmp.remove("├─");
-		if (tmp.contains("sda"))
-			continue;
-		if(tmp.contains("sdb"))
-			mediaList << tmp;
-		if (tmp.contains("mmc"))
-			mediaList << tmp;
+	foreach (CardDevice dev, HotplugMonitor::scan()) {
+		mediaList << QString("%1 %2").arg(dev.name).arg(dev.sizeText());
+		for (int i = 0; i < dev.partitions.size(); i++)
+			mediaList << QString("%1 %2").arg(dev.partitions.at(i))
+						 .arg(CardDevice::sizeText(dev.partitionSizes.at(i)));
 	}
 
 	if (mediaList.isEmpty()) {
@@ -636,12 +1439,27 @@ QStringList CardAssistant::insertMediaInit()
 	return mediaList;
 }
 
-int CardAssistant::processRun(const QString &cmd)
+/* script or program a command line runs, never its arguments (password) */
+static QString commandName(const QString &cmd)
+{
+	QStringList words = cmd.split(" ", QString::SkipEmptyParts);
+	foreach (QString word, words)
+		if (word.endsWith(".sh"))
+			return QFileInfo(word).fileName();
+	return words.isEmpty() ? QString() : words.first();
+}
+
+int CardAssistant::processRun(const QString &cmd, int timeout, const QStringList &errors)
 {
+	TraceSpan span(Tracer::isEnabled() ? Tracer::intern("process " + commandName(cmd)) : "process");
+	QString tmpscr;
+	p->setWorkingDirectory(workdir);
+	p->setTimeout(timeout);
+	p->setErrorPatterns(errors);
 	if (!cmd.contains("|")) {
 		p->start(cmd);
 	} else {
-		QString tmpscr = QString("/tmp/btt_process_%1.sh").arg(QUuid::createUuid().toString().split("-").first().remove("{"));
+		tmpscr = QString("/tmp/btt_process_%1.sh").arg(QUuid::createUuid().toString().split("-").first().remove("{"));
 		QFile f(tmpscr);
 		if (!f.open(QIODevice::WriteOnly | QIODevice::Text)) {
 			logFile(QString("error writing test script '%1'").arg(tmpscr));
@@ -650,32 +1468,97 @@ int CardAssistant::processRun(const QString &cmd)
 		f.write("#!/bin/bash\n\n");
 		f.write(cmd.toUtf8());
 		f.write("\n");
+		f.setPermissions(f.permissions() | QFile::ExeOwner);
 		f.close();
-		QProcess::execute(QString("chmod +x %1").arg(tmpscr));
 		p->start(tmpscr);
 	}
-	if (!p->waitForStarted())
-		return -1;
-	p->waitForFinished();
+	int err = p->wait();
+	span.setStatus(err);
+	if (!tmpscr.isEmpty())
+		QFile::remove(tmpscr);
+	if (err == -7)
+		logFile(QString("Process timeout after %1 ms: %2").arg(timeout).arg(cmd));
+	return err;
+}
 
-	return 0;
+bool CardAssistant::isBusy()
+{
+	return p->isRunning();
+}
+
+/* reported the moment the line is printed, not after the script exits */
+void CardAssistant::processErrorLine(const QString &line)
+{
+	logFile(QString("Process output error: %1").arg(line));
+}
+
+void CardAssistant::outputProgress()
+{
+	outputLines++;
+	progress(qMin(95, outputLines));
+}
+
+/*
+ * Lines go to the background logger, the calling job never waits for the
+ * file. "log_max_mb" and "log_keep" control rotation of "log_path".
+ */
+void CardAssistant::initLog()
+{
+	Logger::setPath(json->value("log_path"));
+	QString max = json->value("log_max_mb");
+	QString keep = json->value("log_keep");
+	Logger::setRotation(max.isEmpty() ? -1 : max.toLongLong() * 1024 * 1024,
+						keep.isEmpty() ? -1 : keep.toInt());
 }
 
 void CardAssistant::logFile(const QString &logdata)
 {
-	QString logpath = json->value("log_path");
-	QFile log(logpath);
-	if (!log.open(QIODevice::ReadWrite | QIODevice::Append))
-		return;
+	Logger::log(logdata);
+}
 
-	QTextStream out(&log);
-	out << logdata << "\n";
-	log.close();
+/* only the end of a failed script's output, that is where the error is */
+void CardAssistant::logOutput(const QString &data)
+{
+	QStringList lines = data.split("\n", QString::SkipEmptyParts);
+	int skipped = qMax(0, lines.size() - OUTPUT_TAIL_LINES);
+	if (skipped)
+		logFile(QString("... %1 lines of output skipped").arg(skipped));
+	for (int i = skipped; i < lines.size(); i++)
+		logFile(lines[i]);
+}
+
+/*
+ * Worker threads must not touch process wide state, so instead of
+ * QDir::setCurrent() the directory is kept per instance and handed to
+ * every process we start.
+ */
+int CardAssistant::changeDirectory(const QString &path)
+{
+	if (path.isEmpty() || !QDir(path).exists())
+		return -3;
+	workdir = path;
+	return 0;
+}
+
+QString CardAssistant::mediaName()
+{
+	if (!device.isEmpty())
+		return device;
+	return json->value("current.media");
+}
+
+/* the media may also be an image file given with its full path */
+QString CardAssistant::devicePath()
+{
+	QString media = mediaName();
+	if (media.startsWith("/"))
+		return media;
+	return QString("/dev/%1").arg(media);
 }
 
-void CardAssistant::getProgressBar(QProgressBar *pbar)
+JsonHelper *CardAssistant::jsonHelper()
 {
-	bar = pbar;
+	return json;
 }
 
 void CardAssistant::setPassword(const QString &pass)
@@ -704,18 +1587,18 @@ QString CardAssistant::getInformation()
 	ba.append(QString("Release Versiyon Numarası = %1").arg(json->value("current.firmware_version")));
 	ba.append(QString("Uygulanacak olan Sd Kart çeşiti = \"%1\"").arg(json->value("current.sd_types")));
 	ba.append("\n");
-	ba.append(QString("Seçilen SD Kart = \"%1\"").arg(json->value("current.media")));
+	ba.append(QString("Seçilen SD Kart = \"%1\"").arg(mediaName()));
 	return ba.data();
 }
 
-void CardAssistant::showProgressBar(QProgressBar *bar, int maxRange)
+/* the engine has no widgets, front ends follow these signals */
+void CardAssistant::showProgressBar(int maxRange)
 {
-	bar->setVisible(true);
-	bar->setValue(0);
-	bar->setRange(0, maxRange);
+	emit progressRange(0, maxRange);
+	emit progressChanged(0);
 }
 
-void CardAssistant::progress(QProgressBar *bar, int value)
+void CardAssistant::progress(int value)
 {
-	bar->setValue(value);
+	emit progressChanged(value);
 }
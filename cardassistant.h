@@ -3,80 +3,147 @@
 
 #include <QTimer>
 #include <QThread>
-#include <QProcess>
-#include <QProgressBar>
+#include <QElapsedTimer>
 #include <QNetworkReply>
 #include <QNetworkAccessManager>
 
 #include "json/jsonhelper.h"
 
-namespace Ui {
-class MainWindow;
-}
+#include "release/tarextractor.h"
+#include "device/cardformatter.h"
+
+class Downloader;
+class ReleaseIngest;
+class ProcessRunner;
+class ReleaseIndex;
+
+/* result of the host side preparation, all a reader needs to program a card */
+struct CardPlan {
+	QString script;
+	QString type;
+	QString key;	/* golden image, empty when the recipe is not cloned */
+	QStringList stages;	/* device stages of the recipe, in the order they run */
+	QString macdir;	/* mac files leased for this card, mac recipes only */
+};
 
 class CardAssistant: public QObject
 {
 	Q_OBJECT
 public:
 	CardAssistant();
+	CardAssistant(JsonHelper *helper, const QString &media);
+	~CardAssistant();
 	QStringList insertMediaInit();
 	QStringList SDCardTypesInit();
 	QStringList versionTypesInit();
 	int releaseParse(QString release);
 	int runFormat(const QString &status, const QString &cardtype);
+	CardLayout formatLayout();
 	int untarRelease(QString release);
 	int getConfigPath(QString release);
 	int ubootScriptsCreate(const QString &script);
+	int ubootScriptsCompileAll();
 	int createConfigScript(const QString &script);
 	int runInstallSd();
 	int runInstallNand();
 	int runAddNandProg();
 	int runAddNewNandProg();
-	int runAddMacProg(const qint8 numberOfSd);
+	int runAddMacProg(const QString &macdir);
 	int runProgramLoader(const QString &script);
-	void getProgressBar(QProgressBar *pbar);
+	int prepareCard(const QString &script, CardPlan &plan);
+	int programCard(const CardPlan &plan);
+	static void dropPlan(const CardPlan &plan);
+	QString cloneImage(const QString &key);
+	int runWriteImage(const QString &image);
+	int runNativeInstall(const QString &type);
+	int runStages(const CardPlan &plan);
+	QStringList recipeStages(const QString &type);
+	bool rawAccess();
+	int runVerify(const QString &image);
+	int runVerifyPayloads();
 	QString getInformation();
 	void getMediaTypes(const QString &media);
 	void setPassword(const QString &pass);
 	QString getScriptTypes();
-	int createMacfile(const QString &numOfMacFile);
+	int createMacfile(int files, const QString &outdir);
 	int getUserPass();
+	bool isBusy();
+	JsonHelper *jsonHelper();
 
 	int downloadMac();
-	int downloadRelease();
+	int downloadRelease(const QString &release);
 	QStringList downloadableReleaseList();
 	QStringList getReleaseList();
 	int downloadReleaseList();
 signals:
 	void finishedJob();
+	void progressRange(int min, int max);
+	void progressChanged(int value);
+	void releaseDownloaded(const QString &release, int err);
+	void releaseListReady(const QStringList &releases);
+	void stageFinished(const QString &stage, int err, int ms);
 public slots:
 	void timeout();
 
 protected:
-	QWidget * parentWidget();
-	int processRun(const QString &cmd);
+	int changeDirectory(const QString &path);
+	int runFormatScript(const QString &card, const QString &target);
+	int runStage(const QString &name, const CardPlan &plan);
+	int runFastErase(const QString &type);
+	int runWriteFanout(const QString &image);
+	int runWriteSparse(const QString &image);
+	QString cardId();
+	qint64 cardSize();
+	int stage(const QString &name, int err);
+	QString mediaName();
+	QString devicePath();
+	int processRun(const QString &cmd, int timeout = 30000, const QStringList &errors = QStringList());
+	void initLog();
 	void logFile(const QString &logdata);
-	void showProgressBar(QProgressBar *bar, int maxRange = 99);
-	void progress(QProgressBar *bar, int value);
+	void logOutput(const QString &data);
+	void showProgressBar(int maxRange = 99);
+	void progress(int value);
 	QJsonObject jsonRead();
 	int checkReleaseFile(const QString release);
+	QString releasePath(const QString &releasename, const QString &file);
+	int useRelease(ReleaseIndex &index, const QString &release);
+	int indexRelease(ReleaseIndex &index, const QString &release);
 	QString replaceVariable(QString str);
-	int saveDownloadFile(QIODevice *data, QString targetname);
-	QNetworkReply *startDownload(QUrl url);
+	int saveDownloadFile(QIODevice *data, QIODevice *file);
+	QNetworkReply *startDownload(QUrl url, const QString &target = QString());
+	QString releaseUrl();
 protected slots:
+	void processErrorLine(const QString &line);
+	void outputProgress();
+	void writeProgress(qint64 written, qint64 total);
+	void formatProgress(int done, int total);
 	void readyRead();
 	void finished(int state);
 	void downloadFinished(QNetworkReply *);
+	void downloadReadyRead();
+	void releaseDownloadFinished(int err);
 private:
 	QTimer *timer;
 	QJsonModel *model;
-	QProcess *p;
+	ProcessRunner *p;
+	int outputLines;
 	QString filename;
+	QString workdir;
+	QString device;
 	JsonHelper *json;
 	QStringList datalist;
 	QStringList releaseList;
-	QProgressBar *bar;
+	QStringList releaseMembers;
+	QMap<QString, TarExtractor::Member> releaseInfo;
+	QByteArray releaseHash;
 	QNetworkAccessManager manager;
+	bool managerConnected;
+	Downloader *downloader;
+	ReleaseIngest *ingest;
+	QString downloadTarget;
+	QElapsedTimer stageClock;
+	CardLayout cardLayout;
+	QList<QPair<qint64, qint64> > imageHoles;	/* left unwritten by the last runWriteImage() */
 };
 
 #endif // CARDASSISTANT_H
@@ -0,0 +1,337 @@
+#include "cardjob.h"
+#include "device/fanoutwriter.h"
+
+#include <QDebug>
+#include <QRegExp>
+#include <QRunnable>
+
+/* host stage of one card, reports back to the manager through its queue */
+class PrepareTask : public QRunnable
+{
+public:
+	PrepareTask(QObject *manager, JsonHelper *json, const QString &media, const QString &script)
+		: manager(manager), json(json), media(media), script(script) {}
+	void run()
+	{
+		QElapsedTimer t;
+		t.start();
+		CardAssistant card(json, media);
+		CardPlan plan;
+		int err = card.prepareCard(script, plan);
+		QMetaObject::invokeMethod(manager, "prepared", Qt::QueuedConnection,
+								  Q_ARG(QString, media), Q_ARG(QString, script),
+								  Q_ARG(QString, plan.type), Q_ARG(QString, plan.key),
+								  Q_ARG(QStringList, plan.stages), Q_ARG(QString, plan.macdir),
+								  Q_ARG(int, err), Q_ARG(int, (int)t.elapsed()));
+	}
+private:
+	QObject *manager;
+	JsonHelper *json;
+	QString media;
+	QString script;
+};
+
+CardJob::CardJob(JsonHelper *helper, const QString &media, const CardPlan &plan)
+{
+	json = helper;
+	device = media;
+	this->plan = plan;
+}
+
+QString CardJob::media() const
+{
+	return device;
+}
+
+void CardJob::run()
+{
+	/* created here so the process belongs to the worker thread */
+	CardAssistant card(json, device);
+	connect(&card, SIGNAL(progressRange(int,int)), this, SIGNAL(progressRange(int,int)));
+	connect(&card, SIGNAL(progressChanged(int)), this, SIGNAL(progressChanged(int)));
+	connect(&card, SIGNAL(stageFinished(QString,int,int)), this, SLOT(cardStage(QString,int,int)));
+
+	int err = card.programCard(plan);
+	CardAssistant::dropPlan(plan);
+	emit finished(device, err);
+}
+
+void CardJob::cardStage(const QString &stage, int err, int ms)
+{
+	emit stageFinished(device, stage, err, ms);
+}
+
+CardJobManager::CardJobManager(JsonHelper *helper, QObject *parent)
+	: QObject(parent)
+{
+	json = helper;
+	/* "host_workers": cards prepared at the same time, default 2 */
+	int workers = json->value("host_workers").toInt();
+	hostPool.setMaxThreadCount(workers > 0 ? workers : 2);
+}
+
+CardJobManager::~CardJobManager()
+{
+	hostPool.waitForDone();
+	foreach (CardPlan plan, ready)
+		CardAssistant::dropPlan(plan);
+	foreach (QThread *th, threads) {
+		th->quit();
+		th->wait();
+	}
+}
+
+/*
+ * lsblk lists partitions (sdb1, mmcblk0p1) next to the disks, only the
+ * disks themselves can be programmed.
+ */
+bool CardJobManager::isWholeDisk(const QString &media)
+{
+	QString name = media.split(" ").first();
+	if (name.startsWith("mmcblk"))
+		return !name.contains(QRegExp("p\\d+$"));
+	if (name.startsWith("sd"))
+		return !name.contains(QRegExp("\\d$"));
+	return false;
+}
+
+/*
+ * Programs the card in every media. A plan prepared earlier with the same
+ * script is used as is, otherwise the host stage runs first. A reader
+ * still busy with a card queues the new one behind it; its host stage
+ * runs meanwhile.
+ */
+int CardJobManager::start(const QStringList &medias, const QString &script)
+{
+	if (!clock.isValid())
+		clock.start();
+	int started = 0;
+	foreach (QString media, medias) {
+		if (threads.contains(media) || waiting.contains(media) || queued.contains(media)) {
+			if (!queued.contains(media) && !waiting.contains(media) &&
+					!(ready.contains(media) && ready.value(media).script == script))
+				launchPrepare(media, script);
+			queued[media] << script;
+			started++;
+			continue;
+		}
+		waiting.insert(media, script);
+		if (ready.contains(media) && ready.value(media).script == script)
+			dispatch(media);
+		else
+			launchPrepare(media, script);
+		started++;
+	}
+	emit queueChanged(hostQueueDepth(), deviceQueueDepth());
+	return started;
+}
+
+/* host stage only, for the card that goes into media next */
+int CardJobManager::prepare(const QStringList &medias, const QString &script)
+{
+	if (!clock.isValid())
+		clock.start();
+	int queued = 0;
+	foreach (QString media, medias) {
+		if (ready.contains(media) && ready.value(media).script == script)
+			continue;
+		launchPrepare(media, script);
+		queued++;
+	}
+	emit queueChanged(hostQueueDepth(), deviceQueueDepth());
+	return queued;
+}
+
+bool CardJobManager::isRunning()
+{
+	return !threads.isEmpty() || !waiting.isEmpty() || !queued.isEmpty();
+}
+
+QStringList CardJobManager::runningMedias()
+{
+	QStringList medias = threads.keys();
+	foreach (QString media, waiting.keys())
+		if (!medias.contains(media))
+			medias << media;
+	return medias;
+}
+
+/* cards queued for or in a host stage */
+int CardJobManager::hostQueueDepth()
+{
+	return preparing.size();
+}
+
+/* cards queued behind a busy reader */
+int CardJobManager::deviceQueueDepth()
+{
+	int depth = 0;
+	foreach (QStringList scripts, queued)
+		depth += scripts.size();
+	return depth;
+}
+
+/* busy time over wall time since the first card, per resource and stage */
+QMap<QString, double> CardJobManager::utilization()
+{
+	QMap<QString, double> u;
+	qint64 wall = clock.isValid() ? clock.elapsed() : 0;
+	if (wall <= 0)
+		return u;
+	QMap<QString, qint64>::const_iterator i;
+	for (i = busy.constBegin(); i != busy.constEnd(); ++i)
+		u.insert(i.key(), (double)i.value() / wall);
+	return u;
+}
+
+/* one host stage per media at a time, prepared() picks up script changes */
+void CardJobManager::launchPrepare(const QString &media, const QString &script)
+{
+	if (preparing.contains(media))
+		return;
+	CardAssistant::dropPlan(ready.take(media));
+	preparing.insert(media, script);
+	hostPool.start(new PrepareTask(this, json, media, script));
+}
+
+void CardJobManager::prepared(const QString &media, const QString &script, const QString &type,
+							  const QString &key, const QStringList &stages, const QString &macdir,
+							  int err, int ms)
+{
+	preparing.remove(media);
+	busy["host"] += ms;
+	busy["prepare"] += ms;
+	emit stageFinished(media, "prepare", err, ms);
+
+	CardPlan plan;
+	plan.script = script;
+	plan.type = type;
+	plan.key = key;
+	plan.stages = stages;
+	plan.macdir = macdir;
+
+	/* started with another recipe while this one was being prepared */
+	if (waiting.contains(media) && waiting.value(media) != script) {
+		CardAssistant::dropPlan(plan);
+		launchPrepare(media, waiting.value(media));
+		emit queueChanged(hostQueueDepth(), deviceQueueDepth());
+		return;
+	}
+	if (err) {
+		CardAssistant::dropPlan(plan);
+		if (waiting.remove(media)) {
+			emit jobFinished(media, err);
+			startNext(media);
+			checkFinished();
+		}
+		emit queueChanged(hostQueueDepth(), deviceQueueDepth());
+		return;
+	}
+	ready.insert(media, plan);
+	dispatch(media);
+	emit queueChanged(hostQueueDepth(), deviceQueueDepth());
+}
+
+/*
+ * Partitions and formats the card in media on its own job thread, a
+ * device stage without a recipe. -1 while the reader has cards to do.
+ */
+int CardJobManager::format(const QString &media)
+{
+	if (threads.contains(media) || waiting.contains(media) || queued.contains(media))
+		return -1;
+	if (!clock.isValid())
+		clock.start();
+	CardPlan plan;
+	plan.script = "format";
+	plan.stages << "format";
+	runJob(media, plan);
+	return 0;
+}
+
+/* device stages, once the reader is free and the plan is there */
+void CardJobManager::dispatch(const QString &media)
+{
+	if (threads.contains(media) || !waiting.contains(media) || !ready.contains(media))
+		return;
+	CardPlan plan = ready.take(media);
+	waiting.remove(media);
+	runJob(media, plan);
+}
+
+void CardJobManager::runJob(const QString &media, const CardPlan &plan)
+{
+	QThread *th = new QThread(this);
+	CardJob *job = new CardJob(json, media, plan);
+	job->moveToThread(th);
+	connect(th, SIGNAL(started()), job, SLOT(run()));
+	connect(job, SIGNAL(stageFinished(QString,QString,int,int)), SLOT(jobStage(QString,QString,int,int)));
+	connect(job, SIGNAL(finished(QString,int)), SLOT(finished(QString,int)));
+	connect(th, SIGNAL(finished()), job, SLOT(deleteLater()));
+	threads.insert(media, th);
+	/* a card that starts with a clone joins that image's fan-out session */
+	QString image = CardAssistant(json, media).cloneImage(plan.key);
+	if (!image.isEmpty()) {
+		cloning.insert(media, image);
+		updateCloning(image);
+	}
+	deviceStart.insert(media, clock.elapsed());
+	emit jobStarted(media, job);
+	th->start();
+}
+
+/* cards of this manager about to write image, for its fan-out session */
+void CardJobManager::updateCloning(const QString &image)
+{
+	int count = 0;
+	foreach (QString other, cloning)
+		if (other == image)
+			count++;
+	FanoutWriter::setDeviceJobs(image, count);
+}
+
+void CardJobManager::jobStage(const QString &media, const QString &stage, int err, int ms)
+{
+	if (stage == "write_image" && cloning.contains(media))
+		updateCloning(cloning.take(media));
+	busy[stage] += ms;
+	emit stageFinished(media, stage, err, ms);
+}
+
+void CardJobManager::finished(const QString &media, int err)
+{
+	QThread *th = threads.take(media);
+	if (th) {
+		th->quit();
+		th->wait();
+		th->deleteLater();
+	}
+	if (cloning.contains(media))
+		updateCloning(cloning.take(media));
+	busy["device:" + media] += clock.elapsed() - deviceStart.take(media);
+	emit jobFinished(media, err);
+	startNext(media);
+	emit queueChanged(hostQueueDepth(), deviceQueueDepth());
+	checkFinished();
+}
+
+/* the reader is free again, its next queued card goes on */
+void CardJobManager::startNext(const QString &media)
+{
+	if (!queued.contains(media))
+		return;
+	QString script = queued[media].takeFirst();
+	if (queued.value(media).isEmpty())
+		queued.remove(media);
+	waiting.insert(media, script);
+	if (ready.contains(media) && ready.value(media).script == script)
+		dispatch(media);
+	else
+		launchPrepare(media, script);
+}
+
+void CardJobManager::checkFinished()
+{
+	if (threads.isEmpty() && waiting.isEmpty() && queued.isEmpty())
+		emit allFinished();
+}
@@ -0,0 +1,96 @@
+#ifndef CARDJOB_H
+#define CARDJOB_H
+
+#include <QMap>
+#include <QThread>
+#include <QThreadPool>
+#include <QStringList>
+#include <QElapsedTimer>
+
+#include "cardassistant.h"
+
+/*
+ * Runs the card side of a prepared recipe. Every job lives in its own
+ * thread and owns its own CardAssistant, so its process handle never
+ * blocks the other readers.
+ */
+class CardJob : public QObject
+{
+	Q_OBJECT
+public:
+	CardJob(JsonHelper *helper, const QString &media, const CardPlan &plan);
+	QString media() const;
+public slots:
+	void run();
+signals:
+	void progressRange(int min, int max);
+	void progressChanged(int value);
+	void stageFinished(const QString &media, const QString &stage, int err, int ms);
+	void finished(const QString &media, int err);
+protected slots:
+	void cardStage(const QString &stage, int err, int ms);
+private:
+	JsonHelper *json;
+	QString device;
+	CardPlan plan;
+};
+
+/*
+ * Station scheduler. A card goes through a host stage (prepare: release
+ * check, config.sh, u-boot script, mac lease, golden image key) and the
+ * device stages its plan lists (install, add-prog, mac, verify). Host
+ * stages run on a small shared pool and need no card, so the next card of
+ * a reader can be prepared while the reader still writes the current one;
+ * device stages are serialized per reader and a card started on a busy
+ * reader waits in that reader's queue. Busy time is kept per resource
+ * ("host", "device:<media>") and per stage for utilization().
+ */
+class CardJobManager : public QObject
+{
+	Q_OBJECT
+public:
+	CardJobManager(JsonHelper *helper, QObject *parent = 0);
+	~CardJobManager();
+	int start(const QStringList &medias, const QString &script);
+	int prepare(const QStringList &medias, const QString &script);
+	int format(const QString &media);
+	bool isRunning();
+	QStringList runningMedias();
+	int hostQueueDepth();
+	int deviceQueueDepth();
+	QMap<QString, double> utilization();
+	static bool isWholeDisk(const QString &media);
+signals:
+	void jobStarted(const QString &media, CardJob *job);
+	void jobFinished(const QString &media, int err);
+	void stageFinished(const QString &media, const QString &stage, int err, int ms);
+	void queueChanged(int host, int device);
+	void allFinished();
+protected:
+	void launchPrepare(const QString &media, const QString &script);
+	void dispatch(const QString &media);
+	void runJob(const QString &media, const CardPlan &plan);
+	void updateCloning(const QString &image);
+	void startNext(const QString &media);
+	void checkFinished();
+protected slots:
+	void prepared(const QString &media, const QString &script, const QString &type,
+				  const QString &key, const QStringList &stages, const QString &macdir,
+				  int err, int ms);
+	void jobStage(const QString &media, const QString &stage, int err, int ms);
+	void finished(const QString &media, int err);
+private:
+	JsonHelper *json;
+	QThreadPool hostPool;
+	QMap<QString, QThread *> threads;
+	QMap<QString, QString> preparing;	/* media -> script on the host pool */
+	QMap<QString, CardPlan> ready;
+	QMap<QString, QString> waiting;		/* started, plan not ready yet */
+	QMap<QString, QStringList> queued;	/* scripts of the cards after the current one */
+	QMap<QString, QString> cloning;		/* media -> golden image its job writes next */
+	QMap<QString, qint64> deviceStart;
+	QMap<QString, qint64> busy;
+	QElapsedTimer clock;
+};
+
+#endif // CARDJOB_H
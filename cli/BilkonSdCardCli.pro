@@ -0,0 +1,21 @@
+#-------------------------------------------------
+#
+# Command line front end for unattended stations, same engine as the gui
+#
+#-------------------------------------------------
+
+QT       -= widgets
+
+TARGET = bilkon-sdcard-cli
+TEMPLATE = app
+CONFIG += console
+CONFIG -= app_bundle
+
+include(../engine.pri)
+
+SOURCES += main.cpp \
+    clibatch.cpp \
+    clibench.cpp
+
+HEADERS  += clibatch.h \
+    clibench.h
@@ -0,0 +1,241 @@
+#include "clibatch.h"
+#include "cardjob.h"
+#include "cardassistant.h"
+#include "device/hotplugmonitor.h"
+
+#include <QJsonObject>
+#include <QJsonDocument>
+#include <QCoreApplication>
+
+#include <stdio.h>
+
+CliBatch::CliBatch(JsonHelper *json, QObject *parent)
+	: QObject(parent)
+{
+	this->json = json;
+	card = new CardAssistant(json, QString());
+	jobs = new CardJobManager(json, this);
+	monitor = new HotplugMonitor(this);
+	count = 0;
+	started = 0;
+	done = 0;
+	failed = 0;
+	swapTimer.setSingleShot(true);
+	swapTimer.setInterval(10 * 60 * 1000);
+	connect(&swapTimer, SIGNAL(timeout()), SLOT(swapTimeout()));
+	connect(jobs, SIGNAL(jobStarted(QString,CardJob*)), SLOT(jobStarted(QString,CardJob*)));
+	connect(jobs, SIGNAL(jobFinished(QString,int)), SLOT(jobFinished(QString,int)));
+	connect(jobs, SIGNAL(stageFinished(QString,QString,int,int)), SLOT(stageFinished(QString,QString,int,int)));
+	connect(jobs, SIGNAL(queueChanged(int,int)), SLOT(queueChanged(int,int)));
+	connect(monitor, SIGNAL(deviceAdded(CardDevice)), SLOT(deviceAdded(CardDevice)));
+	connect(monitor, SIGNAL(deviceRemoved(QString)), SLOT(deviceRemoved(QString)));
+}
+
+CliBatch::~CliBatch()
+{
+	delete card;
+}
+
+/* tarball name as listed in folder.binaries, empty keeps the current one */
+void CliBatch::setRelease(const QString &release)
+{
+	this->release = release;
+}
+
+/* key of list.* in creater.json, empty keeps current.sd_types */
+void CliBatch::setRecipe(const QString &recipe)
+{
+	this->recipe = recipe;
+}
+
+void CliBatch::setDevices(const QStringList &devices)
+{
+	this->devices = devices;
+}
+
+/* cards to program in total, 0 means one per device */
+void CliBatch::setCount(int count)
+{
+	this->count = count;
+}
+
+void CliBatch::setSwapTimeout(int seconds)
+{
+	swapTimer.setInterval(seconds * 1000);
+}
+
+void CliBatch::start()
+{
+	clock.start();
+	if (devices.isEmpty()) {
+		foreach (CardDevice dev, HotplugMonitor::scan())
+			devices << dev.name;
+	}
+	if (devices.isEmpty()) {
+		report("error", "-", "devices", -1, 0);
+		finish(EXIT_SETUP);
+		return;
+	}
+	if (count <= 0)
+		count = devices.size();
+	int err = setup();
+	if (err) {
+		finish(EXIT_SETUP);
+		return;
+	}
+	/* card swaps are only seen through uevents */
+	if (count > devices.size() && monitor->start()) {
+		report("error", "-", "hotplug", -1, 0);
+		finish(EXIT_SETUP);
+		return;
+	}
+	foreach (QString media, devices) {
+		if (started >= count)
+			break;
+		startCard(media);
+	}
+}
+
+/* the per release and per recipe steps the gui does on selection */
+int CliBatch::setup()
+{
+	QElapsedTimer t;
+	if (card->getUserPass()) {
+		report("error", "-", "password", -1, 0);
+		return -1;
+	}
+	if (!release.isEmpty()) {
+		t.start();
+		int err = card->releaseParse(release);
+		report("stage", "-", "release", err, t.elapsed());
+		if (err)
+			return err;
+	}
+	if (!recipe.isEmpty()) {
+		t.start();
+		int err = card->createConfigScript(recipe);
+		report("stage", "-", "config", err, t.elapsed());
+		if (err)
+			return err;
+	}
+	script = card->getScriptTypes();
+	if (script.isEmpty() || json->value(QString("list.%1").arg(script)).isEmpty()) {
+		report("error", "-", "recipe", -1, 0);
+		return -1;
+	}
+	return 0;
+}
+
+void CliBatch::startCard(const QString &media)
+{
+	cardStart.insert(media, clock.elapsed());
+	started++;
+	jobs->start(QStringList() << media, script);
+}
+
+void CliBatch::jobStarted(const QString &media, CardJob *job)
+{
+	Q_UNUSED(job);
+	report("start", media, QString(), 0, 0);
+	/* the next card of this reader is prepared while this one is written */
+	if (started < count)
+		jobs->prepare(QStringList() << media, script);
+}
+
+void CliBatch::stageFinished(const QString &media, const QString &stage, int err, int ms)
+{
+	report("stage", media, stage, err, ms);
+}
+
+void CliBatch::queueChanged(int host, int device)
+{
+	QJsonObject o;
+	o.insert("event", QString("queue"));
+	o.insert("host", host);
+	o.insert("device", device);
+	print(o);
+}
+
+void CliBatch::jobFinished(const QString &media, int err)
+{
+	done++;
+	if (err)
+		failed++;
+	report("card", media, QString(), err, clock.elapsed() - cardStart.value(media));
+
+	if (started < count) {
+		waitRemove.insert(media);
+		report("swap", media, QString(), 0, 0);
+		swapTimer.start();
+		return;
+	}
+	if (!jobs->isRunning())
+		finish(failed ? EXIT_CARDS : EXIT_OK);
+}
+
+void CliBatch::deviceRemoved(const QString &name)
+{
+	if (waitRemove.remove(name))
+		waitInsert.insert(name);
+}
+
+void CliBatch::deviceAdded(const CardDevice &dev)
+{
+	if (!waitInsert.remove(dev.name) || started >= count)
+		return;
+	if (waitRemove.isEmpty() && waitInsert.isEmpty())
+		swapTimer.stop();
+	else
+		swapTimer.start();
+	startCard(dev.name);
+}
+
+/* nobody swapped a card for too long, report what was done */
+void CliBatch::swapTimeout()
+{
+	if (jobs->isRunning()) {
+		swapTimer.start();
+		return;
+	}
+	report("error", "-", "swap", -7, swapTimer.interval());
+	finish(EXIT_SWAP_TIMEOUT);
+}
+
+void CliBatch::report(const QString &event, const QString &media, const QString &stage, int err, qint64 ms)
+{
+	QJsonObject o;
+	o.insert("event", event);
+	o.insert("device", media);
+	if (!stage.isEmpty())
+		o.insert("stage", stage);
+	o.insert("status", err);
+	o.insert("ms", (double)ms);
+	print(o);
+}
+
+void CliBatch::print(const QJsonObject &o)
+{
+	fprintf(stdout, "%s\n", QJsonDocument(o).toJson(QJsonDocument::Compact).constData());
+	fflush(stdout);
+}
+
+void CliBatch::finish(int code)
+{
+	swapTimer.stop();
+	QJsonObject u;
+	u.insert("event", QString("utilization"));
+	QMap<QString, double> busy = jobs->utilization();
+	foreach (QString resource, busy.keys())
+		u.insert(resource, busy.value(resource));
+	print(u);
+
+	QJsonObject o;
+	o.insert("event", QString("summary"));
+	o.insert("cards", done);
+	o.insert("failed", failed);
+	o.insert("ms", (double)clock.elapsed());
+	o.insert("exit", code);
+	print(o);
+	json->flush();
+	QCoreApplication::exit(code);
+}
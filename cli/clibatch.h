@@ -0,0 +1,81 @@
+#ifndef CLIBATCH_H
+#define CLIBATCH_H
+
+#include <QMap>
+#include <QSet>
+#include <QTimer>
+#include <QObject>
+#include <QStringList>
+#include <QJsonObject>
+#include <QElapsedTimer>
+
+class CardJob;
+class JsonHelper;
+class CardAssistant;
+class CardJobManager;
+class HotplugMonitor;
+struct CardDevice;
+
+/*
+ * Unattended run of one recipe on a set of card readers. Prepares the
+ * release and recipe once, programs every reader in parallel and, while
+ * fewer than count cards are done, waits for the card in a finished
+ * reader to be swapped; the host stage of that next card already ran
+ * meanwhile. Every step is printed as one json line on stdout.
+ */
+class CliBatch : public QObject
+{
+	Q_OBJECT
+public:
+	enum ExitCode {
+		EXIT_OK = 0,
+		EXIT_USAGE = 1,
+		EXIT_SETUP = 2,
+		EXIT_CARDS = 3,
+		EXIT_SWAP_TIMEOUT = 4,
+	};
+
+	CliBatch(JsonHelper *json, QObject *parent = 0);
+	~CliBatch();
+	void setRelease(const QString &release);
+	void setRecipe(const QString &recipe);
+	void setDevices(const QStringList &devices);
+	void setCount(int count);
+	void setSwapTimeout(int seconds);
+public slots:
+	void start();
+protected:
+	int setup();
+	void startCard(const QString &media);
+	void report(const QString &event, const QString &media, const QString &stage, int err, qint64 ms);
+	void print(const QJsonObject &o);
+	void finish(int code);
+protected slots:
+	void jobStarted(const QString &media, CardJob *job);
+	void jobFinished(const QString &media, int err);
+	void stageFinished(const QString &media, const QString &stage, int err, int ms);
+	void queueChanged(int host, int device);
+	void deviceAdded(const CardDevice &dev);
+	void deviceRemoved(const QString &name);
+	void swapTimeout();
+private:
+	JsonHelper *json;
+	CardAssistant *card;
+	CardJobManager *jobs;
+	HotplugMonitor *monitor;
+	QString release;
+	QString recipe;
+	QString script;
+	QStringList devices;
+	QSet<QString> waitRemove;
+	QSet<QString> waitInsert;
+	QMap<QString, qint64> cardStart;
+	QElapsedTimer clock;
+	QTimer swapTimer;
+	int count;
+	int started;
+	int done;
+	int failed;
+};
+
+#endif // CLIBATCH_H
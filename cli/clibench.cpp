@@ -0,0 +1,553 @@
+#include "clibench.h"
+#include "cardassistant.h"
+#include "json/jsonhelper.h"
+#include "device/cardverifier.h"
+#include "device/hotplugmonitor.h"
+#include "device/mbr.h"
+
+#include <QDir>
+#include <QFile>
+#include <QDate>
+#include <QFileInfo>
+#include <QProcess>
+#include <QJsonArray>
+#include <QJsonObject>
+#include <QJsonDocument>
+#include <QCoreApplication>
+
+#include <zlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+
+/* stand-ins for the scripts in sdcard_prog, same arguments and output */
+static const char *fakeSudo =
+		"#!/bin/sh\n"
+		"# benchmark sudo: swallows the password, runs the command as is\n"
+		"[ \"$1\" = \"-S\" ] && { shift; cat > /dev/null; }\n"
+		"exec \"$@\"\n";
+
+static const char *fakeInstall =
+		"#!/bin/sh\n"
+		"# benchmark install script: puts the release files on the card\n"
+		". ./config.sh\n"
+		"off=1048576\n"
+		"for f in \"$kernel\" \"$ramdisk\" \"$rootfs\"; do\n"
+		"\tdd if=\"$f\" of=\"$1\" bs=1M oflag=seek_bytes seek=$off conv=notrunc status=none || exit 1\n"
+		"\toff=$((off + $(stat -c %s \"$f\")))\n"
+		"done\n"
+		"echo \"install done\"\n";
+
+static const char *fakeProg =
+		"#!/bin/sh\n"
+		"# benchmark nand programmer copy, the real one mounts partition 2\n"
+		"echo \"prog done\"\n";
+
+CliBench::CliBench(const QString &dir, QObject *parent)
+	: QObject(parent)
+{
+	this->dir = QDir(dir).absolutePath();
+	sdk = QDir(this->dir).filePath("sdk");
+	json = NULL;
+	card = NULL;
+	releaseSize = 128 * 1024 * 1024;
+	cardSize = 1024 * 1024 * 1024;
+	cards = 2;
+	failed = 0;
+}
+
+CliBench::~CliBench()
+{
+	delete card;
+	delete json;
+}
+
+void CliBench::setReleaseSize(qint64 bytes)
+{
+	releaseSize = qMax<qint64>(1024 * 1024, bytes);
+}
+
+void CliBench::setCardSize(qint64 bytes)
+{
+	cardSize = bytes;
+}
+
+/* cards per recipe, the first one runs the full install */
+void CliBench::setCards(int cards)
+{
+	this->cards = qBound(1, cards, 24);
+}
+
+void CliBench::start()
+{
+	QElapsedTimer total;
+	total.start();
+	Sample s;
+
+	begin(s);
+	if (end(s, "prepare", "-", QString(), prepare(), releaseSize)) {
+		QCoreApplication::exit(2);
+		return;
+	}
+
+	begin(s);
+	QStringList readers = card->insertMediaInit();
+	end(s, "scan", "-", QString(), readers.size() == cards * 4 ? 0 : -1, 0);
+
+	qint64 tarball = QFileInfo(QDir(json->value("folder.binaries")).filePath(release)).size();
+	begin(s);
+	end(s, "untar", "-", QString(), card->untarRelease(release), tarball);
+
+	QFile::remove(QDir(json->value("folder.binaries")).filePath("release_index.json"));
+	begin(s);
+	end(s, "release_parse", "-", QString(), card->releaseParse(release), tarball);
+	begin(s);
+	end(s, "release_parse_indexed", "-", QString(), card->releaseParse(release), 0);
+
+	QStringList recipes = json->valueObject("list").keys();
+	foreach (QString recipe, recipes) {
+		currentRecipe = recipe;
+		begin(s);
+		if (end(s, "config", "-", recipe, card->createConfigScript(recipe), 0))
+			continue;
+		for (int i = 0; i < cards; i++) {
+			QString path = cardPath(i);
+			currentCard = path;
+			CardAssistant worker(json, path);
+			connect(&worker, SIGNAL(stageFinished(QString,int,int)), SLOT(cardStage(QString,int,int)));
+
+			/* a fresh card every time, as on the line */
+			if (freshCard(path)) {
+				begin(s);
+				end(s, "card", path, recipe, -2, 0);
+				continue;
+			}
+
+			begin(s);
+			qint64 before = allocated(path);
+			int err = worker.runFormat("green", QString("%1 %2").arg(path).arg(CardDevice::sizeText(cardSize)));
+			end(s, "format", path, recipe, err, allocated(path) - before);
+			if (err)
+				continue;
+			begin(s);
+			before = allocated(path);
+			err = worker.runProgramLoader(recipe);
+			end(s, "program", path, recipe, err, allocated(path) - before);
+		}
+	}
+
+	checkImage();
+
+	QJsonObject o;
+	o.insert("event", QString("summary"));
+	o.insert("ms", (double)total.elapsed());
+	o.insert("failed", failed);
+	fprintf(stdout, "%s\n", QJsonDocument(o).toJson(QJsonDocument::Compact).constData());
+	fflush(stdout);
+	json->flush();
+	QCoreApplication::exit(failed ? 3 : 0);
+}
+
+/*
+ * No script involved: the in process install onto the first card file,
+ * then that card as an image onto a second file. Both are read back in
+ * full, the first against the release files where the formatter put
+ * them, the copy against the image.
+ */
+void CliBench::checkImage()
+{
+	Sample s;
+	QString type("boot_zero_sd.txt");
+	QString image = cardPath(0);
+	QString copy = QDir(dir).filePath("cards/copy.img");
+	currentRecipe = type;
+	currentCard = image;
+	if (freshCard(image) || freshCard(copy)) {
+		begin(s);
+		end(s, "card", image, type, -2, 0);
+		return;
+	}
+
+	CardAssistant worker(json, image);
+	connect(&worker, SIGNAL(stageFinished(QString,int,int)), SLOT(cardStage(QString,int,int)));
+	begin(s);
+	qint64 before = allocated(image);
+	int err = worker.runNativeInstall(type);
+	if (end(s, "native_install", image, type, err, allocated(image) - before))
+		return;
+	begin(s);
+	end(s, "fsck", image, type, checkFilesystems(image), 0);
+
+	CardVerifier payloads(image, QString());
+	payloads.setMode(CardVerifier::Full);
+	foreach (CardPayload payload, worker.formatLayout().payloads)
+		payloads.addPayload(payload.source, payload.offset, payload.from, payload.size);
+	begin(s);
+	err = payloads.verify();
+	end(s, "verify_payloads", image, type, err, payloads.bytesRead());
+
+	CardAssistant writer(json, copy);
+	currentCard = copy;
+	begin(s);
+	before = allocated(copy);
+	err = writer.runWriteImage(image);
+	if (end(s, "write_image", copy, type, err, allocated(copy) - before))
+		return;
+
+	CardVerifier back(copy, image);
+	back.setMode(CardVerifier::Full);
+	begin(s);
+	err = back.verify();
+	end(s, "read_back", copy, type, err, back.bytesRead());
+}
+
+/*
+ * e2fsck -fn on every ext4 partition in place, through the "offset" io
+ * option, and fsck.vfat -n on a copy of the boot partition. Anything
+ * found, or a tool missing, fails the stage; the report goes to stderr.
+ */
+int CliBench::checkFilesystems(const QString &image)
+{
+	QList<MbrPartition> parts = readMbr(image);
+	if (parts.isEmpty())
+		return -1;
+	QString copy = QDir(dir).filePath("cards/boot.part");
+	foreach (MbrPartition p, parts) {
+		QString tool;
+		QStringList args;
+		if (p.type == 0x83) {
+			tool = "e2fsck";
+			args << "-fn" << QString("%1?offset=%2").arg(image).arg(p.start);
+		} else {
+			QFile in(image);
+			QFile out(copy);
+			if (!in.open(QIODevice::ReadOnly) || !in.seek(p.start) || !out.open(QIODevice::WriteOnly))
+				return -2;
+			for (qint64 left = p.size; left > 0; ) {
+				QByteArray buf = in.read(qMin(left, (qint64)1 << 20));
+				if (buf.isEmpty() || out.write(buf) != buf.size())
+					return -2;
+				left -= buf.size();
+			}
+			out.close();
+			tool = "fsck.vfat";
+			args << "-n" << copy;
+		}
+		QProcess fsck;
+		QProcessEnvironment env = QProcessEnvironment::systemEnvironment();
+		env.insert("PATH", env.value("PATH") + ":/sbin:/usr/sbin");
+		fsck.setProcessEnvironment(env);
+		fsck.setProcessChannelMode(QProcess::MergedChannels);
+		fsck.start(tool, args);
+		if (!fsck.waitForFinished(-1) || fsck.exitStatus() != QProcess::NormalExit) {
+			fprintf(stderr, "%s: %s\n", qPrintable(tool), qPrintable(fsck.errorString()));
+			return -3;
+		}
+		if (fsck.exitCode()) {
+			fprintf(stderr, "%s partition %d:\n%s", qPrintable(tool), p.index, fsck.readAll().constData());
+			return -4;
+		}
+	}
+	QFile::remove(copy);
+	return 0;
+}
+
+/* an empty sparse card file of cardSize */
+int CliBench::freshCard(const QString &path)
+{
+	QFile::remove(path);
+	QFile f(path);
+	if (!f.open(QIODevice::WriteOnly) || !f.resize(cardSize))
+		return -2;
+	return 0;
+}
+
+/*
+ * Lays out <dir>/{sdk,cards,sys,bin} from scratch. Nothing outside these
+ * four is touched, so any directory can be used.
+ */
+int CliBench::prepare()
+{
+	QDir root(dir);
+	foreach (QString sub, QStringList() << "sdk" << "cards" << "sys" << "bin") {
+		QDir old(root.filePath(sub));
+		if (old.exists() && !old.removeRecursively())
+			return -3;
+		if (!root.mkpath(sub))
+			return -3;
+	}
+	QString prog = QDir(sdk).filePath("tools/sdcard_prog");
+	QString scripts = QDir(prog).filePath("u-boot-scripts");
+	QString binaries = QDir(sdk).filePath("tools/binaries");
+	if (!QDir().mkpath(scripts) || !QDir().mkpath(binaries))
+		return -3;
+
+	/* the recipes of the shipped creater.json */
+	QJsonObject list;
+	list.insert("Nand Programlama Modu", QString("boot_zero_prog.txt"));
+	list.insert("Nand Programlama[Yeni Nand]", QString("boot_zero_sd_new_mtd.txt"));
+	list.insert("Nand Siler", QString("rescue_erase.txt"));
+	list.insert("Nand'i Siler ve IP'yi Programlamaya Moduna Geçirir", QString("rescue_erase_cammgr.txt"));
+	list.insert("Programlama Modu ve Mac Atma (poe)", QString("boot_zero_SD_mac.txt"));
+	list.insert("Sd Kart ile IP'yi Başlatma", QString("boot_zero_sd.txt"));
+	list.insert("Sd Kart ile IP'yi Programlama", QString("boot_zero_sd_prog.txt"));
+	foreach (QString key, list.keys()) {
+		QByteArray txt = QString("setenv bootargs console=ttyS0,115200 # %1\nfatload mmc 0 0x80000000 uImage\nbootm 0x80000000\n")
+				.arg(list.value(key).toString()).toUtf8();
+		if (writeFile(QDir(scripts).filePath(list.value(key).toString()), txt))
+			return -2;
+	}
+	/* format runs in process, there is no format.sh to fake */
+	if (writeFile(QDir(prog).filePath("install_sd.sh"), fakeInstall, true) ||
+			writeFile(QDir(prog).filePath("install_nand.sh"), fakeInstall, true) ||
+			writeFile(QDir(prog).filePath("add_newnandprog_sd.sh"), fakeProg, true) ||
+			writeFile(QDir(prog).filePath("add_nandprog_sd.sh"), fakeProg, true) ||
+			writeFile(QDir(prog).filePath("add_macprog_sd.sh"), fakeProg, true) ||
+			writeFile(root.filePath("bin/sudo"), fakeSudo, true))
+		return -2;
+	/* scripts find the fake sudo first */
+	qputenv("PATH", (root.filePath("bin") + ":" + qgetenv("PATH")).toLocal8Bit());
+
+	release = QString("release_%1.tar.gz").arg(QDate::currentDate().toString("ddMMyy"));
+	if (writeRelease(QDir(binaries).filePath(release)))
+		return -2;
+	if (writeMacs(QDir(sdk).filePath("tools/macs.txt"), cards * 250 * 2))
+		return -2;
+
+	HotplugMonitor::setSysfsRoot(root.filePath("sys/class/block"));
+	for (int i = 0; i < cards; i++)
+		if (fakeReader(QFileInfo(cardPath(i)).baseName()))
+			return -2;
+
+	QJsonObject folder;
+	folder.insert("binaries", QString("$SDK/tools/binaries"));
+	folder.insert("sdcard_prog", QString("$SDK/tools/sdcard_prog"));
+	folder.insert("tools", QString("$SDK/tools"));
+	folder.insert("uboot_scripts", QString("$SDK/tools/sdcard_prog/u-boot-scripts/"));
+	QJsonObject config;
+	config.insert("PASS", QString("bench"));
+	config.insert("SDK", sdk);
+	config.insert("folder", folder);
+	config.insert("list", list);
+	config.insert("log_path", root.filePath("bench.log"));
+	config.insert("verify", QString("sampled"));
+	/* card files need no privileges, the in process format is the one measured */
+	config.insert("format", QString("inprocess"));
+	/* lets the rescue recipes erase in process and checkImage() install */
+	config.insert("boot_script_name", QString("boot.scr"));
+	QString name = root.filePath("sdk/creater.json");
+	if (writeFile(name, QJsonDocument(config).toJson()))
+		return -2;
+
+	json = new JsonHelper(name);
+	card = new CardAssistant(json, QString());
+	return 0;
+}
+
+int CliBench::writeFile(const QString &path, const QByteArray &data, bool executable)
+{
+	QFile f(path);
+	if (!f.open(QIODevice::WriteOnly | QIODevice::Truncate) || f.write(data) != data.size())
+		return -2;
+	if (executable)
+		f.setPermissions(f.permissions() | QFile::ExeOwner | QFile::ExeGroup);
+	return 0;
+}
+
+/* ustar header, only what TarExtractor and GNU tar look at */
+static void tarHeader(char *h, const QByteArray &name, qint64 size, char type)
+{
+	memset(h, 0, 512);
+	strncpy(h, name.constData(), 99);
+	sprintf(h + 100, "%07o", type == '5' ? 0755 : 0644);
+	sprintf(h + 108, "%07o", 0);
+	sprintf(h + 116, "%07o", 0);
+	sprintf(h + 124, "%011llo", (unsigned long long)size);
+	sprintf(h + 136, "%011lo", (unsigned long)time(NULL));
+	h[156] = type;
+	memcpy(h + 257, "ustar", 6);
+	memcpy(h + 263, "00", 2);
+	memset(h + 148, ' ', 8);
+	unsigned sum = 0;
+	for (int i = 0; i < 512; i++)
+		sum += (uchar)h[i];
+	sprintf(h + 148, "%06o", sum);
+}
+
+/*
+ * release_<date>.tar.gz with uImage, ramdisk_zero.gz, rootfs.tar.gz and
+ * device_info.json. Payloads are pseudo random like the compressed
+ * originals, so the outer gzip gains nothing either.
+ */
+int CliBench::writeRelease(const QString &path)
+{
+	gzFile gz = gzopen(QFile::encodeName(path).constData(), "wb1");
+	if (!gz)
+		return -2;
+	QByteArray top = QFileInfo(path).fileName().split(".").first().toLatin1();
+	struct Entry {
+		QByteArray name;
+		qint64 size;
+	} entries[] = {
+		{ top + "/uImage", releaseSize / 16 },
+		{ top + "/ramdisk_zero.gz", releaseSize / 8 },
+		{ top + "/rootfs.tar.gz", releaseSize - releaseSize / 16 - releaseSize / 8 },
+	};
+	QByteArray info("{\n    \"firmware_version\": \"bench\",\n}\n");
+	char h[512];
+	int err = 0;
+
+	tarHeader(h, top + "/", 0, '5');
+	err |= gzwrite(gz, h, 512) != 512;
+	tarHeader(h, top + "/encsoft/", 0, '5');
+	err |= gzwrite(gz, h, 512) != 512;
+	tarHeader(h, top + "/encsoft/device_info.json", info.size(), '0');
+	err |= gzwrite(gz, h, 512) != 512;
+	info.append(QByteArray(512 - info.size() % 512, 0));
+	err |= gzwrite(gz, info.constData(), info.size()) != info.size();
+
+	QByteArray buf(1024 * 1024, 0);
+	quint64 x = 0x9e3779b97f4a7c15ULL;
+	for (unsigned e = 0; e < sizeof(entries) / sizeof(entries[0]) && !err; e++) {
+		tarHeader(h, entries[e].name, entries[e].size, '0');
+		err |= gzwrite(gz, h, 512) != 512;
+		qint64 padded = (entries[e].size + 511) & ~511LL;
+		for (qint64 done = 0; done < padded && !err; ) {
+			int len = qMin<qint64>(buf.size(), padded - done);
+			quint64 *w = (quint64 *)buf.data();
+			for (int i = 0; i < len / 8; i++) {
+				x ^= x << 13;
+				x ^= x >> 7;
+				x ^= x << 17;
+				w[i] = x;
+			}
+			/* the padding after the member is zero */
+			if (done + len > entries[e].size)
+				memset(buf.data() + (entries[e].size - done), 0, done + len - entries[e].size);
+			err |= gzwrite(gz, buf.constData(), len) != len;
+			done += len;
+		}
+	}
+	memset(h, 0, 512);
+	err |= gzwrite(gz, h, 512) != 512;
+	err |= gzwrite(gz, h, 512) != 512;
+	err |= gzclose(gz) != Z_OK;
+	return err ? -2 : 0;
+}
+
+int CliBench::writeMacs(const QString &path, int count)
+{
+	QByteArray text;
+	for (int i = 0; i < count; i++)
+		text += QString("02:42:%1:%2:%3:%4\n").arg((i >> 24) & 0xff, 2, 16, QChar('0'))
+				.arg((i >> 16) & 0xff, 2, 16, QChar('0')).arg((i >> 8) & 0xff, 2, 16, QChar('0'))
+				.arg(i & 0xff, 2, 16, QChar('0')).toLatin1();
+	return writeFile(path, text);
+}
+
+/* /sys/class/block/<name> as the kernel shows a formatted card */
+int CliBench::fakeReader(const QString &name)
+{
+	QString sys = QDir(dir).filePath(QString("sys/class/block/%1").arg(name));
+	if (!QDir().mkpath(sys + "/device"))
+		return -3;
+	int err = writeFile(sys + "/size", QByteArray::number(cardSize / 512));
+	err |= writeFile(sys + "/removable", "1");
+	err |= writeFile(sys + "/device/model", "Bench Card");
+	for (int i = 1; i <= 3 && !err; i++) {
+		QString part = QString("%1/%2%3").arg(sys).arg(name).arg(i);
+		if (!QDir().mkpath(part))
+			return -3;
+		err |= writeFile(part + "/partition", QByteArray::number(i));
+		err |= writeFile(part + "/size", QByteArray::number(cardSize / 512 / 4));
+	}
+	return err ? -2 : 0;
+}
+
+/* sdb.img, sdc.img, ... so the fake readers look like usb readers */
+QString CliBench::cardPath(int index)
+{
+	return QDir(dir).filePath(QString("cards/sd%1.img").arg(QChar('b' + index)));
+}
+
+void CliBench::begin(Sample &s)
+{
+	/* resets VmHWM, so every stage gets its own peak (linux >= 4.0) */
+	QFile refs("/proc/self/clear_refs");
+	if (refs.open(QIODevice::WriteOnly))
+		refs.write("5");
+	s.cpu = cpuTime();
+	s.wall.start();
+}
+
+int CliBench::end(Sample &s, const QString &stage, const QString &media, const QString &recipe,
+				  int err, qint64 bytes)
+{
+	qint64 ms = s.wall.elapsed();
+	qint64 peak = -1;
+	QFile status("/proc/self/status");
+	if (status.open(QIODevice::ReadOnly)) {
+		foreach (QByteArray line, status.readAll().split('\n'))
+			if (line.startsWith("VmHWM:"))
+				peak = line.mid(6).trimmed().split(' ').first().toLongLong();
+	}
+	if (err)
+		failed++;
+
+	QJsonObject o;
+	o.insert("event", QString("bench"));
+	o.insert("stage", stage);
+	o.insert("device", media);
+	if (!recipe.isEmpty())
+		o.insert("recipe", recipe);
+	o.insert("status", err);
+	o.insert("ms", (double)ms);
+	o.insert("cpu_ms", (double)(cpuTime() - s.cpu));
+	o.insert("peak_rss_kb", (double)peak);
+	o.insert("bytes", (double)bytes);
+	if (bytes > 0 && ms > 0)
+		o.insert("mbps", bytes / (1024.0 * 1024.0) / (ms / 1000.0));
+	fprintf(stdout, "%s\n", QJsonDocument(o).toJson(QJsonDocument::Compact).constData());
+	fflush(stdout);
+	return err;
+}
+
+/* steps inside runProgramLoader(), wall time only */
+void CliBench::cardStage(const QString &stage, int err, int ms)
+{
+	QJsonObject o;
+	o.insert("event", QString("stage"));
+	o.insert("stage", stage);
+	o.insert("device", currentCard);
+	o.insert("recipe", currentRecipe);
+	o.insert("status", err);
+	o.insert("ms", ms);
+	fprintf(stdout, "%s\n", QJsonDocument(o).toJson(QJsonDocument::Compact).constData());
+	fflush(stdout);
+}
+
+/* user + system ms of this process and of the scripts it waited for */
+qint64 CliBench::cpuTime()
+{
+	qint64 ms = 0;
+	struct rusage ru;
+	int who[] = { RUSAGE_SELF, RUSAGE_CHILDREN };
+	for (int i = 0; i < 2; i++) {
+		if (getrusage(who[i], &ru))
+			continue;
+		ms += (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000LL +
+				(ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1000;
+	}
+	return ms;
+}
+
+/* data actually on a sparse card image */
+qint64 CliBench::allocated(const QString &path)
+{
+	struct stat st;
+	if (stat(QFile::encodeName(path).constData(), &st))
+		return 0;
+	return (qint64)st.st_blocks * 512;
+}
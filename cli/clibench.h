@@ -0,0 +1,66 @@
+#ifndef CLIBENCH_H
+#define CLIBENCH_H
+
+#include <QObject>
+#include <QStringList>
+#include <QElapsedTimer>
+
+class JsonHelper;
+class CardAssistant;
+
+/*
+ * Provisioning benchmark without hardware or root. Builds a throw away
+ * station under one directory: sparse image files as cards, a fake sysfs
+ * for the reader scan, a synthetic release tarball, stand-in shell
+ * scripts and a sudo that only drops the password. Then every step of
+ * every recipe in list.* runs against it and reports wall time, cpu time,
+ * MB/s and peak RSS as json lines, followed by an in process install
+ * that is fsck'ed, written out as an image and read back.
+ */
+class CliBench : public QObject
+{
+	Q_OBJECT
+public:
+	CliBench(const QString &dir, QObject *parent = 0);
+	~CliBench();
+	void setReleaseSize(qint64 bytes);
+	void setCardSize(qint64 bytes);
+	void setCards(int cards);
+public slots:
+	void start();
+protected:
+	struct Sample {
+		QElapsedTimer wall;
+		qint64 cpu;
+	};
+	int prepare();
+	int writeFile(const QString &path, const QByteArray &data, bool executable = false);
+	int writeRelease(const QString &path);
+	int writeMacs(const QString &path, int count);
+	int fakeReader(const QString &name);
+	QString cardPath(int index);
+	int freshCard(const QString &path);
+	void checkImage();
+	int checkFilesystems(const QString &image);
+	void begin(Sample &s);
+	int end(Sample &s, const QString &stage, const QString &media, const QString &recipe,
+			int err, qint64 bytes);
+	static qint64 cpuTime();
+	static qint64 allocated(const QString &path);
+protected slots:
+	void cardStage(const QString &stage, int err, int ms);
+private:
+	QString dir;
+	QString sdk;
+	QString release;
+	QString currentCard;
+	QString currentRecipe;
+	JsonHelper *json;
+	CardAssistant *card;
+	qint64 releaseSize;
+	qint64 cardSize;
+	int cards;
+	int failed;
+};
+
+#endif // CLIBENCH_H
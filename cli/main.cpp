@@ -0,0 +1,86 @@
+#include "clibatch.h"
+#include "clibench.h"
+#include "json/jsonhelper.h"
+#include "util/tracer.h"
+
+#include <QTimer>
+#include <QCoreApplication>
+#include <QCommandLineParser>
+
+#include <stdio.h>
+
+/*
+ * bilkon-sdcard-cli -r <release> -p <recipe> [-n <cards>] [device...]
+ * bilkon-sdcard-cli --bench <dir> [--bench-size <MB>] [--bench-card-size <MB>] [-n <cards>]
+ *
+ * Runs a recipe without the gui, see CliBatch for the output format, or
+ * the provisioning benchmark on fake cards, see CliBench.
+ * Exit code 0 when every card passed, 1 usage, 2 release/recipe setup,
+ * 3 a card failed, 4 no card swap within the timeout.
+ */
+int main(int argc, char *argv[])
+{
+	QCoreApplication a(argc, argv);
+	QCoreApplication::setApplicationName("bilkon-sdcard-cli");
+
+	QCommandLineParser parser;
+	parser.setApplicationDescription("Bilkon SD card programming, batch mode");
+	parser.addHelpOption();
+	QCommandLineOption config(QStringList() << "c" << "config", "creater.json to use", "file", "creater.json");
+	QCommandLineOption release(QStringList() << "r" << "release", "release tarball in folder.binaries", "tarball");
+	QCommandLineOption recipe(QStringList() << "p" << "recipe", "recipe, a key of list in creater.json", "name");
+	QCommandLineOption count(QStringList() << "n" << "count", "cards to program, swapping cards in between", "cards", "0");
+	QCommandLineOption swap("swap-timeout", "seconds to wait for a card swap", "seconds", "600");
+	QCommandLineOption trace("trace", "write a chrome trace of the run to file", "file");
+	QCommandLineOption bench("bench", "benchmark on fake cards under dir", "dir");
+	QCommandLineOption benchSize("bench-size", "synthetic release size", "MB", "128");
+	QCommandLineOption benchCard("bench-card-size", "fake card size", "MB", "1024");
+	parser.addOption(config);
+	parser.addOption(release);
+	parser.addOption(recipe);
+	parser.addOption(count);
+	parser.addOption(swap);
+	parser.addOption(trace);
+	parser.addOption(bench);
+	parser.addOption(benchSize);
+	parser.addOption(benchCard);
+	parser.addPositionalArgument("device", "card readers (sdb, mmcblk0), all of them when omitted", "[device...]");
+	parser.process(a);
+
+	Tracer::setEnabled(parser.isSet(trace));
+	bool ok = false;
+	int cards = parser.value(count).toInt(&ok);
+	if (!ok || cards < 0) {
+		fprintf(stderr, "invalid card count '%s'\n", qPrintable(parser.value(count)));
+		return CliBatch::EXIT_USAGE;
+	}
+	if (parser.isSet(bench)) {
+		CliBench b(parser.value(bench));
+		b.setReleaseSize(parser.value(benchSize).toLongLong() * 1024 * 1024);
+		b.setCardSize(parser.value(benchCard).toLongLong() * 1024 * 1024);
+		if (cards)
+			b.setCards(cards);
+		QTimer::singleShot(0, &b, SLOT(start()));
+		int code = a.exec();
+		if (parser.isSet(trace) && Tracer::exportChrome(parser.value(trace)))
+			fprintf(stderr, "trace not written to %s\n", qPrintable(parser.value(trace)));
+		return code;
+	}
+
+	QStringList devices;
+	foreach (QString dev, parser.positionalArguments())
+		devices << (dev.startsWith("/dev/") ? dev.mid(5) : dev);
+
+	JsonHelper json(parser.value(config));
+	CliBatch batch(&json);
+	batch.setRelease(parser.value(release));
+	batch.setRecipe(parser.value(recipe));
+	batch.setDevices(devices);
+	batch.setCount(cards);
+	batch.setSwapTimeout(parser.value(swap).toInt());
+	QTimer::singleShot(0, &batch, SLOT(start()));
+	int code = a.exec();
+	if (parser.isSet(trace) && Tracer::exportChrome(parser.value(trace)))
+		fprintf(stderr, "trace not written to %s\n", qPrintable(parser.value(trace)));
+	return code;
+}
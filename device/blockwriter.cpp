@@ -0,0 +1,494 @@
+#include "blockwriter.h"
+#include "mbr.h"
+#include "util/tracer.h"
+
+#include <QMap>
+#include <QFile>
+#include <QDebug>
+#include <QRegExp>
+#include <QProcess>
+#include <QFileInfo>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/mount.h>
+#include <linux/fs.h>
+#include <linux/falloc.h>
+
+BlockWriter::BlockWriter(const QString &target, QObject *parent)
+	: QObject(parent)
+{
+	this->target = target;
+	fd = -1;
+	bufferedFd = -1;
+	direct = false;
+	sector = 512;
+	buffer = NULL;
+	written = 0;
+	total = 0;
+	elapsedMs = 0;
+}
+
+BlockWriter::~BlockWriter()
+{
+	close();
+}
+
+int BlockWriter::open()
+{
+	if (isOpen())
+		return 0;
+	if (unmountPartitions())
+		return -1;
+	QByteArray path = QFile::encodeName(target);
+	fd = ::open(path.constData(), O_RDWR | O_DIRECT | O_CLOEXEC);
+	direct = fd >= 0;
+	if (fd < 0 && errno == EINVAL)
+		fd = ::open(path.constData(), O_RDWR | O_CLOEXEC);
+	if (fd < 0)
+		return setError(QString("open %1: %2").arg(target).arg(strerror(errno)));
+	/* unaligned heads and tails go through the page cache */
+	bufferedFd = ::open(path.constData(), O_RDWR | O_CLOEXEC);
+	if (bufferedFd < 0) {
+		close();
+		return setError(QString("open %1: %2").arg(target).arg(strerror(errno)));
+	}
+
+	int ssz = 0;
+	if (ioctl(fd, BLKSSZGET, &ssz) == 0 && ssz > 0)
+		sector = ssz;
+	else
+		sector = 4096;
+	if (posix_memalign((void **)&buffer, 4096, bufferSize)) {
+		buffer = NULL;
+		close();
+		return setError("out of memory");
+	}
+	return 0;
+}
+
+void BlockWriter::close()
+{
+	if (fd >= 0)
+		::close(fd);
+	if (bufferedFd >= 0)
+		::close(bufferedFd);
+	fd = -1;
+	bufferedFd = -1;
+	free(buffer);
+	buffer = NULL;
+}
+
+bool BlockWriter::isOpen()
+{
+	return fd >= 0;
+}
+
+bool BlockWriter::isDirect()
+{
+	return direct;
+}
+
+qint64 BlockWriter::size()
+{
+	if (!isOpen())
+		return -1;
+	quint64 bytes = 0;
+	if (ioctl(fd, BLKGETSIZE64, &bytes) == 0)
+		return bytes;
+	struct stat st;
+	if (fstat(fd, &st))
+		return -1;
+	return st.st_size;
+}
+
+int BlockWriter::sectorSize()
+{
+	return sector;
+}
+
+/*
+ * Start of a primary partition (1..4) read from the MBR, so the same code
+ * works for /dev/sdX and for a file backed image.
+ */
+qint64 BlockWriter::partitionOffset(int partition)
+{
+	if (!isOpen())
+		return -1;
+	uchar mbr[512];
+	if (pread(bufferedFd, mbr, sizeof(mbr), 0) != sizeof(mbr))
+		return -1;
+	foreach (MbrPartition p, parseMbr(mbr))
+		if (p.index == partition)
+			return p.start;
+	return -1;
+}
+
+void BlockWriter::addExtent(const QString &source, qint64 offset, qint64 length)
+{
+	Extent e;
+	e.source = source;
+	e.offset = offset;
+	e.length = length;
+	extents << e;
+}
+
+void BlockWriter::clearExtents()
+{
+	extents.clear();
+}
+
+int BlockWriter::write()
+{
+	TRACE_SPAN("block_write");
+	written = 0;
+	total = 0;
+	foreach (const Extent &e, extents)
+		total += e.length < 0 ? QFile(e.source).size() : e.length;
+
+	elapsed.start();
+	foreach (const Extent &e, extents) {
+		int err = writeFile(e.source, e.offset, e.length);
+		if (err)
+			return err;
+	}
+	int err = sync();
+	elapsedMs = elapsed.elapsed();
+	return err;
+}
+
+/* progress and throughput for writes made piece by piece with writeData() */
+void BlockWriter::begin(qint64 total)
+{
+	written = 0;
+	this->total = total;
+	elapsedMs = 0;
+	elapsed.start();
+}
+
+/* length bytes of source, starting at from, go to offset; -1: up to the end */
+int BlockWriter::writeFile(const QString &source, qint64 offset, qint64 length, qint64 from)
+{
+	if (!isOpen())
+		return setError("target is not open");
+	QFile f(source);
+	if (!f.open(QIODevice::ReadOnly))
+		return setError(QString("open %1: %2").arg(source).arg(f.errorString()));
+	if (length < 0)
+		length = f.size() - from;
+	if (from && !f.seek(from))
+		return setError(QString("seek %1: %2").arg(source).arg(f.errorString()));
+	if (!elapsed.isValid())
+		elapsed.start();
+
+	posix_fadvise(f.handle(), 0, 0, POSIX_FADV_SEQUENTIAL);
+	qint64 done = 0;
+	while (done < length) {
+		qint64 chunk = qMin<qint64>(bufferSize, length - done);
+		qint64 len = f.read(buffer, chunk);
+		if (len <= 0)
+			return setError(QString("read %1: short read").arg(source));
+		int err = writeChunk(buffer, len, offset + done);
+		if (err)
+			return err;
+		done += len;
+	}
+	elapsedMs = elapsed.elapsed();
+	return 0;
+}
+
+int BlockWriter::writeData(const char *data, qint64 len, qint64 offset)
+{
+	if (!isOpen())
+		return setError("target is not open");
+	qint64 done = 0;
+	while (done < len) {
+		qint64 chunk = qMin<qint64>(bufferSize, len - done);
+		memcpy(buffer, data + done, chunk);
+		int err = writeChunk(buffer, chunk, offset + done);
+		if (err)
+			return err;
+		done += chunk;
+	}
+	if (elapsed.isValid())
+		elapsedMs = elapsed.elapsed();
+	return 0;
+}
+
+/* data is page aligned already (a BufferPool buffer), written without a copy */
+int BlockWriter::writeBuffer(const char *data, qint64 len, qint64 offset)
+{
+	if (!isOpen())
+		return setError("target is not open");
+	int err = writeChunk(data, len, offset);
+	if (!err && elapsed.isValid())
+		elapsedMs = elapsed.elapsed();
+	return err;
+}
+
+/* through the page cache, which a discard drops for the range */
+int BlockWriter::readData(char *data, qint64 len, qint64 offset)
+{
+	if (!isOpen())
+		return setError("target is not open");
+	qint64 done = 0;
+	while (done < len) {
+		ssize_t ret = pread(bufferedFd, data + done, len - done, offset + done);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return setError(QString("read %1: %2").arg(target).arg(ret ? strerror(errno) : "short read"));
+		done += ret;
+	}
+	return 0;
+}
+
+/* data must live in the aligned buffer */
+int BlockWriter::writeChunk(const char *data, qint64 len, qint64 offset)
+{
+	qint64 aligned = 0;
+	if (direct && offset % sector == 0)
+		aligned = len - len % sector;
+
+	while (aligned > 0) {
+		ssize_t ret = pwrite(fd, data, aligned, offset);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return setError(QString("write %1: %2").arg(target).arg(strerror(errno)));
+		data += ret;
+		offset += ret;
+		aligned -= ret;
+		len -= ret;
+		written += ret;
+	}
+	while (len > 0) {
+		ssize_t ret = pwrite(bufferedFd, data, len, offset);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return setError(QString("write %1: %2").arg(target).arg(strerror(errno)));
+		data += ret;
+		offset += ret;
+		len -= ret;
+		written += ret;
+	}
+	emit progress(written, total);
+	return 0;
+}
+
+int BlockWriter::sync()
+{
+	if (!isOpen())
+		return 0;
+	if (fdatasync(bufferedFd) || fdatasync(fd))
+		return setError(QString("sync %1: %2").arg(target).arg(strerror(errno)));
+	return 0;
+}
+
+/*
+ * Drops the range: BLKDISCARD on a card, a punched hole in an image file.
+ * Returns 1 when the target can not discard, which is not an error.
+ */
+int BlockWriter::discard(qint64 offset, qint64 len)
+{
+	if (!isOpen())
+		return setError("target is not open");
+	struct stat st;
+	if (fstat(bufferedFd, &st))
+		return setError(QString("stat %1: %2").arg(target).arg(strerror(errno)));
+	int ret;
+	if (S_ISBLK(st.st_mode)) {
+		quint64 range[2] = { (quint64)offset, (quint64)len };
+		ret = ioctl(bufferedFd, BLKDISCARD, range);
+	} else {
+		ret = fallocate(bufferedFd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, len);
+	}
+	if (ret && (errno == EOPNOTSUPP || errno == ENOTTY || errno == EINVAL))
+		return 1;
+	if (ret)
+		return setError(QString("discard %1: %2").arg(target).arg(strerror(errno)));
+	return 0;
+}
+
+/*
+ * Clears the range as cheaply as the target allows: secure discard when
+ * asked for, plain discard, BLKZEROOUT when the card can not discard.
+ * method tells which one did it.
+ */
+int BlockWriter::erase(qint64 offset, qint64 len, bool secure, QString *method)
+{
+	TRACE_SPAN("block_erase");
+	if (!isOpen())
+		return setError("target is not open");
+	struct stat st;
+	if (fstat(bufferedFd, &st))
+		return setError(QString("stat %1: %2").arg(target).arg(strerror(errno)));
+	quint64 range[2] = { (quint64)offset, (quint64)len };
+	if (S_ISBLK(st.st_mode) && secure) {
+		if (ioctl(bufferedFd, BLKSECDISCARD, range) == 0) {
+			if (method)
+				*method = "secure discard";
+			return 0;
+		}
+		if (errno != EOPNOTSUPP && errno != EINVAL)
+			return setError(QString("secure discard %1: %2").arg(target).arg(strerror(errno)));
+	}
+	int err = discard(offset, len);
+	if (err <= 0) {
+		if (!err && method)
+			*method = S_ISBLK(st.st_mode) ? "discard" : "hole";
+		return err;
+	}
+	if (!S_ISBLK(st.st_mode))
+		return setError(QString("erase %1: not supported").arg(target));
+	if (ioctl(bufferedFd, BLKZEROOUT, range))
+		return setError(QString("zero out %1: %2").arg(target).arg(strerror(errno)));
+	if (method)
+		*method = "zero out";
+	return 0;
+}
+
+/*
+ * The range reads back as zero afterwards: BLKZEROOUT on a card, a hole
+ * in an image file, plain zero writes when neither works.
+ */
+int BlockWriter::zeroOut(qint64 offset, qint64 len)
+{
+	if (!isOpen())
+		return setError("target is not open");
+	struct stat st;
+	if (fstat(bufferedFd, &st))
+		return setError(QString("stat %1: %2").arg(target).arg(strerror(errno)));
+	int ret;
+	if (S_ISBLK(st.st_mode)) {
+		quint64 range[2] = { (quint64)offset, (quint64)len };
+		ret = ioctl(bufferedFd, BLKZEROOUT, range);
+	} else {
+		ret = fallocate(bufferedFd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, len);
+	}
+	if (!ret)
+		return 0;
+	if (errno != EOPNOTSUPP && errno != ENOTTY && errno != EINVAL)
+		return setError(QString("zero out %1: %2").arg(target).arg(strerror(errno)));
+	memset(buffer, 0, bufferSize);
+	qint64 done = 0;
+	while (done < len) {
+		qint64 chunk = qMin<qint64>(bufferSize, len - done);
+		int err = writeChunk(buffer, chunk, offset + done);
+		if (err)
+			return err;
+		done += chunk;
+	}
+	return 0;
+}
+
+/* mount points in /proc/self/mounts have blanks etc. as \ooo */
+static QString unescapeMount(const QByteArray &field)
+{
+	QByteArray out;
+	for (int i = 0; i < field.size(); i++) {
+		if (field[i] == '\\' && i + 3 < field.size() && field.mid(i + 1, 3).toInt(0, 8) > 0) {
+			out += (char)field.mid(i + 1, 3).toInt(0, 8);
+			i += 3;
+		} else
+			out += field[i];
+	}
+	return QFile::decodeName(out);
+}
+
+/*
+ * Desktops automount a card as soon as it is inserted. Anything mounted
+ * from the target goes before it is written: the mount would write its
+ * stale view back and BLKRRPART fails with EBUSY. umount(2) needs root,
+ * what udisks mounted for the station user udisks unmounts. A no-op for
+ * file backed images.
+ */
+int BlockWriter::unmountPartitions()
+{
+	struct stat st;
+	if (::stat(QFile::encodeName(target).constData(), &st) || !S_ISBLK(st.st_mode))
+		return 0;
+	QString disk = QFileInfo(target).canonicalFilePath();
+	QFile mounts("/proc/self/mounts");
+	if (!mounts.open(QIODevice::ReadOnly))
+		return setError(QString("open /proc/self/mounts: %1").arg(mounts.errorString()));
+	QRegExp partition("p?\\d+");
+	QStringList devices;
+	QMap<QString, QStringList> points;
+	foreach (QByteArray line, mounts.readAll().split('\n')) {
+		QList<QByteArray> f = line.split(' ');
+		if (f.size() < 2 || !f[0].startsWith("/dev/"))
+			continue;
+		QString dev = QFileInfo(QFile::decodeName(f[0])).canonicalFilePath();
+		if (dev != disk && !(dev.startsWith(disk) && partition.exactMatch(dev.mid(disk.size()))))
+			continue;
+		if (!devices.contains(dev))
+			devices << dev;
+		/* nested mounts first */
+		points[dev].prepend(unescapeMount(f[1]));
+	}
+	foreach (QString dev, devices) {
+		bool denied = false;
+		foreach (QString point, points.value(dev)) {
+			if (::umount2(QFile::encodeName(point).constData(), 0) == 0)
+				continue;
+			if (errno != EPERM)
+				return setError(QString("umount %1: %2").arg(point).arg(strerror(errno)));
+			denied = true;
+		}
+		if (!denied)
+			continue;
+		QProcess udisks;
+		udisks.setProcessChannelMode(QProcess::MergedChannels);
+		udisks.start("udisksctl", QStringList() << "unmount" << "--no-user-interaction" << "-b" << dev);
+		if (udisks.waitForFinished(30000) && udisks.exitStatus() == QProcess::NormalExit && !udisks.exitCode())
+			continue;
+		QString out = QString::fromLocal8Bit(udisks.readAll()).trimmed();
+		return setError(QString("umount %1: %2").arg(dev).arg(out.isEmpty() ? udisks.errorString() : out));
+	}
+	return 0;
+}
+
+/* new partition table to the kernel, a no-op for file backed images */
+int BlockWriter::rereadPartitions()
+{
+	if (!isOpen())
+		return 0;
+	struct stat st;
+	if (fstat(bufferedFd, &st) || !S_ISBLK(st.st_mode))
+		return 0;
+	if (ioctl(bufferedFd, BLKRRPART) && errno != EINVAL)
+		return setError(QString("reread partitions %1: %2").arg(target).arg(strerror(errno)));
+	return 0;
+}
+
+qint64 BlockWriter::bytesWritten()
+{
+	return written;
+}
+
+/* MB/s of the last write() */
+double BlockWriter::throughput()
+{
+	if (elapsedMs <= 0)
+		return 0;
+	return (written / (1024.0 * 1024.0)) / (elapsedMs / 1000.0);
+}
+
+QString BlockWriter::errorString()
+{
+	return error;
+}
+
+int BlockWriter::setError(const QString &err)
+{
+	error = err;
+	qDebug() << "BlockWriter:" << err;
+	return -2;
+}
@@ -0,0 +1,74 @@
+#ifndef BLOCKWRITER_H
+#define BLOCKWRITER_H
+
+#include <QList>
+#include <QObject>
+#include <QElapsedTimer>
+
+/*
+ * Writes payloads straight onto a card (/dev/sdX) or onto a file backed
+ * image with large aligned O_DIRECT writes, bypassing the page cache.
+ * Targets that refuse O_DIRECT (tmpfs files etc.) fall back to buffered
+ * writes plus fdatasync().
+ */
+class BlockWriter : public QObject
+{
+	Q_OBJECT
+public:
+	struct Extent {
+		QString source;		/* file to copy */
+		qint64 offset;		/* byte offset on the target */
+		qint64 length;		/* -1: whole file */
+	};
+
+	BlockWriter(const QString &target, QObject *parent = 0);
+	~BlockWriter();
+	int open();
+	void close();
+	bool isOpen();
+	bool isDirect();
+	qint64 size();
+	int sectorSize();
+	qint64 partitionOffset(int partition);
+
+	void addExtent(const QString &source, qint64 offset, qint64 length = -1);
+	void clearExtents();
+	int write();
+	void begin(qint64 total);
+	int writeFile(const QString &source, qint64 offset, qint64 length = -1, qint64 from = 0);
+	int writeData(const char *data, qint64 len, qint64 offset);
+	int writeBuffer(const char *data, qint64 len, qint64 offset);
+	int readData(char *data, qint64 len, qint64 offset);
+	int sync();
+	int unmountPartitions();
+	int rereadPartitions();
+	int discard(qint64 offset, qint64 len);
+	int erase(qint64 offset, qint64 len, bool secure, QString *method = 0);
+	int zeroOut(qint64 offset, qint64 len);
+
+	qint64 bytesWritten();
+	double throughput();
+	QString errorString();
+
+	static const int bufferSize = 4 * 1024 * 1024;
+signals:
+	void progress(qint64 written, qint64 total);
+protected:
+	int writeChunk(const char *data, qint64 len, qint64 offset);
+	int setError(const QString &err);
+private:
+	QString target;
+	int fd;
+	int bufferedFd;
+	bool direct;
+	int sector;
+	char *buffer;
+	qint64 written;
+	qint64 total;
+	QElapsedTimer elapsed;
+	qint64 elapsedMs;
+	QString error;
+	QList<Extent> extents;
+};
+
+#endif // BLOCKWRITER_H
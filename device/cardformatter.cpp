@@ -0,0 +1,812 @@
+#include "cardformatter.h"
+#include "blockwriter.h"
+#include "util/tracer.h"
+
+#include <QUuid>
+#include <QDebug>
+#include <QVector>
+#include <QDateTime>
+#include <QFileInfo>
+
+#include <ctype.h>
+#include <string.h>
+
+#define SECTOR			512
+#define MIB				(1024 * 1024LL)
+
+/* ext4 as mke2fs -t ext4 -O ^resize_inode,^flex_bg would lay it out */
+#define EXT_BLOCK		4096
+#define EXT_INODE		256
+#define EXT_INODE_RATIO	16384
+#define EXT_GROUP		(EXT_BLOCK * 8)
+#define EXT_FIRST_INO	11
+#define EXT_ROOT_INO	2
+#define EXT_JOURNAL_INO	8
+#define EXT_DESC		32
+
+#define EXT_COMPAT		0x0004	/* has_journal */
+#define EXT_INCOMPAT	0x0042	/* filetype, extents */
+#define EXT_RO_COMPAT	0x0073	/* sparse_super, large_file, uninit_bg, dir_nlink, extra_isize */
+
+#define BG_INODE_UNINIT	0x0001
+#define BG_BLOCK_UNINIT	0x0002
+
+static void put16(uchar *p, quint16 v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+}
+
+static void put32(uchar *p, quint32 v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+static void putBe32(uchar *p, quint32 v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+static void setBits(uchar *map, quint32 from, quint32 to)
+{
+	for (quint32 i = from; i < to; i++)
+		map[i / 8] |= 1 << (i % 8);
+}
+
+/* crc16 of lib/crc16.c, what uninit_bg checksums group descriptors with */
+static quint16 crc16(quint16 crc, const uchar *p, int len)
+{
+	while (len--) {
+		crc ^= *p++;
+		for (int i = 0; i < 8; i++)
+			crc = (crc & 1) ? (crc >> 1) ^ 0xa001 : crc >> 1;
+	}
+	return crc;
+}
+
+/* sparse_super: backups only in groups 0, 1 and powers of 3, 5 and 7 */
+static bool hasSuper(quint32 group)
+{
+	if (group <= 1)
+		return true;
+	for (quint32 base = 3; base <= 7; base += 2) {
+		quint64 n = base;
+		while (n < group)
+			n *= base;
+		if (n == group)
+			return true;
+	}
+	return false;
+}
+
+static void putExtentInode(uchar *inode, quint16 mode, quint16 links, quint32 block,
+						   quint32 count, quint32 now)
+{
+	put16(inode + 0, mode);
+	put32(inode + 4, count * EXT_BLOCK);		/* i_size_lo */
+	put32(inode + 8, now);						/* atime */
+	put32(inode + 12, now);						/* ctime */
+	put32(inode + 16, now);						/* mtime */
+	put16(inode + 26, links);
+	put32(inode + 28, count * (EXT_BLOCK / 512));	/* i_blocks_lo */
+	put32(inode + 32, 0x80000);					/* EXT4_EXTENTS_FL */
+	/* extent header and a single extent in i_block */
+	put16(inode + 40, 0xf30a);
+	put16(inode + 42, 1);
+	put16(inode + 44, 4);
+	put16(inode + 46, 0);
+	put32(inode + 52, 0);
+	put16(inode + 56, count);
+	put16(inode + 58, 0);
+	put32(inode + 60, block);
+	put16(inode + 128, 32);						/* i_extra_isize */
+	put32(inode + 144, now);					/* crtime */
+}
+
+static int putDirent(uchar *p, quint32 ino, quint16 len, const char *name, uchar type = 2)
+{
+	int n = strlen(name);
+	put32(p, ino);
+	put16(p + 4, len);
+	p[6] = n;
+	p[7] = type;								/* 1 file, 2 directory */
+	memcpy(p + 8, name, n);
+	return len;
+}
+
+/* (first block, count) pieces of a file, one per block group it crosses */
+typedef QList<QPair<quint32, quint32> > ExtRuns;
+
+/* hands out the data blocks of a fresh ext4 in order, group after group */
+struct ExtAllocator {
+	quint64 blocks;
+	quint32 groups;
+	quint32 gdt;
+	quint32 itb;
+	quint32 used0;
+	quint32 group;
+	quint32 next;
+	QVector<quint32> used;		/* blocks handed out, per group */
+
+	quint32 first(quint32 g)
+	{
+		return g ? (hasSuper(g) ? 1 + gdt : 0) + 2 + itb : used0;
+	}
+	quint32 end(quint32 g)
+	{
+		return qMin<quint64>(EXT_GROUP, blocks - (quint64)g * EXT_GROUP);
+	}
+	bool take(quint32 count, ExtRuns &runs)
+	{
+		while (count) {
+			if (next >= end(group)) {
+				if (group + 1 >= groups)
+					return false;
+				group++;
+				next = first(group);
+				continue;
+			}
+			quint32 n = qMin(count, end(group) - next);
+			runs << qMakePair((quint32)(group * EXT_GROUP + next), n);
+			used[group] += n;
+			next += n;
+			count -= n;
+		}
+		return true;
+	}
+};
+
+/*
+ * Regular file inode. Up to four pieces fit in i_block, more go into one
+ * leaf block that i_block points to (depth 1).
+ */
+static void putFileInode(uchar *inode, qint64 size, const ExtRuns &runs, quint32 leaf,
+						 uchar *leafData, quint32 now)
+{
+	quint64 count = leaf ? 1 : 0;
+	foreach (ExtRuns::value_type r, runs)
+		count += r.second;
+	put16(inode + 0, 0100644);
+	put32(inode + 4, size);						/* i_size_lo */
+	put32(inode + 8, now);
+	put32(inode + 12, now);
+	put32(inode + 16, now);
+	put16(inode + 26, 1);
+	put32(inode + 28, count * (EXT_BLOCK / 512));
+	put32(inode + 32, 0x80000);					/* EXT4_EXTENTS_FL */
+	put32(inode + 108, (quint64)size >> 32);	/* i_size_high */
+	put16(inode + 128, 32);
+	put32(inode + 144, now);
+
+	uchar *h = leaf ? leafData : inode + 40;
+	put16(h + 0, 0xf30a);
+	put16(h + 2, runs.size());
+	put16(h + 4, leaf ? (EXT_BLOCK - 12) / 12 : 4);
+	put16(h + 6, 0);
+	quint32 logical = 0;
+	for (int i = 0; i < runs.size(); i++) {
+		uchar *e = h + 12 + i * 12;
+		put32(e + 0, logical);
+		put16(e + 4, runs[i].second);
+		put16(e + 6, 0);
+		put32(e + 8, runs[i].first);
+		logical += runs[i].second;
+	}
+	if (leaf) {
+		uchar *i = inode + 40;
+		put16(i + 0, 0xf30a);
+		put16(i + 2, 1);
+		put16(i + 4, 4);
+		put16(i + 6, 1);						/* depth */
+		put32(i + 12, 0);						/* first logical block */
+		put32(i + 16, leaf);
+		put16(i + 20, 0);
+	}
+}
+
+static void putFatChain(uchar *fat, bool fat32, quint32 cluster, quint32 next)
+{
+	if (fat32)
+		put32(fat + cluster * 4, next);
+	else
+		put16(fat + cluster * 2, next);
+}
+
+/*
+ * Directory entry for name: long name entries first, then the 8.3 alias.
+ * Returns the number of 32 byte slots used.
+ */
+static int putFatEntry(uchar *e, const QString &name, int index, quint32 cluster, quint32 size)
+{
+	QString base = name.section('.', 0, -2);
+	QString ext = name.section('.', -1);
+	if (base.isEmpty()) {
+		base = name;
+		ext.clear();
+	}
+	QByteArray shortBase = base.toUpper().toLatin1();
+	QByteArray shortExt = ext.toUpper().toLatin1();
+	bool lossy = shortBase.size() > 8 || shortExt.size() > 3;
+	for (int i = 0; i < shortBase.size(); i++)
+		if (!isalnum((uchar)shortBase[i]) && !strchr("_-~!#$%&'(){}^@`", shortBase[i])) {
+			shortBase[i] = '_';
+			lossy = true;
+		}
+	if (lossy)
+		shortBase = shortBase.left(6) + "~" + QByteArray::number(index + 1);
+	uchar alias[11];
+	memset(alias, ' ', sizeof(alias));
+	memcpy(alias, shortBase.constData(), qMin(8, shortBase.size()));
+	memcpy(alias + 8, shortExt.constData(), qMin(3, shortExt.size()));
+	uchar sum = 0;
+	for (int i = 0; i < 11; i++)
+		sum = ((sum & 1) ? 0x80 : 0) + (sum >> 1) + alias[i];
+
+	static const int offsets[13] = { 1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30 };
+	int parts = (name.size() + 12) / 13;
+	for (int k = parts; k >= 1; k--, e += 32) {
+		e[0] = k | (k == parts ? 0x40 : 0);
+		e[11] = 0x0f;
+		e[13] = sum;
+		for (int i = 0; i < 13; i++) {
+			int at = (k - 1) * 13 + i;
+			quint16 ch = at < name.size() ? name[at].unicode() : at == name.size() ? 0 : 0xffff;
+			put16(e + offsets[i], ch);
+		}
+	}
+
+	QDateTime now = QDateTime::currentDateTime();
+	quint16 date = ((now.date().year() - 1980) << 9) | (now.date().month() << 5) | now.date().day();
+	quint16 time = (now.time().hour() << 11) | (now.time().minute() << 5) | (now.time().second() / 2);
+	memcpy(e, alias, 11);
+	e[11] = 0x20;								/* archive */
+	put16(e + 14, time);
+	put16(e + 16, date);
+	put16(e + 18, date);
+	put16(e + 20, cluster >> 16);
+	put16(e + 22, time);
+	put16(e + 24, date);
+	put16(e + 26, cluster);
+	put32(e + 28, size);
+	return parts + 1;
+}
+
+CardFormatter::CardFormatter(const QString &target, QObject *parent)
+	: QObject(parent)
+{
+	this->target = target;
+	writer = NULL;
+	discard = true;
+	result.size = 0;
+}
+
+/* off for cards that take long over erase commands */
+void CardFormatter::setDiscard(bool on)
+{
+	discard = on;
+}
+
+/* copied into the root of the FAT partition as name, in one piece each */
+void CardFormatter::addBootFile(const QString &source, const QString &name)
+{
+	bootFiles << qMakePair(source, name);
+}
+
+/* copied into the root of the system (first ext4) partition as name */
+void CardFormatter::addSystemFile(const QString &source, const QString &name)
+{
+	systemFiles << qMakePair(source, name);
+}
+
+/*
+ * format.sh layout: 32 MiB FAT at 1 MiB, the rest split in two halves,
+ * every start on a 1 MiB boundary. The system partition stops growing at
+ * systemMax (what an 8 GB card gets), bigger cards only add to the data
+ * partition. Empty when the card is too small.
+ */
+CardLayout CardFormatter::plan(qint64 size)
+{
+	CardLayout l;
+	l.size = size;
+	qint64 end = qMin<qint64>(size, 0xffffffffLL * SECTOR) & ~(MIB - 1);
+	qint64 rest = end - bootStart - bootSize;
+	if (rest < 32 * MIB)
+		return l;
+	MbrPartition p;
+	p.index = 1;
+	p.type = 0x0c;
+	p.start = bootStart;
+	p.size = bootSize;
+	l.partitions << p;
+	l.filesystems << (bootSize < 512 * MIB ? "fat16" : "fat32");
+	p.index = 2;
+	p.type = 0x83;
+	p.start = bootStart + bootSize;
+	p.size = rest / 2;
+	if (p.size > systemMax)
+		p.size = systemMax;
+	p.size &= ~(MIB - 1);
+	l.partitions << p;
+	l.filesystems << "ext4";
+	p.index = 3;
+	p.start += p.size;
+	p.size = end - p.start;
+	l.partitions << p;
+	l.filesystems << "ext4";
+	return l;
+}
+
+int CardFormatter::format()
+{
+	TRACE_SPAN("card_format");
+	result = CardLayout();
+	placed.clear();
+	BlockWriter w(target);
+	if (w.open())
+		return setError(w.errorString());
+	writer = &w;
+
+	CardLayout l = plan(w.size());
+	if (l.partitions.isEmpty()) {
+		writer = NULL;
+		setError(QString("%1: %2 bytes is too small").arg(target).arg(l.size));
+		return -6;
+	}
+	int total = l.partitions.size() + 1;
+	emit progress(0, total);
+	/* whatever the old filesystems left goes, metadata is written into a clean card */
+	if (discard) {
+		qint64 end = mbrLayoutEnd(l.partitions);
+		int err = w.discard(0, end);
+		if (err < 0) {
+			writer = NULL;
+			return setError(w.errorString());
+		}
+		if (err)
+			qDebug() << "CardFormatter:" << target << "can not discard";
+	}
+	bool system = true;
+	for (int i = 0; i < l.partitions.size(); i++) {
+		QString fs = l.filesystems[i];
+		int err;
+		if (fs == "ext4") {
+			err = formatExt(l.partitions[i], system ? systemFiles : QList<QPair<QString, QString> >());
+			system = false;
+		} else
+			err = formatFat(l.partitions[i], fs);
+		if (err) {
+			writer = NULL;
+			return err;
+		}
+		l.filesystems[i] = fs;
+		emit progress(i + 1, total);
+	}
+	/* the table goes last, a card cut off half way has no half made partitions */
+	quint32 signature = QDateTime::currentMSecsSinceEpoch();
+	int err = write(makeMbr(l.partitions, signature), 0);
+	if (!err && w.sync())
+		err = setError(w.errorString());
+	if (!err && w.rereadPartitions())
+		err = setError(w.errorString());
+	writer = NULL;
+	if (err)
+		return err;
+	emit progress(total, total);
+
+	/* report what is on the card, not what was meant to be */
+	result.size = l.size;
+	result.partitions = readMbr(target);
+	result.filesystems = l.filesystems;
+	result.payloads = placed;
+	if (result.partitions.size() != l.partitions.size())
+		return setError(QString("%1: partition table did not read back").arg(target));
+	return 0;
+}
+
+CardLayout CardFormatter::layout()
+{
+	return result;
+}
+
+/*
+ * FAT16 below 512 MiB, FAT32 above, cluster sizes as the Microsoft FAT
+ * specification tabulates them. Boot sector, FATs and root directory are
+ * contiguous and go out as a single write.
+ */
+int CardFormatter::formatFat(const MbrPartition &p, QString &fs)
+{
+	quint32 sectors = p.size / SECTOR;
+	bool fat32 = p.size >= 512 * MIB;
+	quint32 spc;
+	if (fat32)
+		spc = p.size <= 8192 * MIB ? 8 : p.size <= 16384 * MIB ? 16 : p.size <= 32768 * MIB ? 32 : 64;
+	else
+		spc = p.size <= 16 * MIB ? 2 : p.size <= 128 * MIB ? 4 : p.size <= 256 * MIB ? 8 : 16;
+	quint32 reserved = fat32 ? 32 : 1;
+	quint32 rootSectors = fat32 ? 0 : 512 * 32 / SECTOR;
+	quint32 tmp = 256 * spc + 2;
+	if (fat32)
+		tmp /= 2;
+	quint32 fatSize = (sectors - reserved - rootSectors + tmp - 1) / tmp;
+	quint32 dataStart = reserved + 2 * fatSize + rootSectors;
+	quint32 clusters = (sectors - dataStart) / spc;
+	if (clusters < 4085 || (fat32 != (clusters >= 65525)))
+		return setError(QString("no FAT layout for %1 bytes").arg(p.size));
+
+	QByteArray meta((dataStart + (fat32 ? spc : 0)) * SECTOR, 0);
+	uchar *b = (uchar *)meta.data();
+	b[0] = 0xeb;
+	b[1] = fat32 ? 0x58 : 0x3c;
+	b[2] = 0x90;
+	memcpy(b + 3, "BILKON  ", 8);
+	put16(b + 11, SECTOR);
+	b[13] = spc;
+	put16(b + 14, reserved);
+	b[16] = 2;
+	put16(b + 17, fat32 ? 0 : 512);
+	put16(b + 19, !fat32 && sectors < 65536 ? sectors : 0);
+	b[21] = 0xf8;
+	put16(b + 22, fat32 ? 0 : fatSize);
+	put16(b + 24, 63);
+	put16(b + 26, 255);
+	put32(b + 28, p.start / SECTOR);
+	put32(b + 32, fat32 || sectors >= 65536 ? sectors : 0);
+	uchar *ext = b + 36;
+	if (fat32) {
+		put32(b + 36, fatSize);
+		put32(b + 44, 2);						/* root directory cluster */
+		put16(b + 48, 1);						/* fsinfo sector */
+		put16(b + 50, 6);						/* backup boot sector */
+		ext = b + 64;
+	}
+	ext[0] = 0x80;
+	ext[2] = 0x29;
+	put32(ext + 3, QDateTime::currentMSecsSinceEpoch());
+	memcpy(ext + 7, "NO NAME    ", 11);
+	memcpy(ext + 18, fat32 ? "FAT32   " : "FAT16   ", 8);
+	b[510] = 0x55;
+	b[511] = 0xaa;
+
+	for (int i = 0; i < 2; i++) {
+		uchar *fat = b + (reserved + i * fatSize) * SECTOR;
+		if (fat32) {
+			put32(fat, 0x0ffffff8);
+			put32(fat + 4, 0x0fffffff);
+			put32(fat + 8, 0x0fffffff);			/* root directory, one cluster */
+		} else {
+			put16(fat, 0xfff8);
+			put16(fat + 2, 0xffff);
+		}
+	}
+
+	/* boot files go into contiguous clusters right after the root directory */
+	quint32 clusterBytes = spc * SECTOR;
+	quint32 next = fat32 ? 3 : 2;
+	uchar *dir = b + (fat32 ? dataStart : reserved + 2 * fatSize) * SECTOR;
+	int slots = fat32 ? clusterBytes / 32 : 512;
+	int slot = 0;
+	for (int i = 0; i < bootFiles.size(); i++) {
+		QFileInfo info(bootFiles[i].first);
+		QString name = bootFiles[i].second;
+		if (!info.isFile())
+			return setError(QString("%1: no such file").arg(info.filePath()));
+		quint32 count = (info.size() + clusterBytes - 1) / clusterBytes;
+		if (info.size() > 0xffffffffLL || next + count > clusters + 2 ||
+				slot + 2 + name.size() / 13 > slots) {
+			setError(QString("%1 does not fit on the boot partition").arg(info.filePath()));
+			return -6;
+		}
+		slot += putFatEntry(dir + slot * 32, name, i, count ? next : 0, info.size());
+		for (quint32 c = next; c < next + count; c++)
+			for (int f = 0; f < 2; f++)
+				putFatChain(b + (reserved + f * fatSize) * SECTOR, fat32, c,
+							c + 1 < next + count ? c + 1 : fat32 ? 0x0fffffff : 0xffff);
+		qint64 offset = p.start + ((qint64)dataStart + (qint64)(next - 2) * spc) * SECTOR;
+		if (count && writer->writeFile(info.filePath(), offset))
+			return setError(writer->errorString());
+		CardPayload payload;
+		payload.source = info.filePath();
+		payload.offset = offset;
+		payload.size = info.size();
+		payload.from = 0;
+		placed << payload;
+		next += count;
+	}
+
+	if (fat32) {
+		uchar *info = b + SECTOR;
+		put32(info, 0x41615252);
+		put32(info + 484, 0x61417272);
+		put32(info + 488, clusters + 2 - next);
+		put32(info + 492, next);
+		put32(info + 508, 0xaa550000);
+		memcpy(b + 6 * SECTOR, b, 2 * SECTOR);
+	}
+	fs = fat32 ? "fat32" : "fat16";
+	return write(meta, p.start);
+}
+
+/*
+ * ext4 with uninit_bg: only group 0 (superblock, descriptors, bitmaps,
+ * the inode table block holding the reserved inodes, root, lost+found
+ * and the journal superblock), the superblock backups and the bitmap of
+ * the partial last group are written. Every other bitmap and inode table
+ * is flagged uninitialized and zeroed by the kernel after mount. Files
+ * get the inodes after lost+found and the data blocks right after the
+ * journal, then after the metadata of every following group; a group
+ * they reach gets its bitmap written too.
+ */
+int CardFormatter::formatExt(const MbrPartition &p, const QList<QPair<QString, QString> > &files)
+{
+	quint64 blocks = p.size / EXT_BLOCK;
+	if (blocks < 2048 || blocks > 0xffffffffULL)
+		return setError(QString("no ext4 layout for %1 bytes").arg(p.size));
+	quint32 groups, ipg, itb, gdt;
+	while (true) {
+		groups = (blocks + EXT_GROUP - 1) / EXT_GROUP;
+		quint64 inodes = blocks * EXT_BLOCK / EXT_INODE_RATIO;
+		ipg = (inodes + groups - 1) / groups;
+		ipg = qMax<quint32>(16, (ipg + 15) & ~15);
+		itb = ipg * EXT_INODE / EXT_BLOCK;
+		gdt = (groups * EXT_DESC + EXT_BLOCK - 1) / EXT_BLOCK;
+		/* a last group too small for its own metadata is dropped */
+		quint32 last = blocks - (quint64)(groups - 1) * EXT_GROUP;
+		quint32 overhead = (hasSuper(groups - 1) ? 1 + gdt : 0) + 2 + itb;
+		if (groups > 1 && last < overhead + 64) {
+			blocks = (quint64)(groups - 1) * EXT_GROUP;
+			continue;
+		}
+		break;
+	}
+	quint32 journal = blocks < 32768 ? 1024 : blocks < 262144 ? 4096 : blocks < 524288 ? 8192 : 16384;
+
+	quint32 now = QDateTime::currentMSecsSinceEpoch() / 1000;
+	QByteArray uuid = QUuid::createUuid().toRfc4122();
+	QByteArray seed = QUuid::createUuid().toRfc4122();
+
+	/* group 0: superblock, descriptors, bitmaps, inode table, root, lost+found, journal */
+	quint32 bitmap0 = 1 + gdt;
+	quint32 table0 = bitmap0 + 2;
+	quint32 root = table0 + itb;
+	quint32 used0 = root + 2 + journal;
+	if (used0 > qMin<quint64>(blocks, EXT_GROUP))
+		return setError(QString("no ext4 layout for %1 bytes").arg(p.size));
+
+	/* inodes 12..16 share the inode table block that is written anyway */
+	if (files.size() > EXT_BLOCK / EXT_INODE - EXT_FIRST_INO)
+		return setError(QString("%1 files do not fit in the root directory").arg(files.size()));
+	ExtAllocator alloc;
+	alloc.blocks = blocks;
+	alloc.groups = groups;
+	alloc.gdt = gdt;
+	alloc.itb = itb;
+	alloc.used0 = used0;
+	alloc.group = 0;
+	alloc.next = used0;
+	alloc.used.fill(0, groups);
+	QList<ExtRuns> fileRuns;
+	QList<quint32> leaves;
+	int dirBytes = 24 + 20;
+	for (int i = 0; i < files.size(); i++) {
+		QFileInfo info(files[i].first);
+		if (!info.isFile())
+			return setError(QString("%1: no such file").arg(info.filePath()));
+		quint32 count = (info.size() + EXT_BLOCK - 1) / EXT_BLOCK;
+		ExtRuns runs, leaf;
+		ExtAllocator trial = alloc;
+		bool fits = trial.take(count, runs);
+		/* more than i_block holds: a leaf block first, then the data */
+		if (fits && runs.size() > 4) {
+			runs.clear();
+			fits = alloc.take(1, leaf) && alloc.take(count, runs) &&
+					runs.size() <= (EXT_BLOCK - 12) / 12;
+		} else
+			alloc = trial;
+		dirBytes += (8 + files[i].second.toUtf8().size() + 3) & ~3;
+		if (!fits || dirBytes > EXT_BLOCK || files[i].second.toUtf8().size() > 255) {
+			setError(QString("%1 does not fit on the system partition").arg(info.filePath()));
+			return -6;
+		}
+		fileRuns << runs;
+		leaves << (leaf.isEmpty() ? 0 : leaf.first().first);
+	}
+
+	QByteArray desc(gdt * EXT_BLOCK, 0);
+	quint64 freeBlocks = 0;
+	quint64 freeInodes = 0;
+	for (quint32 g = 0; g < groups; g++) {
+		quint64 start = (quint64)g * EXT_GROUP;
+		quint32 count = qMin<quint64>(EXT_GROUP, blocks - start);
+		quint32 bitmap = start + (hasSuper(g) ? 1 + gdt : 0);
+		quint32 used = (g ? bitmap - start + 2 + itb : used0) + alloc.used[g];
+		quint32 inodes = g ? 0 : EXT_FIRST_INO + files.size();
+		quint16 flags = 0;
+		if (g) {
+			flags = BG_INODE_UNINIT;
+			if (g != groups - 1 && !alloc.used[g])
+				flags |= BG_BLOCK_UNINIT;
+		}
+		uchar *d = (uchar *)desc.data() + g * EXT_DESC;
+		put32(d + 0, bitmap);
+		put32(d + 4, bitmap + 1);
+		put32(d + 8, bitmap + 2);
+		put16(d + 12, count - used);
+		put16(d + 14, ipg - inodes);
+		put16(d + 16, g ? 0 : 2);
+		put16(d + 18, flags);
+		put16(d + 28, ipg - inodes);
+		uchar group[4];
+		put32(group, g);
+		quint16 crc = crc16(0xffff, (const uchar *)uuid.constData(), 16);
+		crc = crc16(crc, group, 4);
+		put16(d + 30, crc16(crc, d, 30));
+		freeBlocks += count - used;
+		freeInodes += ipg - inodes;
+	}
+
+	QByteArray super(1024, 0);
+	uchar *s = (uchar *)super.data();
+	put32(s + 0, ipg * groups);
+	put32(s + 4, blocks);
+	put32(s + 8, blocks / 20);
+	put32(s + 12, freeBlocks);
+	put32(s + 16, freeInodes);
+	put32(s + 20, 0);							/* first data block */
+	put32(s + 24, 2);							/* 1024 << 2 */
+	put32(s + 28, 2);
+	put32(s + 32, EXT_GROUP);
+	put32(s + 36, EXT_GROUP);
+	put32(s + 40, ipg);
+	put32(s + 48, now);
+	put16(s + 54, 0xffff);						/* no mount count checks */
+	put16(s + 56, 0xef53);
+	put16(s + 58, 1);							/* clean */
+	put16(s + 60, 1);							/* errors=continue */
+	put32(s + 64, now);
+	put32(s + 76, 1);							/* dynamic inode sizes */
+	put32(s + 84, EXT_FIRST_INO);
+	put16(s + 88, EXT_INODE);
+	put32(s + 92, EXT_COMPAT);
+	put32(s + 96, EXT_INCOMPAT);
+	put32(s + 100, EXT_RO_COMPAT);
+	memcpy(s + 104, uuid.constData(), 16);
+	put32(s + 224, EXT_JOURNAL_INO);
+	memcpy(s + 236, seed.constData(), 16);
+	s[252] = 1;									/* half_md4 */
+	s[253] = 1;									/* journal inode backed up below */
+	put32(s + 256, 0x000c);						/* user_xattr, acl */
+	put32(s + 264, now);
+	put16(s + 348, 32);
+	put16(s + 350, 32);
+	put32(s + 352, 0x0001);						/* signed directory hash */
+
+	QByteArray table(EXT_BLOCK, 0);
+	uchar *t = (uchar *)table.data();
+	putExtentInode(t + (EXT_ROOT_INO - 1) * EXT_INODE, 040755, 3, root, 1, now);
+	putExtentInode(t + (EXT_FIRST_INO - 1) * EXT_INODE, 040700, 2, root + 1, 1, now);
+	putExtentInode(t + (EXT_JOURNAL_INO - 1) * EXT_INODE, 0100600, 1, root + 2, journal, now);
+	memcpy(s + 268, t + (EXT_JOURNAL_INO - 1) * EXT_INODE + 40, 60);
+	put32(s + 268 + 64, journal * EXT_BLOCK);
+	QList<QByteArray> leafData;
+	for (int i = 0; i < files.size(); i++) {
+		QByteArray leaf(leaves[i] ? EXT_BLOCK : 0, 0);
+		putFileInode(t + (EXT_FIRST_INO + i) * EXT_INODE, QFileInfo(files[i].first).size(),
+					 fileRuns[i], leaves[i], (uchar *)leaf.data(), now);
+		leafData << leaf;
+	}
+
+	/* superblock, descriptors, both bitmaps and the first inode table block */
+	QByteArray head((table0 + 1) * EXT_BLOCK, 0);
+	uchar *h = (uchar *)head.data();
+	memcpy(h + 1024, s, 1024);
+	memcpy(h + EXT_BLOCK, desc.constData(), desc.size());
+	uchar *bmap = h + bitmap0 * EXT_BLOCK;
+	setBits(bmap, 0, used0 + alloc.used[0]);
+	if (groups == 1)
+		setBits(bmap, blocks, EXT_GROUP);
+	setBits(bmap + EXT_BLOCK, 0, EXT_FIRST_INO + files.size());
+	setBits(bmap + EXT_BLOCK, ipg, EXT_GROUP);
+	memcpy(h + table0 * EXT_BLOCK, t, EXT_BLOCK);
+	int err = write(head, p.start);
+	if (err)
+		return err;
+
+	/* root and lost+found directories, journal superblock */
+	QByteArray data(3 * EXT_BLOCK, 0);
+	uchar *r = (uchar *)data.data();
+	r += putDirent(r, EXT_ROOT_INO, 12, ".");
+	r += putDirent(r, EXT_ROOT_INO, 12, "..");
+	if (files.isEmpty())
+		putDirent(r, EXT_FIRST_INO, EXT_BLOCK - 24, "lost+found");
+	else
+		r += putDirent(r, EXT_FIRST_INO, 20, "lost+found");
+	for (int i = 0; i < files.size(); i++) {
+		QByteArray name = files[i].second.toUtf8();
+		quint16 len = i + 1 < files.size() ? (8 + name.size() + 3) & ~3
+										   : EXT_BLOCK - (r - (uchar *)data.data());
+		r += putDirent(r, EXT_FIRST_INO + 1 + i, len, name.constData(), 1);
+	}
+	r = (uchar *)data.data() + EXT_BLOCK;
+	r += putDirent(r, EXT_FIRST_INO, 12, ".");
+	putDirent(r, EXT_ROOT_INO, EXT_BLOCK - 12, "..");
+	uchar *j = (uchar *)data.data() + 2 * EXT_BLOCK;
+	putBe32(j + 0, 0xc03b3998);
+	putBe32(j + 4, 4);							/* superblock v2 */
+	putBe32(j + 12, EXT_BLOCK);
+	putBe32(j + 16, journal);
+	putBe32(j + 20, 1);
+	/* a random start keeps stale transactions of an old journal from replaying */
+	putBe32(j + 24, qMax<quint32>(1, QDateTime::currentMSecsSinceEpoch() & 0x7fffffff));
+	memcpy(j + 48, uuid.constData(), 16);
+	putBe32(j + 64, 1);
+	err = write(data, p.start + (qint64)root * EXT_BLOCK);
+	if (err)
+		return err;
+
+	for (int i = 0; i < files.size(); i++) {
+		if (leaves[i] && (err = write(leafData[i], p.start + (qint64)leaves[i] * EXT_BLOCK)))
+			return err;
+		qint64 size = QFileInfo(files[i].first).size();
+		qint64 from = 0;
+		foreach (ExtRuns::value_type r, fileRuns[i]) {
+			CardPayload payload;
+			payload.source = files[i].first;
+			payload.offset = p.start + (qint64)r.first * EXT_BLOCK;
+			payload.size = qMin<qint64>((qint64)r.second * EXT_BLOCK, size - from);
+			payload.from = from;
+			if (writer->writeFile(payload.source, payload.offset, payload.size, from))
+				return setError(writer->errorString());
+			placed << payload;
+			from += payload.size;
+		}
+	}
+
+	for (quint32 g = 1; g < groups; g++) {
+		qint64 start = (qint64)g * EXT_GROUP * EXT_BLOCK;
+		if (hasSuper(g)) {
+			QByteArray backup((1 + gdt) * EXT_BLOCK, 0);
+			memcpy(backup.data(), s, 1024);
+			put16((uchar *)backup.data() + 90, g);
+			memcpy(backup.data() + EXT_BLOCK, desc.constData(), desc.size());
+			err = write(backup, p.start + start);
+			if (err)
+				return err;
+		}
+		/* the partial last group and groups holding files are the others with a bitmap */
+		if (g == groups - 1 || alloc.used[g]) {
+			quint32 overhead = (hasSuper(g) ? 1 + gdt : 0) + 2 + itb;
+			QByteArray map(EXT_BLOCK, 0);
+			setBits((uchar *)map.data(), 0, overhead + alloc.used[g]);
+			setBits((uchar *)map.data(), blocks - (quint64)g * EXT_GROUP, EXT_GROUP);
+			err = write(map, p.start + start + (qint64)(overhead - 2 - itb) * EXT_BLOCK);
+			if (err)
+				return err;
+		}
+	}
+	return 0;
+}
+
+int CardFormatter::write(const QByteArray &data, qint64 offset)
+{
+	if (writer->writeData(data.constData(), data.size(), offset))
+		return setError(writer->errorString());
+	return 0;
+}
+
+QString CardFormatter::errorString()
+{
+	return error;
+}
+
+int CardFormatter::setError(const QString &err)
+{
+	error = err;
+	qDebug() << "CardFormatter:" << err;
+	return -2;
+}
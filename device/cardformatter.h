@@ -0,0 +1,72 @@
+#ifndef CARDFORMATTER_H
+#define CARDFORMATTER_H
+
+#include <QPair>
+#include <QObject>
+#include <QStringList>
+
+#include "mbr.h"
+
+class BlockWriter;
+
+/* a piece of a file format() copied onto the card */
+struct CardPayload {
+	QString source;
+	qint64 offset;	/* on the card */
+	qint64 size;
+	qint64 from;	/* in the source */
+};
+
+/* what format() left on the card */
+struct CardLayout {
+	qint64 size;
+	QList<MbrPartition> partitions;
+	QStringList filesystems;	/* "fat16", "fat32" or "ext4", per partition */
+	QList<CardPayload> payloads;
+};
+
+/*
+ * In process replacement of format.sh. Writes the same three partitions
+ * (FAT boot, two ext4) straight onto the card: the card is discarded as a
+ * whole, then only the metadata a filesystem needs to mount is written,
+ * in a handful of large writes. ext4 inode tables and bitmaps are left
+ * uninitialized (uninit_bg), the kernel fills them in lazily, so the time
+ * does not grow with the card. Boot and system files given beforehand
+ * are written in the same pass, each one sequentially. The bench runs
+ * e2fsck -fn and fsck.vfat -n on the result.
+ */
+class CardFormatter : public QObject
+{
+	Q_OBJECT
+public:
+	CardFormatter(const QString &target, QObject *parent = 0);
+	void setDiscard(bool on);
+	void addBootFile(const QString &source, const QString &name);
+	void addSystemFile(const QString &source, const QString &name);
+	int format();
+	CardLayout layout();
+	QString errorString();
+	static CardLayout plan(qint64 size);
+
+	static const qint64 bootStart = 1024 * 1024;
+	static const qint64 bootSize = 32 * 1024 * 1024;
+	static const qint64 systemMax = 4096LL * 1024 * 1024;
+signals:
+	void progress(int done, int total);
+protected:
+	int formatFat(const MbrPartition &p, QString &fs);
+	int formatExt(const MbrPartition &p, const QList<QPair<QString, QString> > &files);
+	int write(const QByteArray &data, qint64 offset);
+	int setError(const QString &err);
+private:
+	QString target;
+	BlockWriter *writer;
+	bool discard;
+	QList<QPair<QString, QString> > bootFiles;
+	QList<QPair<QString, QString> > systemFiles;
+	QList<CardPayload> placed;
+	CardLayout result;
+	QString error;
+};
+
+#endif // CARDFORMATTER_H
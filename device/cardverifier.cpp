@@ -0,0 +1,329 @@
+#include "cardverifier.h"
+#include "mbr.h"
+#include "util/crc32c.h"
+#include "util/tracer.h"
+
+#include <QMap>
+#include <QFile>
+#include <QMutex>
+#include <QDebug>
+#include <QDateTime>
+#include <QFileInfo>
+#include <QRunnable>
+#include <QThreadPool>
+
+#include <algorithm>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* crc of every block of a range, read with O_DIRECT where possible */
+class RangeHasher : public QRunnable
+{
+public:
+	RangeHasher(const QString &path, qint64 offset, qint64 length, const QList<qint64> &blocks,
+				const QList<QPair<qint64, qint64> > &ignored)
+	{
+		this->path = path;
+		this->offset = offset;
+		this->length = length;
+		this->blocks = blocks;
+		this->ignored = ignored;
+		setAutoDelete(false);
+	}
+	/* ignored bytes hash as zero on both sides */
+	void mask(char *buf, qint64 pos, qint64 len)
+	{
+		QList<QPair<qint64, qint64> >::const_iterator i =
+				std::lower_bound(ignored.constBegin(), ignored.constEnd(), qMakePair(pos, (qint64)0));
+		if (i != ignored.constBegin())
+			--i;
+		for (; i != ignored.constEnd() && i->first < pos + len; ++i) {
+			qint64 from = qMax(pos, i->first);
+			qint64 to = qMin(pos + len, i->first + i->second);
+			if (to > from)
+				memset(buf + (from - pos), 0, to - from);
+		}
+	}
+	void run()
+	{
+		QByteArray name = QFile::encodeName(path);
+		bool direct = true;
+		int fd = ::open(name.constData(), O_RDONLY | O_DIRECT | O_CLOEXEC);
+		if (fd < 0 && errno == EINVAL) {
+			direct = false;
+			fd = ::open(name.constData(), O_RDONLY | O_CLOEXEC);
+		}
+		if (fd < 0) {
+			error = QString("open %1: %2").arg(path).arg(strerror(errno));
+			return;
+		}
+		/* a buffered fallback must not verify the page cache */
+		posix_fadvise(fd, offset, length, POSIX_FADV_DONTNEED);
+		char *buf = NULL;
+		if (posix_memalign((void **)&buf, 4096, CardVerifier::blockSize)) {
+			::close(fd);
+			error = "out of memory";
+			return;
+		}
+		foreach (qint64 block, blocks) {
+			qint64 pos = block * CardVerifier::blockSize;
+			qint64 len = qMin<qint64>(CardVerifier::blockSize, length - pos);
+			qint64 done = 0;
+			int err = 0;
+			while (done < len) {
+				ssize_t ret = pread(fd, buf + done, len - done, offset + pos + done);
+				if (ret < 0 && errno == EINTR)
+					continue;
+				/* unaligned tail of an image file */
+				if (ret < 0 && errno == EINVAL && direct) {
+					direct = false;
+					::close(fd);
+					fd = ::open(name.constData(), O_RDONLY | O_CLOEXEC);
+					if (fd < 0) {
+						err = errno;
+						break;
+					}
+					continue;
+				}
+				if (ret <= 0) {
+					err = ret < 0 ? errno : 0;
+					break;
+				}
+				done += ret;
+			}
+			if (done != len) {
+				error = QString("read %1 at %2: %3").arg(path).arg(offset + pos)
+						.arg(err ? strerror(err) : "short read");
+				break;
+			}
+			if (!ignored.isEmpty())
+				mask(buf, offset + pos, len);
+			crcs << crc32c(0, buf, len);
+			read += len;
+		}
+		free(buf);
+		if (fd >= 0)
+			::close(fd);
+	}
+
+	QString path;
+	qint64 offset;
+	qint64 length;
+	QList<qint64> blocks;
+	QList<QPair<qint64, qint64> > ignored;
+	QVector<quint32> crcs;
+	qint64 read = 0;
+	QString error;
+};
+
+static QMutex referenceLock;
+static QMap<QString, QVector<quint32> > referenceCrcs;
+
+CardVerifier::CardVerifier(const QString &device, const QString &reference, QObject *parent)
+	: QObject(parent)
+{
+	this->device = device;
+	this->reference = reference;
+	verifyMode = Full;
+	samples = 32;
+	read = 0;
+	elapsedMs = 0;
+}
+
+void CardVerifier::setMode(Mode mode)
+{
+	verifyMode = mode;
+}
+
+/* blocks per range in sampled mode */
+void CardVerifier::setSamples(int blocks)
+{
+	samples = qMax(1, blocks);
+}
+
+/*
+ * (offset, length) ranges, sorted, whose content was never written, e.g.
+ * what a sparse image leaves out. They are not compared.
+ */
+void CardVerifier::setIgnored(const QList<QPair<qint64, qint64> > &ranges)
+{
+	ignored = ranges;
+}
+
+/* length bytes of source from "from" on are expected on the card at offset; -1: to its end */
+void CardVerifier::addPayload(const QString &source, qint64 offset, qint64 from, qint64 length)
+{
+	Range r;
+	r.name = QFileInfo(source).fileName();
+	if (from)
+		r.name += QString("@%1").arg(from);
+	r.offset = offset;
+	r.length = length < 0 ? QFileInfo(source).size() - from : length;
+	r.source = source;
+	r.sourceOffset = from;
+	payloads << r;
+}
+
+/* "full", "sampled" as written in creater.json */
+CardVerifier::Mode CardVerifier::mode(const QString &name)
+{
+	if (name == "sampled")
+		return Sampled;
+	return Full;
+}
+
+QList<CardVerifier::Range> CardVerifier::ranges()
+{
+	if (!payloads.isEmpty())
+		return payloads;
+	QList<Range> list;
+
+	QList<MbrPartition> parts = readMbr(reference);
+	qint64 first = -1;
+	foreach (MbrPartition p, parts)
+		if (first < 0 || p.start < first)
+			first = p.start;
+
+	Range boot;
+	boot.name = "boot";
+	boot.offset = 0;
+	boot.length = first > 0 ? first : QFileInfo(reference).size();
+	boot.source = reference;
+	boot.sourceOffset = 0;
+	list << boot;
+	foreach (MbrPartition p, parts) {
+		Range r;
+		r.name = QString("part%1").arg(p.index);
+		r.offset = p.start;
+		r.source = reference;
+		r.sourceOffset = p.start;
+		/* the image may stop short of the last partition's end */
+		r.length = qMin(p.size, QFileInfo(reference).size() - p.start);
+		if (r.length > 0)
+			list << r;
+	}
+	return list;
+}
+
+/*
+ * Block numbers to look at. Sampled mode always takes the first and last
+ * block (partition table, superblocks, backup metadata) and spreads the
+ * rest evenly in between.
+ */
+QList<qint64> CardVerifier::blocks(const Range &range)
+{
+	qint64 count = (range.length + blockSize - 1) / blockSize;
+	QList<qint64> list;
+	if (verifyMode == Full || count <= samples) {
+		for (qint64 i = 0; i < count; i++)
+			list << i;
+		return list;
+	}
+	for (int i = 0; i < samples; i++) {
+		qint64 b = (count - 1) * i / (samples - 1 > 0 ? samples - 1 : 1);
+		if (list.isEmpty() || list.last() != b)
+			list << b;
+	}
+	return list;
+}
+
+/* 0 when the card matches, -5 on a mismatch, -2 on read errors */
+int CardVerifier::verify()
+{
+	TRACE_SPAN("card_verify");
+	QElapsedTimer t;
+	t.start();
+	read = 0;
+	bad.clear();
+
+	if (payloads.isEmpty() && !QFileInfo(reference).exists())
+		return setError(QString("%1 does not exist").arg(reference));
+	QList<Range> list = ranges();
+	qint64 total = 0;
+	foreach (Range r, list) {
+		if (!QFileInfo(r.source).isFile())
+			return setError(QString("%1 does not exist").arg(r.source));
+		total += r.length;
+	}
+
+	QThreadPool pool;
+	pool.setMaxThreadCount(2);
+	qint64 done = 0;
+	foreach (Range r, list) {
+		QList<qint64> b = blocks(r);
+		QFileInfo ref(r.source);
+		QString key = QString("%1:%2:%3:%4:%5:%6").arg(ref.absoluteFilePath()).arg(ref.size())
+				.arg(ref.lastModified().toMSecsSinceEpoch()).arg(r.sourceOffset).arg(r.length)
+				.arg(verifyMode == Full ? QString("full") : QString::number(samples))
+				+ QString(":%1").arg(ignored.size());
+
+		RangeHasher card(device, r.offset, r.length, b, ignored);
+		RangeHasher source(r.source, r.sourceOffset, r.length, b, ignored);
+		referenceLock.lock();
+		bool known = referenceCrcs.contains(key);
+		if (known)
+			source.crcs = referenceCrcs.value(key);
+		referenceLock.unlock();
+
+		pool.start(&card);
+		if (!known)
+			pool.start(&source);
+		pool.waitForDone();
+
+		if (!card.error.isEmpty())
+			return setError(card.error);
+		if (!source.error.isEmpty())
+			return setError(source.error);
+		if (!known) {
+			QMutexLocker locker(&referenceLock);
+			referenceCrcs.insert(key, source.crcs);
+		}
+		read += card.read;
+		for (int i = 0; i < b.size(); i++) {
+			if (card.crcs.at(i) != source.crcs.at(i))
+				bad << QString("%1 block %2").arg(r.name).arg(b.at(i));
+		}
+		done += r.length;
+		emit progress(done, total);
+	}
+	elapsedMs = t.elapsed();
+	if (!bad.isEmpty()) {
+		error = QString("%1 blocks differ: %2").arg(bad.size()).arg(bad.mid(0, 8).join(", "));
+		return -5;
+	}
+	return 0;
+}
+
+QStringList CardVerifier::mismatches()
+{
+	return bad;
+}
+
+qint64 CardVerifier::bytesRead()
+{
+	return read;
+}
+
+/* MB/s read from the card */
+double CardVerifier::throughput()
+{
+	if (elapsedMs <= 0)
+		return 0;
+	return (read / (1024.0 * 1024.0)) / (elapsedMs / 1000.0);
+}
+
+QString CardVerifier::errorString()
+{
+	return error;
+}
+
+int CardVerifier::setError(const QString &err)
+{
+	error = err;
+	qDebug() << "CardVerifier:" << err;
+	return -2;
+}
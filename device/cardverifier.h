@@ -0,0 +1,68 @@
+#ifndef CARDVERIFIER_H
+#define CARDVERIFIER_H
+
+#include <QList>
+#include <QPair>
+#include <QVector>
+#include <QObject>
+#include <QStringList>
+#include <QElapsedTimer>
+
+/*
+ * Reads a written card back and compares it with the image it was written
+ * from. Every partition (and the boot area in front of the first one) is
+ * hashed in 4 MiB CRC32C blocks; the reference and the card are hashed
+ * in parallel and the reference hashes are remembered between cards.
+ * Sampled mode only looks at a spread of blocks per partition. Without an
+ * image the card is compared with the source files themselves, at the
+ * offsets addPayload() gives.
+ */
+class CardVerifier : public QObject
+{
+	Q_OBJECT
+public:
+	enum Mode {
+		Full,
+		Sampled,
+	};
+	struct Range {
+		QString name;
+		qint64 offset;
+		qint64 length;
+		QString source;
+		qint64 sourceOffset;
+	};
+
+	CardVerifier(const QString &device, const QString &reference, QObject *parent = 0);
+	void setMode(Mode mode);
+	void setSamples(int blocks);
+	void setIgnored(const QList<QPair<qint64, qint64> > &ranges);
+	void addPayload(const QString &source, qint64 offset, qint64 from = 0, qint64 length = -1);
+	int verify();
+	QList<Range> ranges();
+	QStringList mismatches();
+	qint64 bytesRead();
+	double throughput();
+	QString errorString();
+
+	static Mode mode(const QString &name);
+	static const int blockSize = 4 * 1024 * 1024;
+signals:
+	void progress(qint64 done, qint64 total);
+protected:
+	QList<qint64> blocks(const Range &range);
+	int setError(const QString &err);
+private:
+	QString device;
+	QString reference;
+	Mode verifyMode;
+	int samples;
+	QList<QPair<qint64, qint64> > ignored;
+	QList<Range> payloads;
+	qint64 read;
+	qint64 elapsedMs;
+	QStringList bad;
+	QString error;
+};
+
+#endif // CARDVERIFIER_H
@@ -0,0 +1,504 @@
+#include "fanoutwriter.h"
+#include "blockwriter.h"
+#include "sparseimage.h"
+#include "resumejournal.h"
+#include "util/crc32c.h"
+#include "release/bufferpool.h"
+#include "util/tracer.h"
+
+#include <QMap>
+#include <QFile>
+#include <QMutex>
+#include <QFileInfo>
+#include <QQueue>
+#include <QDebug>
+#include <QThread>
+#include <QElapsedTimer>
+#include <QWaitCondition>
+
+#include <fcntl.h>
+
+struct FanoutPiece {
+	int at;				/* in the buffer */
+	int length;
+	qint64 offset;		/* on the card */
+};
+
+struct FanoutBlock {
+	char *buf;
+	QList<FanoutPiece> pieces;
+	quint32 crc;		/* of the data, pieces are back to back from buf */
+	int refs;			/* cards that still have to write it */
+};
+
+/* one image on its way to a set of cards, everything under lock */
+class FanoutSession : public QThread
+{
+public:
+	FanoutSession(const QString &image, int buffers);
+	~FanoutSession();
+	FanoutBlock *next(qint64 seq);
+	void done(FanoutBlock *b);
+	void leave(qint64 seq);
+
+	QMutex lock;
+	QWaitCondition changed;
+	QString image;
+	SparseImage *sparse;
+	BufferPool pool;
+	qint64 total;		/* bytes per card */
+	int cards;			/* joined */
+	int active;			/* still writing */
+	int users;			/* not yet detached */
+	bool started;
+	qint64 first;		/* seq of blocks.head(), the earliest resume point at start */
+	QString error;
+protected:
+	void run();
+	int fill(FanoutBlock *b, qint64 seq);
+private:
+	QQueue<FanoutBlock *> blocks;
+	bool eof;
+	QFile raw;
+};
+
+static QMutex sessionLock;
+static QMap<QString, FanoutSession *> gathering;
+static QMap<QString, int> deviceJobs;	/* image -> cards about to write it */
+static int gatherMs = 1000;
+static int bufferCount = 16;
+
+FanoutSession::FanoutSession(const QString &image, int buffers)
+	: pool(buffers, SparseImage::chunkSize), raw(image)
+{
+	this->image = image;
+	sparse = NULL;
+	total = 0;
+	cards = 0;
+	active = 0;
+	users = 0;
+	started = false;
+	first = -1;
+	eof = false;
+	if (!pool.available()) {
+		error = "out of memory";
+		return;
+	}
+	if (image.endsWith(".simg")) {
+		sparse = new SparseImage(image);
+		if (sparse->open())
+			error = sparse->errorString();
+		total = sparse->dataBytes();
+	} else if (!raw.open(QIODevice::ReadOnly)) {
+		error = QString("open %1: %2").arg(image).arg(raw.errorString());
+	} else {
+		total = raw.size();
+		posix_fadvise(raw.handle(), 0, 0, POSIX_FADV_SEQUENTIAL);
+	}
+}
+
+FanoutSession::~FanoutSession()
+{
+	while (!blocks.isEmpty()) {
+		FanoutBlock *b = blocks.dequeue();
+		pool.release(b->buf);
+		delete b;
+	}
+	delete sparse;
+}
+
+/* the reader: stops early once no card is left to write to */
+void FanoutSession::run()
+{
+	TRACE_SPAN("fanout_read");
+	qint64 count = sparse ? sparse->chunkCount() : (total + pool.bufferSize() - 1) / pool.bufferSize();
+	for (qint64 seq = first; seq < count; seq++) {
+		lock.lock();
+		bool idle = !active;
+		lock.unlock();
+		if (idle)
+			break;
+		/* the backpressure: waits for the slowest card */
+		FanoutBlock *b = new FanoutBlock;
+		b->buf = pool.acquire();
+		int err = fill(b, seq);
+
+		QMutexLocker locker(&lock);
+		if (err || !active) {
+			pool.release(b->buf);
+			delete b;
+			break;
+		}
+		b->refs = active;
+		blocks.enqueue(b);
+		changed.wakeAll();
+	}
+	QMutexLocker locker(&lock);
+	eof = true;
+	changed.wakeAll();
+}
+
+int FanoutSession::fill(FanoutBlock *b, qint64 seq)
+{
+	if (sparse) {
+		if (sparse->readChunk(seq, b->buf)) {
+			QMutexLocker locker(&lock);
+			error = sparse->errorString();
+			return -2;
+		}
+		int at = 0;
+		foreach (SparseImage::Range r, sparse->chunkRanges(seq)) {
+			FanoutPiece p = { at, (int)r.length, r.offset };
+			b->pieces << p;
+			at += r.length;
+		}
+		b->crc = crc32c(0, b->buf, at);
+		return 0;
+	}
+	qint64 offset = seq * pool.bufferSize();
+	qint64 len = qMin<qint64>(pool.bufferSize(), total - offset);
+	if (!raw.seek(offset) || raw.read(b->buf, len) != len) {
+		QMutexLocker locker(&lock);
+		error = QString("read %1: short read").arg(image);
+		return -2;
+	}
+	FanoutPiece p = { 0, (int)len, offset };
+	b->pieces << p;
+	b->crc = crc32c(0, b->buf, len);
+	return 0;
+}
+
+/* block seq, NULL at the end of the image or when the reader failed */
+FanoutBlock *FanoutSession::next(qint64 seq)
+{
+	QMutexLocker locker(&lock);
+	while (seq >= first + blocks.size() && !eof)
+		changed.wait(&lock);
+	if (seq >= first + blocks.size())
+		return NULL;
+	return blocks.at(seq - first);
+}
+
+/* the card wrote b; the last one hands the buffer back */
+void FanoutSession::done(FanoutBlock *b)
+{
+	QMutexLocker locker(&lock);
+	b->refs--;
+	/* cards write in order, so buffers drain from the head */
+	while (!blocks.isEmpty() && !blocks.head()->refs) {
+		FanoutBlock *head = blocks.dequeue();
+		pool.release(head->buf);
+		delete head;
+		first++;
+	}
+}
+
+/* a card drops out at seq, it no longer holds anything back */
+void FanoutSession::leave(qint64 seq)
+{
+	QList<FanoutBlock *> held;
+	lock.lock();
+	active--;
+	for (qint64 i = qMax(seq, first); i < first + blocks.size(); i++)
+		held << blocks.at(i - first);
+	lock.unlock();
+	foreach (FanoutBlock *b, held)
+		done(b);
+}
+
+FanoutWriter::FanoutWriter(const QString &image, QObject *parent)
+	: QObject(parent)
+{
+	this->image = image;
+	journal = NULL;
+	sessionCards = 0;
+	written = 0;
+	resumed = 0;
+	elapsedMs = 0;
+	direct = false;
+}
+
+/* cards whose next write is image, its session stops gathering once all joined */
+void FanoutWriter::setDeviceJobs(const QString &image, int count)
+{
+	QMutexLocker locker(&sessionLock);
+	if (count > 0)
+		deviceJobs.insert(image, count);
+	else
+		deviceJobs.remove(image);
+}
+
+void FanoutWriter::setGatherTime(int ms)
+{
+	QMutexLocker locker(&sessionLock);
+	gatherMs = qMax(0, ms);
+}
+
+/* 4 MiB each, the memory of one session */
+void FanoutWriter::setBuffers(int count)
+{
+	QMutexLocker locker(&sessionLock);
+	bufferCount = qMax(2, count);
+}
+
+/* checkpoints go there, a card that has one continues where it stopped */
+void FanoutWriter::setJournal(ResumeJournal *journal)
+{
+	this->journal = journal;
+}
+
+/*
+ * Blocks until target has the whole image. Joins the session gathering
+ * for the image or opens one and waits up to the gather time for the
+ * other device jobs to join.
+ */
+int FanoutWriter::write(const QString &target)
+{
+	TRACE_SPAN("fanout_write");
+	BlockWriter w(target);
+	qint64 from = w.open() ? 0 : resumePoint(&w);
+	sessionLock.lock();
+	FanoutSession *s = gathering.value(image);
+	bool owner = !s;
+	if (owner) {
+		s = new FanoutSession(image, bufferCount);
+		gathering.insert(image, s);
+	}
+	int wait = gatherMs;
+	int expected = qMax(1, deviceJobs.value(image));
+	s->lock.lock();
+	s->cards++;
+	s->active++;
+	s->users++;
+	s->first = s->first < 0 ? from : qMin(s->first, from);
+	s->changed.wakeAll();
+	s->lock.unlock();
+	sessionLock.unlock();
+
+	s->lock.lock();
+	if (owner) {
+		QElapsedTimer t;
+		t.start();
+		while (s->cards < expected && t.elapsed() < wait)
+			s->changed.wait(&s->lock, qMax<qint64>(1, wait - t.elapsed()));
+		/* late cards open a session of their own */
+		s->lock.unlock();
+		sessionLock.lock();
+		gathering.remove(image);
+		sessionLock.unlock();
+		s->lock.lock();
+		s->started = true;
+		if (s->error.isEmpty())
+			s->start();
+		s->changed.wakeAll();
+	}
+	while (!s->started)
+		s->changed.wait(&s->lock);
+	sessionCards = s->cards;
+	s->lock.unlock();
+
+	int err = stream(s, &w, target, from);
+
+	s->lock.lock();
+	bool last = --s->users == 0;
+	s->lock.unlock();
+	if (last) {
+		s->wait();
+		delete s;
+	}
+	return err;
+}
+
+/*
+ * Where an earlier attempt on this card stopped. The first and the last
+ * confirmed extent are read back: a card that does not hold them is not
+ * the card of the journal, or was written since, and starts over.
+ */
+qint64 FanoutWriter::resumePoint(BlockWriter *w)
+{
+	if (!journal || journal->open() || !journal->extents())
+		return 0;
+	TRACE_SPAN("resume_check");
+	bool isSparse = image.endsWith(".simg");
+	SparseImage sparse(image);
+	if (isSparse && sparse.open()) {
+		journal->reset();
+		return 0;
+	}
+	qint64 size = QFileInfo(image).size();
+	qint64 count = journal->extents();
+	QList<qint64> check;
+	check << count - 1;
+	if (count > 1)
+		check << 0;
+	QByteArray buf(SparseImage::chunkSize, 0);
+	foreach (qint64 e, check) {
+		QList<SparseImage::Range> pieces;
+		if (isSparse) {
+			pieces = sparse.chunkRanges(e);
+		} else if (e * SparseImage::chunkSize < size) {
+			SparseImage::Range r;
+			r.offset = e * SparseImage::chunkSize;
+			r.length = qMin<qint64>(SparseImage::chunkSize, size - r.offset);
+			r.zero = false;
+			pieces << r;
+		}
+		qint64 at = 0;
+		bool ok = !pieces.isEmpty();
+		foreach (SparseImage::Range r, pieces) {
+			if (w->readData(buf.data() + at, r.length, r.offset)) {
+				ok = false;
+				break;
+			}
+			at += r.length;
+		}
+		if (!ok || crc32c(0, buf.constData(), at) != journal->crc(e)) {
+			qDebug() << "FanoutWriter: journal does not match the card, starting over";
+			journal->reset();
+			return 0;
+		}
+	}
+	return count;
+}
+
+/* what the card surely has goes into the journal */
+int FanoutWriter::checkpoint(BlockWriter *w)
+{
+	if (w->sync())
+		return -1;
+	if (journal)
+		journal->commit();
+	return 0;
+}
+
+/*
+ * This card's share of the session, runs on the calling job's thread.
+ * Extents before from are already on the card and only passed on.
+ */
+int FanoutWriter::stream(FanoutSession *s, BlockWriter *w, const QString &target, qint64 from)
+{
+	s->lock.lock();
+	qint64 seq = s->first;
+	QString err = s->error;
+	qint64 total = s->total;
+	s->lock.unlock();
+	if (err.isEmpty() && !w->isOpen())
+		err = w->errorString();
+	if (!err.isEmpty()) {
+		s->leave(seq);
+		return setError(err);
+	}
+	if (w->size() > 0 && (s->sparse ? s->sparse->imageSize() : total) > w->size()) {
+		s->leave(seq);
+		return setError(QString("%1 does not fit on %2").arg(image).arg(target));
+	}
+	direct = w->isDirect();
+	w->begin(total);
+	QElapsedTimer t;
+	t.start();
+	written = 0;
+	resumed = 0;
+	/* the reader starts at the earliest resume point of the session */
+	for (qint64 i = 0; i < seq; i++) {
+		if (s->sparse) {
+			foreach (SparseImage::Range r, s->sparse->chunkRanges(i))
+				resumed += r.length;
+		} else {
+			resumed += qMin<qint64>(SparseImage::chunkSize, total - i * SparseImage::chunkSize);
+		}
+	}
+	int unsynced = 0;
+	while (FanoutBlock *b = s->next(seq)) {
+		foreach (FanoutPiece p, b->pieces) {
+			if (seq < from) {
+				resumed += p.length;
+				continue;
+			}
+			if (w->writeBuffer(b->buf + p.at, p.length, p.offset)) {
+				s->leave(seq);
+				checkpoint(w);
+				return setError(w->errorString());
+			}
+			written += p.length;
+		}
+		if (seq >= from && journal) {
+			journal->add(seq, b->crc);
+			if (++unsynced == checkpointExtents) {
+				unsynced = 0;
+				if (checkpoint(w)) {
+					s->done(b);
+					s->leave(seq + 1);
+					return setError(w->errorString());
+				}
+			}
+		}
+		s->done(b);
+		seq++;
+		emit progress(written + resumed, total);
+	}
+	s->lock.lock();
+	err = s->error;
+	s->lock.unlock();
+	if (!err.isEmpty() || written + resumed != total) {
+		s->leave(seq);
+		checkpoint(w);
+		return setError(err.isEmpty() ? QString("%1: image ended early").arg(image) : err);
+	}
+	s->lock.lock();
+	s->active--;
+	s->lock.unlock();
+	if (s->sparse) {
+		/* zero ranges cost no reads, every card clears its own */
+		SparseImage zero(image);
+		if (zero.open() || zero.writeZero(w))
+			return setError(zero.errorString());
+	}
+	if (w->sync())
+		return setError(w->errorString());
+	if (journal)
+		journal->remove();
+	elapsedMs = t.elapsed();
+	return 0;
+}
+
+/* cards that were written in the same session as this one */
+int FanoutWriter::cards()
+{
+	return sessionCards;
+}
+
+qint64 FanoutWriter::bytesWritten()
+{
+	return written;
+}
+
+/* already on the card from an earlier attempt */
+qint64 FanoutWriter::bytesResumed()
+{
+	return resumed;
+}
+
+/* MB/s to this card */
+double FanoutWriter::throughput()
+{
+	if (elapsedMs <= 0)
+		return 0;
+	return (written / (1024.0 * 1024.0)) / (elapsedMs / 1000.0);
+}
+
+bool FanoutWriter::isDirect()
+{
+	return direct;
+}
+
+QString FanoutWriter::errorString()
+{
+	return error;
+}
+
+int FanoutWriter::setError(const QString &err)
+{
+	error = err;
+	qDebug() << "FanoutWriter:" << err;
+	return -2;
+}
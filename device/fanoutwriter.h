@@ -0,0 +1,56 @@
+#ifndef FANOUTWRITER_H
+#define FANOUTWRITER_H
+
+#include <QObject>
+
+class BlockWriter;
+class FanoutSession;
+class ResumeJournal;
+
+/*
+ * Writes one image (raw or .simg) to several cards at once. The first
+ * card to ask for an image opens a session, cards asking for the same
+ * image while it gathers join it. One reader thread fills 4 MiB buffers
+ * of a BufferPool, every buffer is written to each card as it is and goes
+ * back to the pool once the last card wrote it. A slow card only holds
+ * the others back once the pool is used up; reads and memory stay the
+ * same however many cards are in the session.
+ */
+class FanoutWriter : public QObject
+{
+	Q_OBJECT
+public:
+	FanoutWriter(const QString &image, QObject *parent = 0);
+	void setJournal(ResumeJournal *journal);
+	int write(const QString &target);
+	int cards();
+	qint64 bytesWritten();
+	qint64 bytesResumed();
+	double throughput();
+	bool isDirect();
+	QString errorString();
+
+	static void setDeviceJobs(const QString &image, int count);
+	static void setGatherTime(int ms);
+	static void setBuffers(int count);
+
+	static const int checkpointExtents = 16;
+signals:
+	void progress(qint64 written, qint64 total);
+protected:
+	qint64 resumePoint(BlockWriter *w);
+	int checkpoint(BlockWriter *w);
+	int stream(FanoutSession *s, BlockWriter *w, const QString &target, qint64 from);
+	int setError(const QString &err);
+private:
+	QString image;
+	ResumeJournal *journal;
+	int sessionCards;
+	qint64 written;
+	qint64 resumed;
+	qint64 elapsedMs;
+	bool direct;
+	QString error;
+};
+
+#endif // FANOUTWRITER_H
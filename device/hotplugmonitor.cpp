@@ -0,0 +1,195 @@
+#include "hotplugmonitor.h"
+
+#include <QDir>
+#include <QFile>
+#include <QDebug>
+#include <QRegExp>
+#include <QFileInfo>
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+
+/* overridable, the benchmark brings its own fake card readers */
+static QString sysfsBlock = "/sys/class/block";
+
+/* lsblk style, "7,4G" */
+QString CardDevice::sizeText(qint64 bytes)
+{
+	const char *units = "BKMGT";
+	double value = bytes;
+	int unit = 0;
+	while (value >= 1024 && unit < 4) {
+		value /= 1024;
+		unit++;
+	}
+	QString text = QString::number(value, 'f', 1);
+	if (text.endsWith(".0"))
+		text.chop(2);
+	return text.replace(".", ",") + units[unit];
+}
+
+QString CardDevice::sizeText() const
+{
+	return sizeText(size);
+}
+
+HotplugMonitor::HotplugMonitor(QObject *parent)
+	: QObject(parent)
+{
+	fd = -1;
+	notifier = NULL;
+}
+
+HotplugMonitor::~HotplugMonitor()
+{
+	if (fd >= 0)
+		::close(fd);
+}
+
+int HotplugMonitor::start()
+{
+	if (fd >= 0)
+		return 0;
+	fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, NETLINK_KOBJECT_UEVENT);
+	if (fd < 0) {
+		qDebug() << "hotplug: netlink socket:" << strerror(errno);
+		return -1;
+	}
+	struct sockaddr_nl addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.nl_family = AF_NETLINK;
+	addr.nl_groups = 1;		/* kernel events, not the udev rebroadcast */
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+		qDebug() << "hotplug: netlink bind:" << strerror(errno);
+		::close(fd);
+		fd = -1;
+		return -1;
+	}
+
+	foreach (CardDevice dev, scan())
+		present << dev.name;
+	notifier = new QSocketNotifier(fd, QSocketNotifier::Read, this);
+	connect(notifier, SIGNAL(activated(int)), SLOT(readEvents()));
+	return 0;
+}
+
+bool HotplugMonitor::isActive()
+{
+	return fd >= 0;
+}
+
+void HotplugMonitor::readEvents()
+{
+	char buf[8192];
+	ssize_t len;
+	while ((len = recv(fd, buf, sizeof(buf) - 1, 0)) > 0)
+		handleEvent(QByteArray(buf, len));
+}
+
+/* "ACTION@DEVPATH\0KEY=VALUE\0..." */
+void HotplugMonitor::handleEvent(const QByteArray &msg)
+{
+	QString action;
+	QString subsystem;
+	QString devname;
+	QString devtype;
+	foreach (QByteArray field, msg.split('\0')) {
+		if (field.startsWith("ACTION="))
+			action = field.mid(7);
+		else if (field.startsWith("SUBSYSTEM="))
+			subsystem = field.mid(10);
+		else if (field.startsWith("DEVNAME="))
+			devname = QFileInfo(field.mid(8)).fileName();
+		else if (field.startsWith("DEVTYPE="))
+			devtype = field.mid(8);
+	}
+	if (subsystem != "block" || devtype != "disk" || !isCardReader(devname))
+		return;
+
+	/*
+	 * usb readers exist without a card and only report a media change, a
+	 * card counts as present while the disk has a size.
+	 */
+	CardDevice dev = device(devname);
+	bool inserted = action != "remove" && dev.size > 0;
+	if (inserted && !present.contains(devname)) {
+		present << devname;
+		emit deviceAdded(dev);
+		emit changed();
+	} else if (!inserted && present.contains(devname)) {
+		present.removeAll(devname);
+		emit deviceRemoved(devname);
+		emit changed();
+	} else if (inserted) {
+		/* partitions were rewritten, e.g. by a format */
+		emit changed();
+	}
+}
+
+bool HotplugMonitor::isCardReader(const QString &name)
+{
+	if (name.startsWith("mmcblk"))
+		return !name.contains(QRegExp("(p\\d+|boot\\d|rpmb)$"));
+	/* sda is the system disk */
+	return name.contains(QRegExp("^sd[b-z]+$"));
+}
+
+QString HotplugMonitor::readAttribute(const QString &path)
+{
+	QFile f(path);
+	if (!f.open(QIODevice::ReadOnly))
+		return QString();
+	return QString(f.readAll()).trimmed();
+}
+
+CardDevice HotplugMonitor::device(const QString &name)
+{
+	QString sys = QString("%1/%2").arg(sysfsBlock).arg(name);
+	CardDevice dev;
+	dev.name = name;
+	dev.size = readAttribute(sys + "/size").toLongLong() * 512;
+	dev.removable = readAttribute(sys + "/removable") == "1";
+	dev.model = readAttribute(sys + "/device/model");
+	if (dev.model.isEmpty())
+		dev.model = readAttribute(sys + "/device/name");
+	dev.cid = readAttribute(sys + "/device/cid");
+
+	QString path = QFileInfo(sys).canonicalFilePath();
+	if (path.contains("/usb"))
+		dev.transport = "usb";
+	else if (path.contains("/mmc"))
+		dev.transport = "mmc";
+	else
+		dev.transport = "other";
+
+	QDir dir(sys);
+	foreach (QString entry, dir.entryList(QStringList() << QString("%1*").arg(name), QDir::Dirs, QDir::Name))
+		if (QFile::exists(QString("%1/%2/partition").arg(sys).arg(entry))) {
+			dev.partitions << entry;
+			dev.partitionSizes << readAttribute(QString("%1/%2/size").arg(sys).arg(entry)).toLongLong() * 512;
+		}
+	return dev;
+}
+
+/* set before any scan, the path is not locked */
+void HotplugMonitor::setSysfsRoot(const QString &path)
+{
+	sysfsBlock = path;
+}
+
+/* every reader that currently holds a card */
+QList<CardDevice> HotplugMonitor::scan()
+{
+	QList<CardDevice> list;
+	foreach (QString name, QDir(sysfsBlock).entryList(QDir::Dirs | QDir::NoDotAndDotDot, QDir::Name)) {
+		if (!isCardReader(name))
+			continue;
+		CardDevice dev = device(name);
+		if (dev.size > 0)
+			list << dev;
+	}
+	return list;
+}
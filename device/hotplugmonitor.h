@@ -0,0 +1,56 @@
+#ifndef HOTPLUGMONITOR_H
+#define HOTPLUGMONITOR_H
+
+#include <QList>
+#include <QObject>
+#include <QStringList>
+#include <QSocketNotifier>
+
+struct CardDevice {
+	QString name;
+	qint64 size;
+	bool removable;
+	QString transport;
+	QString model;
+	QString cid;
+	QStringList partitions;
+	QList<qint64> partitionSizes;
+
+	QString sizeText() const;
+	static QString sizeText(qint64 bytes);
+};
+
+/*
+ * Listens to kernel uevents on a netlink socket and reads everything else
+ * from sysfs, so noticing an inserted card costs neither a poll nor a
+ * process spawn.
+ */
+class HotplugMonitor : public QObject
+{
+	Q_OBJECT
+public:
+	HotplugMonitor(QObject *parent = 0);
+	~HotplugMonitor();
+	int start();
+	bool isActive();
+
+	static QList<CardDevice> scan();
+	static CardDevice device(const QString &name);
+	static bool isCardReader(const QString &name);
+	static void setSysfsRoot(const QString &path);
+signals:
+	void deviceAdded(const CardDevice &dev);
+	void deviceRemoved(const QString &name);
+	void changed();
+protected slots:
+	void readEvents();
+protected:
+	void handleEvent(const QByteArray &msg);
+	static QString readAttribute(const QString &path);
+private:
+	int fd;
+	QSocketNotifier *notifier;
+	QStringList present;
+};
+
+#endif // HOTPLUGMONITOR_H
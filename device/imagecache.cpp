@@ -0,0 +1,297 @@
+#include "imagecache.h"
+#include "mbr.h"
+#include "sparseimage.h"
+#include "cardformatter.h"
+#include "util/tracer.h"
+
+#include <QDir>
+#include <QFile>
+#include <QDebug>
+#include <QDateTime>
+#include <QFileInfo>
+#include <QTemporaryFile>
+#include <QCryptographicHash>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+QMutex ImageCache::hashLock;
+QWaitCondition ImageCache::hashDone;
+QMap<QString, QByteArray> ImageCache::hashes;
+QSet<QString> ImageCache::hashing;
+QMutex ImageCache::claimLock;
+QSet<QString> ImageCache::claimed;
+
+ImageCache::ImageCache(const QString &dir)
+{
+	this->dir = QDir(dir).filePath("golden");
+}
+
+/*
+ * Key of a card: content of every release payload and recipe source plus
+ * the recipe name. File hashes are remembered by path, size and mtime, so
+ * a batch hashes the multi-GB release only once.
+ */
+QString ImageCache::key(const QStringList &files, const QString &recipe)
+{
+	TRACE_SPAN("golden_key");
+	QCryptographicHash h(QCryptographicHash::Sha1);
+	h.addData(recipe.toUtf8());
+	foreach (QString file, files) {
+		QByteArray fh = fileHash(file);
+		if (fh.isEmpty())
+			return QString();
+		h.addData(fh);
+	}
+	return h.result().toHex();
+}
+
+/*
+ * Key of one card size: the partitions CardFormatter lays out on it are
+ * sized from the capacity, cards of another size need an image of their
+ * own. Empty when the card is too small for a layout.
+ */
+QString ImageCache::cardKey(const QString &key, qint64 capacity)
+{
+	CardLayout layout = CardFormatter::plan(capacity);
+	if (key.isEmpty() || layout.partitions.isEmpty())
+		return QString();
+	QCryptographicHash h(QCryptographicHash::Sha1);
+	h.addData(key.toUtf8());
+	foreach (MbrPartition p, layout.partitions)
+		h.addData(QString(" %1:%2+%3").arg(p.index).arg(p.start).arg(p.size).toUtf8());
+	return h.result().toHex();
+}
+
+/*
+ * sha1 of a file's content, remembered by path, size and mtime. The lock
+ * only guards the maps: different files are hashed at the same time, a
+ * thread asking for a file another one is reading waits for that result.
+ */
+QByteArray ImageCache::fileHash(const QString &file)
+{
+	QFileInfo info(file);
+	if (!info.exists())
+		return QByteArray();
+	QString id = QString("%1:%2:%3").arg(info.absoluteFilePath()).arg(info.size())
+			.arg(info.lastModified().toMSecsSinceEpoch());
+
+	hashLock.lock();
+	while (hashing.contains(id))
+		hashDone.wait(&hashLock);
+	if (hashes.contains(id)) {
+		QByteArray hash = hashes.value(id);
+		hashLock.unlock();
+		return hash;
+	}
+	hashing.insert(id);
+	hashLock.unlock();
+
+	QByteArray hash;
+	QFile f(file);
+	QCryptographicHash h(QCryptographicHash::Sha1);
+	if (f.open(QIODevice::ReadOnly) && h.addData(&f))
+		hash = h.result();
+
+	hashLock.lock();
+	hashing.remove(id);
+	if (!hash.isEmpty())
+		hashes.insert(id, hash);
+	hashDone.wakeAll();
+	hashLock.unlock();
+	return hash;
+}
+
+QString ImageCache::imagePath(const QString &key)
+{
+	return QDir(dir).filePath(QString("%1.img").arg(key));
+}
+
+QString ImageCache::sparsePath(const QString &key)
+{
+	return QDir(dir).filePath(QString("%1.simg").arg(key));
+}
+
+bool ImageCache::contains(const QString &key)
+{
+	if (key.isEmpty())
+		return false;
+	return QFile::exists(imagePath(key));
+}
+
+bool ImageCache::containsSparse(const QString &key)
+{
+	if (key.isEmpty())
+		return false;
+	return QFile::exists(sparsePath(key));
+}
+
+int ImageCache::remove(const QString &key)
+{
+	QFile::remove(sparsePath(key));
+	if (!QFile::remove(imagePath(key)))
+		return -1;
+	return 0;
+}
+
+/*
+ * Sparse form of a captured image, the raw one stays as verify reference.
+ * One job builds it, the others get 1 back like from capture().
+ */
+int ImageCache::buildSparse(const QString &key)
+{
+	if (!contains(key))
+		return setError(QString("no image for %1").arg(key));
+	if (containsSparse(key))
+		return 0;
+	if (!claim(sparsePath(key)))
+		return 1;
+	int err = 0;
+	SparseImage sparse(sparsePath(key));
+	if (!containsSparse(key) && sparse.build(imagePath(key)))
+		err = setError(sparse.errorString());
+	release(sparsePath(key));
+	return err;
+}
+
+/*
+ * Card jobs are threads of one process: the first job to claim a cache
+ * file writes it, the others leave it alone.
+ */
+bool ImageCache::claim(const QString &path)
+{
+	QMutexLocker locker(&claimLock);
+	if (claimed.contains(path))
+		return false;
+	claimed.insert(path);
+	return true;
+}
+
+void ImageCache::release(const QString &path)
+{
+	QMutexLocker locker(&claimLock);
+	claimed.remove(path);
+}
+
+/* end of the last primary partition, or -1 without a partition table */
+qint64 ImageCache::layoutEnd(const QString &device)
+{
+	return mbrLayoutEnd(readMbr(device));
+}
+
+/*
+ * Reads the card back up to the end of its last partition, leaving out
+ * free ext4 blocks and storing zero blocks as holes. Only one job
+ * captures a key, the others get 1 back. The image is written to a temp
+ * file of its own and renamed, so nobody ever sees half an image.
+ */
+int ImageCache::capture(const QString &device, const QString &key)
+{
+	TRACE_SPAN("golden_capture");
+	if (key.isEmpty())
+		return setError("empty key");
+	if (contains(key))
+		return 0;
+	if (!claim(imagePath(key)))
+		return 1;
+	int err = contains(key) ? 0 : captureImage(device, key);
+	release(imagePath(key));
+	return err;
+}
+
+int ImageCache::captureImage(const QString &device, const QString &key)
+{
+	qint64 end = layoutEnd(device);
+	if (end <= 0)
+		return setError(QString("%1: no partition table").arg(device));
+	if (!QDir().mkpath(dir))
+		return setError(QString("cannot create %1").arg(dir));
+	/* free ext4 blocks are neither read nor stored, the data partition spans the card */
+	QVector<QPair<qint64, qint64> > skip = SparseImage::freeRanges(device);
+
+	QByteArray path = QFile::encodeName(device);
+	int fd = ::open(path.constData(), O_RDONLY | O_DIRECT | O_CLOEXEC);
+	if (fd < 0 && errno == EINVAL)
+		fd = ::open(path.constData(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return setError(QString("open %1: %2").arg(device).arg(strerror(errno)));
+
+	const int bufsize = 4 * 1024 * 1024;
+	const int block = SparseImage::blockSize;
+	char *buf = NULL;
+	if (posix_memalign((void **)&buf, 4096, bufsize)) {
+		::close(fd);
+		return setError("out of memory");
+	}
+
+	/* zero blocks stay holes, the image takes the space of what the card holds */
+	QTemporaryFile out(imagePath(key) + ".XXXXXX.tmp");
+	int err = 0;
+	qint64 stored = 0;
+	if (!out.open()) {
+		err = setError(QString("create %1: %2").arg(out.fileTemplate()).arg(out.errorString()));
+	} else if (ftruncate(out.handle(), end)) {
+		err = setError(QString("truncate %1: %2").arg(out.fileName()).arg(strerror(errno)));
+	} else {
+		qint64 done = 0;
+		int s = 0;
+		while (done < end) {
+			while (s < skip.size() && skip[s].first + skip[s].second <= done)
+				s++;
+			if (s < skip.size() && skip[s].first <= done) {
+				done = qMin(end, skip[s].first + skip[s].second);
+				continue;
+			}
+			/* layouts end on sector boundaries, O_DIRECT is happy with that */
+			qint64 chunk = qMin<qint64>(bufsize, end - done);
+			if (s < skip.size())
+				chunk = qMin(chunk, skip[s].first - done);
+			ssize_t len = pread(fd, buf, chunk, done);
+			if (len < 0 && errno == EINTR)
+				continue;
+			if (len <= 0) {
+				err = setError(QString("read %1: %2").arg(device).arg(len ? strerror(errno) : "short read"));
+				break;
+			}
+			for (ssize_t b = 0; b < len && !err; b += block) {
+				int n = qMin<qint64>(block, len - b);
+				const char *p = buf + b;
+				if (p[0] == 0 && !memcmp(p, p + 1, n - 1))
+					continue;
+				if (pwrite(out.handle(), p, n, done + b) != n)
+					err = setError(QString("write %1: %2").arg(out.fileName()).arg(strerror(errno)));
+				stored += n;
+			}
+			done += len;
+		}
+		if (!err && fdatasync(out.handle()))
+			err = setError(QString("write %1: %2").arg(out.fileName()).arg(strerror(errno)));
+	}
+	free(buf);
+	::close(fd);
+
+	if (!err && rename(QFile::encodeName(out.fileName()).constData(),
+					   QFile::encodeName(imagePath(key)).constData()))
+		err = setError(QString("rename %1: %2").arg(out.fileName()).arg(strerror(errno)));
+	/* renamed away, nothing left for the destructor to remove */
+	if (!err) {
+		out.setAutoRemove(false);
+		qDebug() << "ImageCache:" << key << end << "bytes," << stored << "stored";
+	}
+	return err;
+}
+
+QString ImageCache::errorString()
+{
+	return error;
+}
+
+int ImageCache::setError(const QString &err)
+{
+	error = err;
+	qDebug() << "ImageCache:" << err;
+	return -2;
+}
@@ -0,0 +1,51 @@
+#ifndef IMAGECACHE_H
+#define IMAGECACHE_H
+
+#include <QSet>
+#include <QMap>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QStringList>
+
+/*
+ * Raw card images kept under <folder.binaries>/golden, one per release,
+ * recipe and card layout. The first card of a batch is made the slow way
+ * and read back into the cache, every following card is a single
+ * sequential copy of that image, or of its sparse form (SparseImage)
+ * which leaves out what the card does not need.
+ */
+class ImageCache
+{
+public:
+	ImageCache(const QString &dir);
+	QString key(const QStringList &files, const QString &recipe);
+	QString cardKey(const QString &key, qint64 capacity);
+	QString imagePath(const QString &key);
+	QString sparsePath(const QString &key);
+	bool contains(const QString &key);
+	bool containsSparse(const QString &key);
+	int capture(const QString &device, const QString &key);
+	int buildSparse(const QString &key);
+	int remove(const QString &key);
+	QString errorString();
+
+	static qint64 layoutEnd(const QString &device);
+	static QByteArray fileHash(const QString &file);
+protected:
+	int captureImage(const QString &device, const QString &key);
+	static bool claim(const QString &path);
+	static void release(const QString &path);
+	int setError(const QString &err);
+private:
+	QString dir;
+	QString error;
+
+	static QMutex hashLock;
+	static QWaitCondition hashDone;
+	static QMap<QString, QByteArray> hashes;
+	static QSet<QString> hashing;		/* ids a thread is reading right now */
+	static QMutex claimLock;
+	static QSet<QString> claimed;		/* files a job of this process is writing */
+};
+
+#endif // IMAGECACHE_H
@@ -0,0 +1,77 @@
+#include "mbr.h"
+
+#include <QFile>
+
+static quint32 le32(const uchar *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((quint32)p[3] << 24);
+}
+
+static void putLe32(uchar *p, quint32 v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+QList<MbrPartition> parseMbr(const uchar *sector)
+{
+	QList<MbrPartition> parts;
+	if (sector[510] != 0x55 || sector[511] != 0xaa)
+		return parts;
+	for (int i = 0; i < 4; i++) {
+		const uchar *e = sector + 446 + i * 16;
+		MbrPartition p;
+		p.index = i + 1;
+		p.type = e[4];
+		p.start = (qint64)le32(e + 8) * 512;
+		p.size = (qint64)le32(e + 12) * 512;
+		if (!p.type || !p.size)
+			continue;
+		parts << p;
+	}
+	return parts;
+}
+
+QList<MbrPartition> readMbr(const QString &path)
+{
+	QFile f(path);
+	if (!f.open(QIODevice::ReadOnly))
+		return QList<MbrPartition>();
+	QByteArray sector = f.read(512);
+	if (sector.size() != 512)
+		return QList<MbrPartition>();
+	return parseMbr((const uchar *)sector.constData());
+}
+
+/* end of the last partition, -1 without any */
+qint64 mbrLayoutEnd(const QList<MbrPartition> &parts)
+{
+	qint64 end = -1;
+	foreach (MbrPartition p, parts)
+		end = qMax(end, p.start + p.size);
+	return end;
+}
+
+QByteArray makeMbr(const QList<MbrPartition> &parts, quint32 signature)
+{
+	QByteArray sector(512, 0);
+	uchar *s = (uchar *)sector.data();
+	putLe32(s + 440, signature);
+	foreach (MbrPartition p, parts) {
+		if (p.index < 1 || p.index > 4)
+			continue;
+		uchar *e = s + 446 + (p.index - 1) * 16;
+		/* CHS fields saturated, everybody reads the LBA ones */
+		e[1] = e[5] = 0xfe;
+		e[2] = e[6] = 0xff;
+		e[3] = e[7] = 0xff;
+		e[4] = p.type;
+		putLe32(e + 8, p.start / 512);
+		putLe32(e + 12, p.size / 512);
+	}
+	s[510] = 0x55;
+	s[511] = 0xaa;
+	return sector;
+}
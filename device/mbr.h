@@ -0,0 +1,22 @@
+#ifndef MBR_H
+#define MBR_H
+
+#include <QList>
+#include <QString>
+#include <QByteArray>
+
+struct MbrPartition {
+	int index;		/* 1..4 */
+	quint8 type;
+	qint64 start;	/* bytes */
+	qint64 size;	/* bytes */
+};
+
+/* primary partitions of a card or image, empty without a valid MBR */
+QList<MbrPartition> readMbr(const QString &path);
+QList<MbrPartition> parseMbr(const uchar *sector);
+qint64 mbrLayoutEnd(const QList<MbrPartition> &parts);
+/* boot sector holding parts, LBA only, start and size sector aligned */
+QByteArray makeMbr(const QList<MbrPartition> &parts, quint32 signature);
+
+#endif // MBR_H
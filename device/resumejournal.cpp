@@ -0,0 +1,136 @@
+#include "resumejournal.h"
+
+#include <QDir>
+#include <QDebug>
+#include <QRegExp>
+#include <QStringList>
+#include <QCryptographicHash>
+
+#include <unistd.h>
+
+#define JOURNAL_MAGIC	"bkresume"
+#define JOURNAL_VERSION	1
+
+/* card: its CID; image: content hash of the file being written */
+ResumeJournal::ResumeJournal(const QString &dir, const QString &card, const QString &image)
+{
+	this->dir = QDir(dir).filePath("resume");
+	this->card = QString(card).replace(QRegExp("\\s+"), "_");
+	this->image = QString(image).replace(QRegExp("\\s+"), "_");
+	QByteArray id = QCryptographicHash::hash((this->card + "\n" + this->image).toUtf8(),
+											 QCryptographicHash::Sha1).toHex();
+	file = QDir(this->dir).filePath(QString("%1.journal").arg(QString(id)));
+}
+
+/*
+ * Loads what an earlier attempt confirmed. A torn last line (the station
+ * lost power while appending) is dropped, the file is rewritten clean.
+ */
+int ResumeJournal::open()
+{
+	crcs.clear();
+	pending.clear();
+	if (!QDir().mkpath(dir))
+		return setError(QString("cannot create %1").arg(dir));
+	QFile in(file);
+	if (in.open(QIODevice::ReadOnly | QIODevice::Text)) {
+		QStringList header = QString(in.readLine()).trimmed().split(" ");
+		if (header.size() == 4 && header.at(0) == JOURNAL_MAGIC &&
+				header.at(1).toInt() == JOURNAL_VERSION &&
+				header.at(2) == card && header.at(3) == image) {
+			while (!in.atEnd()) {
+				QByteArray line = in.readLine();
+				QStringList f = QString(line).trimmed().split(" ");
+				bool ok1, ok2;
+				qint64 extent = f.value(0).toLongLong(&ok1);
+				quint32 crc = f.value(1).toUInt(&ok2, 16);
+				if (!line.endsWith('\n') || f.size() != 2 || !ok1 || !ok2 || extent != crcs.size())
+					break;
+				crcs << crc;
+			}
+		}
+		in.close();
+	}
+	QVector<quint32> keep = crcs;
+	int err = reset();
+	if (err)
+		return err;
+	pending = keep;
+	crcs.clear();
+	return commit();
+}
+
+qint64 ResumeJournal::extents()
+{
+	return crcs.size();
+}
+
+quint32 ResumeJournal::crc(qint64 extent)
+{
+	return crcs.value(extent);
+}
+
+/* extent is on the card, not yet confirmed; extents come in order */
+void ResumeJournal::add(qint64 extent, quint32 crc)
+{
+	if (extent != crcs.size() + pending.size())
+		return;
+	pending << crc;
+}
+
+/* call after the card was synced */
+int ResumeJournal::commit()
+{
+	if (pending.isEmpty())
+		return 0;
+	QByteArray data;
+	for (int i = 0; i < pending.size(); i++)
+		data += QString("%1 %2\n").arg(crcs.size() + i).arg(pending.at(i), 8, 16, QChar('0')).toLatin1();
+	if (out.write(data) != data.size() || !out.flush() || fdatasync(out.handle()))
+		return setError(QString("write %1: %2").arg(file).arg(out.errorString()));
+	crcs += pending;
+	pending.clear();
+	return 0;
+}
+
+/* forgets everything, the card starts over */
+int ResumeJournal::reset()
+{
+	crcs.clear();
+	pending.clear();
+	out.close();
+	out.setFileName(file);
+	if (!out.open(QIODevice::WriteOnly | QIODevice::Truncate))
+		return setError(QString("open %1: %2").arg(file).arg(out.errorString()));
+	QByteArray header = QString("%1 %2 %3 %4\n").arg(JOURNAL_MAGIC).arg(JOURNAL_VERSION)
+			.arg(card).arg(image).toUtf8();
+	if (out.write(header) != header.size() || !out.flush() || fdatasync(out.handle()))
+		return setError(QString("write %1: %2").arg(file).arg(out.errorString()));
+	return 0;
+}
+
+/* the write finished, nothing to resume */
+void ResumeJournal::remove()
+{
+	out.close();
+	QFile::remove(file);
+	crcs.clear();
+	pending.clear();
+}
+
+QString ResumeJournal::path()
+{
+	return file;
+}
+
+QString ResumeJournal::errorString()
+{
+	return error;
+}
+
+int ResumeJournal::setError(const QString &err)
+{
+	error = err;
+	qDebug() << "ResumeJournal:" << err;
+	return -2;
+}
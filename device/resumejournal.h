@@ -0,0 +1,46 @@
+#ifndef RESUMEJOURNAL_H
+#define RESUMEJOURNAL_H
+
+#include <QFile>
+#include <QVector>
+#include <QString>
+
+/*
+ * Checkpoints of one image write to one card, a file per (card CID,
+ * image name, size and mtime) under <dir>/resume. The writer appends the
+ * crc32c of every extent it wrote, but only after the card confirmed them
+ * with a sync, so the file never claims more than the card holds. A card
+ * that comes back after a failed write continues behind the last extent
+ * instead of starting over.
+ *
+ *   bkresume 1 <card> <image>
+ *   <extent> <crc>
+ *   ...
+ */
+class ResumeJournal
+{
+public:
+	ResumeJournal(const QString &dir, const QString &card, const QString &image);
+	int open();
+	qint64 extents();
+	quint32 crc(qint64 extent);
+	void add(qint64 extent, quint32 crc);
+	int commit();
+	int reset();
+	void remove();
+	QString path();
+	QString errorString();
+protected:
+	int setError(const QString &err);
+private:
+	QString dir;
+	QString card;
+	QString image;
+	QString file;
+	QFile out;
+	QVector<quint32> crcs;
+	QVector<quint32> pending;
+	QString error;
+};
+
+#endif // RESUMEJOURNAL_H
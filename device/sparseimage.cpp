@@ -0,0 +1,576 @@
+#include "sparseimage.h"
+#include "mbr.h"
+#include "blockwriter.h"
+#include "util/crc32c.h"
+#include "util/tracer.h"
+
+#include <QFile>
+#include <QDebug>
+#include <QTemporaryFile>
+
+#include <algorithm>
+
+#include <zlib.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#define SPARSE_MAGIC	"BKSPARSE"
+#define SPARSE_VERSION	1
+#define RANGE_ZERO		(1ULL << 63)
+
+#define EXT_MAGIC			0xef53
+#define EXT_SPARSE_SUPER	0x0001	/* ro_compat */
+#define EXT_GDT_CSUM		0x0010	/* ro_compat */
+#define EXT_METADATA_CSUM	0x0400	/* ro_compat */
+#define EXT_META_BG			0x0010	/* incompat */
+#define EXT_64BIT			0x0080	/* incompat */
+#define EXT_SPARSE_SUPER2	0x0200	/* compat */
+
+#define BG_BLOCK_UNINIT		0x0002
+#define BG_INODE_ZEROED		0x0004
+
+static quint16 get16(const uchar *p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+static quint32 get32(const uchar *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((quint32)p[3] << 24);
+}
+
+static quint64 get64(const uchar *p)
+{
+	return get32(p) | ((quint64)get32(p + 4) << 32);
+}
+
+static void put32(uchar *p, quint32 v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+static void put64(uchar *p, quint64 v)
+{
+	put32(p, v);
+	put32(p + 4, v >> 32);
+}
+
+/* 64 bytes per step, stops at the first one that is not zero */
+static bool isZero(const uchar *p, int len)
+{
+	int i = 0;
+#if defined(__SSE2__)
+	const __m128i zero = _mm_setzero_si128();
+	for (; i + 64 <= len; i += 64) {
+		__m128i v = _mm_or_si128(_mm_or_si128(_mm_loadu_si128((const __m128i *)(p + i)),
+											  _mm_loadu_si128((const __m128i *)(p + i + 16))),
+								 _mm_or_si128(_mm_loadu_si128((const __m128i *)(p + i + 32)),
+											  _mm_loadu_si128((const __m128i *)(p + i + 48))));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero)) != 0xffff)
+			return false;
+	}
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+	for (; i + 64 <= len; i += 64) {
+		uint8x16_t v = vorrq_u8(vorrq_u8(vld1q_u8(p + i), vld1q_u8(p + i + 16)),
+								vorrq_u8(vld1q_u8(p + i + 32), vld1q_u8(p + i + 48)));
+		if (vmaxvq_u8(v))
+			return false;
+	}
+#endif
+	for (; i + 8 <= len; i += 8) {
+		quint64 v;
+		memcpy(&v, p + i, 8);
+		if (v)
+			return false;
+	}
+	for (; i < len; i++)
+		if (p[i])
+			return false;
+	return true;
+}
+
+/* backup superblock in group g */
+static bool hasSuper(quint32 g, bool sparse)
+{
+	if (!sparse || g <= 1)
+		return true;
+	static const quint32 bases[3] = { 3, 5, 7 };
+	for (int i = 0; i < 3; i++) {
+		quint32 n = g;
+		while (n % bases[i] == 0)
+			n /= bases[i];
+		if (n == 1)
+			return true;
+	}
+	return false;
+}
+
+static void setBits(QByteArray &map, qint64 from, qint64 to)
+{
+	for (qint64 i = qMax<qint64>(from, 0); i < to && i < (qint64)map.size() * 8; i++)
+		map[(int)(i / 8)] = map[(int)(i / 8)] | (1 << (i % 8));
+}
+
+static void clearBits(QByteArray &map, qint64 from, qint64 to)
+{
+	for (qint64 i = qMax<qint64>(from, 0); i < to && i < (qint64)map.size() * 8; i++)
+		map[(int)(i / 8)] = map[(int)(i / 8)] & ~(1 << (i % 8));
+}
+
+/*
+ * Blocks of an ext4 partition nothing points at: clear in the block
+ * bitmaps, and inode table tails past bg_itable_unused the kernel zeroes
+ * itself on first mount. Groups with BLOCK_UNINIT get the bitmap the
+ * kernel would build for them. Anything unexpected leaves the partition
+ * out, which only costs speed.
+ */
+static void ext4Free(QFile &f, const MbrPartition &p, QVector<QPair<qint64, qint64> > &list)
+{
+	uchar sb[1024];
+	if (!f.seek(p.start + 1024) || f.read((char *)sb, sizeof(sb)) != sizeof(sb))
+		return;
+	if (get16(sb + 56) != EXT_MAGIC)
+		return;
+	quint32 compat = get32(sb + 92);
+	quint32 incompat = get32(sb + 96);
+	quint32 rocompat = get32(sb + 100);
+	if ((incompat & EXT_META_BG) || (compat & EXT_SPARSE_SUPER2) || get32(sb + 24) > 6)
+		return;
+	bool is64 = incompat & EXT_64BIT;
+	qint64 bs = 1024LL << get32(sb + 24);
+	qint64 blocks = get32(sb + 4) | (is64 ? (qint64)get32(sb + 0x150) << 32 : 0);
+	quint32 first = get32(sb + 20);
+	quint32 bpg = get32(sb + 32);
+	quint32 ipg = get32(sb + 40);
+	quint32 isz = get32(sb + 76) ? get16(sb + 88) : 128;
+	int desc = is64 ? qMax(32, (int)get16(sb + 0xfe)) : 32;
+	if (!bpg || bpg % 8 || !isz || blocks <= first || blocks * bs > p.size)
+		return;
+	qint64 groups = (blocks - first + bpg - 1) / bpg;
+	qint64 gdtBlocks = (groups * desc + bs - 1) / bs;
+	qint64 itableBlocks = ((qint64)ipg * isz + bs - 1) / bs;
+	QByteArray gdt(groups * desc, 0);
+	if (!f.seek(p.start + (first + 1) * bs) || f.read(gdt.data(), gdt.size()) != gdt.size())
+		return;
+
+	/* bit i is block first + i */
+	QByteArray used((blocks - first + 7) / 8, 0);
+	for (qint64 g = 0; g < groups; g++) {
+		const uchar *d = (const uchar *)gdt.constData() + g * desc;
+		qint64 start = g * bpg;
+		qint64 count = qMin<qint64>(bpg, blocks - first - start);
+		if (get16(d + 18) & BG_BLOCK_UNINIT) {
+			if (hasSuper(g, rocompat & EXT_SPARSE_SUPER))
+				setBits(used, start, start + 1 + gdtBlocks + get16(sb + 0xce));
+			continue;
+		}
+		qint64 bitmap = get32(d) | (desc >= 64 ? (qint64)get32(d + 0x20) << 32 : 0);
+		if (bitmap <= 0 || bitmap >= blocks || !f.seek(p.start + bitmap * bs) ||
+				f.read(used.data() + start / 8, (count + 7) / 8) != (count + 7) / 8)
+			return;
+	}
+	/* bitmap bits past the end of the last group are padding */
+	clearBits(used, blocks - first, (qint64)used.size() * 8);
+	for (qint64 g = 0; g < groups; g++) {
+		const uchar *d = (const uchar *)gdt.constData() + g * desc;
+		qint64 bb = get32(d) | (desc >= 64 ? (qint64)get32(d + 0x20) << 32 : 0);
+		qint64 ib = get32(d + 4) | (desc >= 64 ? (qint64)get32(d + 0x24) << 32 : 0);
+		qint64 it = get32(d + 8) | (desc >= 64 ? (qint64)get32(d + 0x28) << 32 : 0);
+		setBits(used, bb - first, bb - first + 1);
+		setBits(used, ib - first, ib - first + 1);
+		setBits(used, it - first, it - first + itableBlocks);
+	}
+	if (rocompat & (EXT_GDT_CSUM | EXT_METADATA_CSUM)) {
+		for (qint64 g = 0; g < groups; g++) {
+			const uchar *d = (const uchar *)gdt.constData() + g * desc;
+			if (get16(d + 18) & BG_INODE_ZEROED)
+				continue;
+			qint64 it = get32(d + 8) | (desc >= 64 ? (qint64)get32(d + 0x28) << 32 : 0);
+			quint32 unused = get16(d + 28) | (desc >= 64 ? get16(d + 0x32) << 16 : 0);
+			if (unused > ipg)
+				continue;
+			qint64 inUse = ((qint64)(ipg - unused) * isz + bs - 1) / bs;
+			clearBits(used, it - first + inUse, it - first + itableBlocks);
+		}
+	}
+
+	qint64 bits = blocks - first;
+	for (qint64 i = 0; i < bits; ) {
+		if (used.at(i / 8) & (1 << (i % 8))) {
+			i++;
+			continue;
+		}
+		qint64 run = i;
+		while (run < bits && !(used.at(run / 8) & (1 << (run % 8))))
+			run++;
+		list << qMakePair(p.start + (first + i) * bs, (run - i) * bs);
+		i = run;
+	}
+}
+
+/* a chunk is stored as is when deflate does not make it smaller */
+static int putChunk(QFile &out, const QByteArray &data, QByteArray &packed, QList<SparseImage::Chunk> &chunks)
+{
+	SparseImage::Chunk c;
+	c.position = out.pos();
+	c.size = data.size();
+	c.crc = crc32c(0, data.constData(), data.size());
+	uLongf len = packed.size();
+	const char *p = data.constData();
+	if (compress2((Bytef *)packed.data(), &len, (const Bytef *)data.constData(), data.size(), Z_BEST_SPEED) == Z_OK &&
+			len < (uLongf)data.size())
+		p = packed.constData();
+	else
+		len = data.size();
+	c.stored = len;
+	if (out.write(p, len) != (qint64)len)
+		return -1;
+	chunks << c;
+	return 0;
+}
+
+SparseImage::SparseImage(const QString &path)
+{
+	this->path = path;
+	size = 0;
+}
+
+/* byte ranges of a card or image whose content does not matter, sorted */
+QVector<QPair<qint64, qint64> > SparseImage::freeRanges(const QString &raw)
+{
+	QVector<QPair<qint64, qint64> > list;
+	QFile f(raw);
+	if (!f.open(QIODevice::ReadOnly))
+		return list;
+	foreach (MbrPartition p, readMbr(raw))
+		ext4Free(f, p, list);
+	std::sort(list.begin(), list.end());
+	return list;
+}
+
+/*
+ * Scans a raw card image (a golden capture) and writes the sparse image
+ * to a temp file next to path, renamed into place once it is complete.
+ */
+int SparseImage::build(const QString &raw)
+{
+	TRACE_SPAN("sparse_build");
+	QFile in(raw);
+	if (!in.open(QIODevice::ReadOnly))
+		return setError(QString("open %1: %2").arg(raw).arg(in.errorString()));
+	size = in.size();
+	map.clear();
+	chunks.clear();
+	QVector<QPair<qint64, qint64> > skip = freeRanges(raw);
+
+	/* a name of its own, other builders of the same image never share it */
+	QTemporaryFile out(path + ".XXXXXX.tmp");
+	if (!out.open())
+		return setError(QString("create %1: %2").arg(out.fileTemplate()).arg(out.errorString()));
+	QString tmpname = out.fileName();
+	int err = 0;
+	if (out.write(QByteArray(headerSize, 0)) != headerSize)
+		err = setError(QString("write %1: %2").arg(tmpname).arg(out.errorString()));
+
+	QByteArray buf(chunkSize, 0);
+	QByteArray pending;
+	pending.reserve(chunkSize);
+	QByteArray packed(compressBound(chunkSize), 0);
+	int s = 0;
+	for (qint64 pos = 0; !err && pos < size; ) {
+		qint64 len = in.read(buf.data(), qMin<qint64>(chunkSize, size - pos));
+		if (len <= 0) {
+			err = setError(QString("read %1: short read").arg(raw));
+			break;
+		}
+		const uchar *data = (const uchar *)buf.constData();
+		for (qint64 b = 0; b < len; b += blockSize) {
+			qint64 at = pos + b;
+			int n = qMin<qint64>(blockSize, len - b);
+			while (s < skip.size() && skip[s].first + skip[s].second <= at)
+				s++;
+			if (s < skip.size() && skip[s].first <= at && at + n <= skip[s].first + skip[s].second)
+				continue;
+			bool zero = isZero(data + b, n);
+			if (!map.isEmpty() && map.last().zero == zero &&
+					map.last().offset + map.last().length == at) {
+				map.last().length += n;
+			} else {
+				Range r;
+				r.offset = at;
+				r.length = n;
+				r.zero = zero;
+				map << r;
+			}
+			if (zero)
+				continue;
+			pending.append((const char *)data + b, n);
+			if (pending.size() == chunkSize) {
+				if (putChunk(out, pending, packed, chunks)) {
+					err = setError(QString("write %1: %2").arg(tmpname).arg(out.errorString()));
+					break;
+				}
+				pending.clear();
+			}
+		}
+		pos += len;
+	}
+	if (!err && !pending.isEmpty() && putChunk(out, pending, packed, chunks))
+		err = setError(QString("write %1: %2").arg(tmpname).arg(out.errorString()));
+
+	if (!err) {
+		QByteArray index(map.size() * 16 + chunks.size() * 24, 0);
+		uchar *p = (uchar *)index.data();
+		foreach (Range r, map) {
+			put64(p, r.offset);
+			put64(p + 8, r.length | (r.zero ? RANGE_ZERO : 0));
+			p += 16;
+		}
+		foreach (Chunk c, chunks) {
+			put64(p, c.position);
+			put32(p + 8, c.stored);
+			put32(p + 12, c.size);
+			put32(p + 16, c.crc);
+			p += 24;
+		}
+		QByteArray header(headerSize, 0);
+		uchar *h = (uchar *)header.data();
+		memcpy(h, SPARSE_MAGIC, 8);
+		put32(h + 8, SPARSE_VERSION);
+		put32(h + 12, blockSize);
+		put64(h + 16, size);
+		put32(h + 24, map.size());
+		put32(h + 28, chunks.size());
+		put64(h + 32, out.pos());
+		put32(h + 40, index.size());
+		put32(h + 44, crc32c(0, index.constData(), index.size()));
+		put32(h + 48, crc32c(0, h, 48));
+		if (out.write(index) != index.size() || !out.seek(0) || out.write(header) != headerSize)
+			err = setError(QString("write %1: %2").arg(tmpname).arg(out.errorString()));
+	}
+	out.close();
+	if (!err && rename(QFile::encodeName(tmpname).constData(), QFile::encodeName(path).constData()))
+		err = setError(QString("rename %1: %2").arg(tmpname).arg(strerror(errno)));
+	/* the temp file is only removed when it was not renamed */
+	if (!err)
+		out.setAutoRemove(false);
+	return err;
+}
+
+/* reads header and index, the chunks are read by write() */
+int SparseImage::open()
+{
+	QFile f(path);
+	if (!f.open(QIODevice::ReadOnly))
+		return setError(QString("open %1: %2").arg(path).arg(f.errorString()));
+	QByteArray header = f.read(headerSize);
+	const uchar *h = (const uchar *)header.constData();
+	if (header.size() != headerSize || memcmp(h, SPARSE_MAGIC, 8) ||
+			get32(h + 8) != SPARSE_VERSION || get32(h + 12) != blockSize ||
+			get32(h + 48) != crc32c(0, h, 48))
+		return setError(QString("%1: not a sparse image").arg(path));
+	quint32 ranges = get32(h + 24);
+	quint32 count = get32(h + 28);
+	quint32 len = get32(h + 40);
+	if (len != (quint64)ranges * 16 + (quint64)count * 24 || !f.seek(get64(h + 32)))
+		return setError(QString("%1: bad index").arg(path));
+	QByteArray index = f.read(len);
+	if ((quint32)index.size() != len || crc32c(0, index.constData(), len) != get32(h + 44))
+		return setError(QString("%1: bad index").arg(path));
+
+	size = get64(h + 16);
+	map.clear();
+	chunks.clear();
+	const uchar *p = (const uchar *)index.constData();
+	for (quint32 i = 0; i < ranges; i++, p += 16) {
+		Range r;
+		r.offset = get64(p);
+		r.length = get64(p + 8) & ~RANGE_ZERO;
+		r.zero = get64(p + 8) & RANGE_ZERO;
+		map << r;
+	}
+	for (quint32 i = 0; i < count; i++, p += 24) {
+		Chunk c;
+		c.position = get64(p);
+		c.stored = get32(p + 8);
+		c.size = get32(p + 12);
+		c.crc = get32(p + 16);
+		if (c.size > (quint32)chunkSize || c.stored > c.size)
+			return setError(QString("%1: bad index").arg(path));
+		chunks << c;
+	}
+
+	/* chunks hold the data ranges back to back */
+	placement.clear();
+	int r = 0;
+	qint64 done = 0;
+	foreach (Chunk c, chunks) {
+		QList<Range> list;
+		qint64 at = 0;
+		while (at < c.size) {
+			while (r < map.size() && (map[r].zero || done == map[r].length)) {
+				r++;
+				done = 0;
+			}
+			if (r == map.size())
+				return setError(QString("%1: more data than ranges").arg(path));
+			Range p;
+			p.offset = map[r].offset + done;
+			p.length = qMin<qint64>(c.size - at, map[r].length - done);
+			p.zero = false;
+			list << p;
+			at += p.length;
+			done += p.length;
+		}
+		placement << list;
+	}
+	file.close();
+	file.setFileName(path);
+	return 0;
+}
+
+/*
+ * Zero ranges first, then the data ranges in image order. Everything
+ * else on the card is left as it is. The writer must be open.
+ */
+int SparseImage::write(BlockWriter *writer)
+{
+	TRACE_SPAN("sparse_write");
+	if (map.isEmpty() && open())
+		return -2;
+	int err = writeZero(writer);
+	if (err)
+		return err;
+
+	writer->begin(dataBytes());
+	QByteArray data(chunkSize, 0);
+	for (int i = 0; i < chunks.size(); i++) {
+		if (readChunk(i, data.data()))
+			return -2;
+		qint64 at = 0;
+		foreach (Range r, placement.at(i)) {
+			if (writer->writeData(data.constData() + at, r.length, r.offset))
+				return setError(writer->errorString());
+			at += r.length;
+		}
+	}
+	if (writer->sync())
+		return setError(writer->errorString());
+	return 0;
+}
+
+int SparseImage::chunkCount()
+{
+	return chunks.size();
+}
+
+/* where the data of chunk index goes on the card, in the order it is stored */
+QList<SparseImage::Range> SparseImage::chunkRanges(int index)
+{
+	return placement.value(index);
+}
+
+/* inflates chunk index into data, which holds at least chunkSize bytes */
+int SparseImage::readChunk(int index, char *data)
+{
+	Chunk c = chunks.at(index);
+	if (!file.isOpen() && !file.open(QIODevice::ReadOnly))
+		return setError(QString("open %1: %2").arg(path).arg(file.errorString()));
+	if (c.stored < c.size) {
+		QByteArray packed(c.stored, 0);
+		if (!file.seek(c.position) || file.read(packed.data(), c.stored) != c.stored)
+			return setError(QString("read %1: short read").arg(path));
+		uLongf len = c.size;
+		if (uncompress((Bytef *)data, &len, (const Bytef *)packed.constData(), c.stored) != Z_OK ||
+				len != c.size)
+			return setError(QString("%1: chunk at %2 does not inflate").arg(path).arg(c.position));
+	} else if (!file.seek(c.position) || file.read(data, c.size) != c.size) {
+		return setError(QString("read %1: short read").arg(path));
+	}
+	if (crc32c(0, data, c.size) != c.crc)
+		return setError(QString("%1: chunk at %2 is damaged").arg(path).arg(c.position));
+	return 0;
+}
+
+/*
+ * Zero ranges hold filesystem metadata too, they are zeroed for real with
+ * BLKZEROOUT: write-zeroes where the card has it, zero pages where not.
+ * A discard may leave unaligned or short ranges untouched and still
+ * succeed, so it never stands in for zeros.
+ */
+int SparseImage::writeZero(BlockWriter *writer)
+{
+	foreach (Range r, map) {
+		if (!r.zero)
+			continue;
+		if (writer->zeroOut(r.offset, r.length))
+			return setError(writer->errorString());
+	}
+	return 0;
+}
+
+qint64 SparseImage::imageSize()
+{
+	return size;
+}
+
+qint64 SparseImage::dataBytes()
+{
+	qint64 n = 0;
+	foreach (Range r, map)
+		if (!r.zero)
+			n += r.length;
+	return n;
+}
+
+qint64 SparseImage::zeroBytes()
+{
+	qint64 n = 0;
+	foreach (Range r, map)
+		if (r.zero)
+			n += r.length;
+	return n;
+}
+
+QList<SparseImage::Range> SparseImage::ranges()
+{
+	return map;
+}
+
+/* (offset, length) of everything inside the image that is not written */
+QList<QPair<qint64, qint64> > SparseImage::holes()
+{
+	QList<QPair<qint64, qint64> > list;
+	qint64 end = 0;
+	foreach (Range r, map) {
+		if (r.offset > end)
+			list << qMakePair(end, r.offset - end);
+		end = r.offset + r.length;
+	}
+	if (size > end)
+		list << qMakePair(end, size - end);
+	return list;
+}
+
+QString SparseImage::errorString()
+{
+	return error;
+}
+
+int SparseImage::setError(const QString &err)
+{
+	error = err;
+	qDebug() << "SparseImage:" << err;
+	return -2;
+}
@@ -0,0 +1,70 @@
+#ifndef SPARSEIMAGE_H
+#define SPARSEIMAGE_H
+
+#include <QFile>
+#include <QList>
+#include <QPair>
+#include <QString>
+#include <QVector>
+
+class BlockWriter;
+
+/*
+ * Card image that only carries what has to reach the card, like bmap.
+ * The image is cut in 4 KiB blocks; blocks an ext4 partition does not
+ * use are left out, blocks that are all zero are only recorded, the rest
+ * is stored as deflated 4 MiB chunks with an index. Writing it costs the
+ * payload, not the partition size.
+ *
+ *   header (4 KiB)  magic, sizes, index position and crc
+ *   chunks          deflated (or stored) data of the data ranges, in order
+ *   index           ranges, then one entry per chunk
+ */
+class SparseImage
+{
+public:
+	struct Range {
+		qint64 offset;
+		qint64 length;
+		bool zero;			/* must read back as zero, nothing stored */
+	};
+	struct Chunk {
+		qint64 position;	/* in the image file */
+		quint32 stored;
+		quint32 size;
+		quint32 crc;		/* crc32c of the inflated data */
+	};
+
+	SparseImage(const QString &path);
+	int build(const QString &raw);
+	int open();
+	int write(BlockWriter *writer);
+	int writeZero(BlockWriter *writer);
+	int chunkCount();
+	QList<Range> chunkRanges(int index);
+	int readChunk(int index, char *data);
+	qint64 imageSize();
+	qint64 dataBytes();
+	qint64 zeroBytes();
+	QList<Range> ranges();
+	QList<QPair<qint64, qint64> > holes();
+	QString errorString();
+
+	static QVector<QPair<qint64, qint64> > freeRanges(const QString &raw);
+
+	static const int blockSize = 4096;
+	static const int chunkSize = 4 * 1024 * 1024;
+	static const int headerSize = 4096;
+protected:
+	int setError(const QString &err);
+private:
+	QString path;
+	qint64 size;
+	QList<Range> map;
+	QList<Chunk> chunks;
+	QList<QList<Range> > placement;
+	QFile file;
+	QString error;
+};
+
+#endif // SPARSEIMAGE_H
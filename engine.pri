@@ -0,0 +1,68 @@
+#-------------------------------------------------
+#
+# Card programming engine, shared by the gui and the command line front
+# end. Nothing in here may depend on QtWidgets.
+#
+#-------------------------------------------------
+
+QT       += core gui network
+
+INCLUDEPATH += $$PWD
+
+SOURCES += $$PWD/cardassistant.cpp \
+    $$PWD/cardjob.cpp \
+    $$PWD/processrunner.cpp \
+    $$PWD/device/mbr.cpp \
+    $$PWD/device/cardformatter.cpp \
+    $$PWD/device/blockwriter.cpp \
+    $$PWD/device/imagecache.cpp \
+    $$PWD/device/sparseimage.cpp \
+    $$PWD/device/fanoutwriter.cpp \
+    $$PWD/device/resumejournal.cpp \
+    $$PWD/device/hotplugmonitor.cpp \
+    $$PWD/device/cardverifier.cpp \
+    $$PWD/release/chunkqueue.cpp \
+    $$PWD/release/gzipinflater.cpp \
+    $$PWD/release/tarextractor.cpp \
+    $$PWD/release/releaseindex.cpp \
+    $$PWD/release/ubootscript.cpp \
+    $$PWD/release/downloader.cpp \
+    $$PWD/release/bufferpool.cpp \
+    $$PWD/release/releaseingest.cpp \
+    $$PWD/mac/macpool.cpp \
+    $$PWD/util/crc32c.cpp \
+    $$PWD/util/tracer.cpp \
+    $$PWD/util/logger.cpp \
+    $$PWD/json/jsonhelper.cpp \
+    $$PWD/json/qjsonmodel.cpp
+
+HEADERS  += $$PWD/cardassistant.h \
+    $$PWD/cardjob.h \
+    $$PWD/processrunner.h \
+    $$PWD/device/mbr.h \
+    $$PWD/device/cardformatter.h \
+    $$PWD/device/blockwriter.h \
+    $$PWD/device/imagecache.h \
+    $$PWD/device/sparseimage.h \
+    $$PWD/device/fanoutwriter.h \
+    $$PWD/device/resumejournal.h \
+    $$PWD/device/hotplugmonitor.h \
+    $$PWD/device/cardverifier.h \
+    $$PWD/release/chunkqueue.h \
+    $$PWD/release/gzipinflater.h \
+    $$PWD/release/tarextractor.h \
+    $$PWD/release/releaseindex.h \
+    $$PWD/release/ubootscript.h \
+    $$PWD/release/downloader.h \
+    $$PWD/release/bufferpool.h \
+    $$PWD/release/releaseingest.h \
+    $$PWD/mac/macpool.h \
+    $$PWD/util/crc32c.h \
+    $$PWD/util/tracer.h \
+    $$PWD/util/logger.h \
+    $$PWD/json/jsonhelper.h \
+    $$PWD/json/qjsonmodel.h
+
+QMAKE_CXXFLAGS += -std=c++11
+
+LIBS += -lz
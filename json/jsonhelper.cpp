@@ -1,26 +1,45 @@
 #include "jsonhelper.h"
+#include "util/tracer.h"
 
 #include <QFile>
 #include <QDebug>
+#include <QFileInfo>
+#include <fcntl.h>
 #include <unistd.h>
 #include <QJsonArray>
 #include <QTimer>
 
 JsonHelper::JsonHelper(const QString &file)
 {
-	filename = file;
+	timer = NULL;
+	journalRecords = 0;
+	/* card workers never chdir, but keep the config location fixed anyway */
+	filename = QFileInfo(file).absoluteFilePath();
+	journalname = QString(filename).replace(".json", ".journal");
 	obj = jsonRead(filename);
 	if (obj.isEmpty())
 		return;
+	/* leftovers of a run that did not get to compact */
+	if (replayJournal() > 0)
+		compact();
 	timer = new QTimer();
-	timer->start(1000);
+	timer->setSingleShot(true);
+	timer->setInterval(flushDelay);
 	connect(timer, SIGNAL(timeout()), SLOT(saveAll()));
 }
 
+JsonHelper::~JsonHelper()
+{
+	flush();
+	QMutexLocker locker(&lock);
+	if (journalRecords)
+		compact();
+	delete timer;
+}
+
 void JsonHelper::saveAll()
 {
-	save();
-	timer->setInterval(1000);
+	flush();
 }
 
 QJsonObject JsonHelper::jsonRead(const QString &filename)
@@ -39,23 +58,102 @@ QJsonObject JsonHelper::jsonRead(const QString &filename)
 	return root;
 }
 
+/* whole document, written next to the original and renamed over it */
 int JsonHelper::save()
 {
+	QMutexLocker locker(&lock);
+	return compact();
+}
+
+int JsonHelper::compact()
+{
+	TRACE_SPAN("json_compact");
 	QString tmpname = QString(filename).replace(".json", ".tmp");
 	QFile f(tmpname);
 	if (!f.open(QIODevice::WriteOnly | QIODevice::Text | QFile::Truncate))
 		return -2;
 	f.write(QJsonDocument(obj).toJson());
+	f.flush();
 	fsync(f.handle());
 	f.close();
-	rename(qPrintable(tmpname), qPrintable(filename));
-	/* w/o sync() jffs2 fails */
-	::sync();
+	if (rename(qPrintable(tmpname), qPrintable(filename)))
+		return -2;
+	/* w/o a synced directory the rename is lost on jffs2 */
+	syncDirectory();
+	QFile::remove(journalname);
+	journalRecords = 0;
+	dirty.clear();
+	return 0;
+}
+
+void JsonHelper::syncDirectory()
+{
+	int fd = ::open(QFile::encodeName(QFileInfo(filename).absolutePath()).constData(), O_RDONLY | O_DIRECTORY);
+	if (fd < 0)
+		return;
+	fsync(fd);
+	::close(fd);
+}
+
+/* writes the changed keys out, called from the coalescing timer */
+int JsonHelper::flush()
+{
+	QMutexLocker locker(&lock);
+	if (dirty.isEmpty())
+		return 0;
+	int err = writeJournal();
+	if (err)
+		return compact();
+	if (journalRecords >= compactRecords)
+		return compact();
+	return 0;
+}
+
+/* one line per changed key, one fdatasync per batch */
+int JsonHelper::writeJournal()
+{
+	TRACE_SPAN("json_journal");
+	QByteArray batch;
+	foreach (QString key, dirty) {
+		QJsonObject record;
+		record.insert("key", key);
+		record.insert("value", rawValue(key));
+		batch.append(QJsonDocument(record).toJson(QJsonDocument::Compact));
+		batch.append('\n');
+	}
+	QFile f(journalname);
+	if (!f.open(QIODevice::WriteOnly | QIODevice::Append))
+		return -2;
+	if (f.write(batch) != batch.size())
+		return -2;
+	f.flush();
+	fdatasync(f.handle());
+	f.close();
+	journalRecords += dirty.size();
+	dirty.clear();
 	return 0;
 }
 
+/* number of records applied, a torn last line is ignored */
+int JsonHelper::replayJournal()
+{
+	QFile f(journalname);
+	if (!f.open(QIODevice::ReadOnly))
+		return 0;
+	int records = 0;
+	foreach (QByteArray line, f.readAll().split('\n')) {
+		QJsonDocument doc = QJsonDocument::fromJson(line);
+		if (!doc.isObject())
+			continue;
+		apply(doc.object().value("key").toString(), doc.object().value("value").toString());
+		records++;
+	}
+	return records;
+}
+
 QString JsonHelper::value(QString key)
 {
+	QMutexLocker locker(&lock);
 	QString str;
 	if(key.contains(".")) {
 		QStringList flds = key.split(".");
@@ -72,12 +170,46 @@ QString JsonHelper::value(QString key)
 	return str;
 }
 
+QString JsonHelper::rawValue(const QString &key)
+{
+	if (key.contains(".")) {
+		QStringList flds = key.split(".");
+		return obj.value(flds.at(0)).toObject().value(flds.at(1)).toString();
+	}
+	return obj.value(key).toString();
+}
+
+bool JsonHelper::hasKey(const QString &key)
+{
+	if (key.contains(".")) {
+		QStringList flds = key.split(".");
+		return obj.value(flds.at(0)).toObject().contains(flds.at(1));
+	}
+	return obj.contains(key);
+}
+
 QJsonObject JsonHelper::valueObject(QString key)
 {
+	QMutexLocker locker(&lock);
 	return obj.value(key).toObject();
 }
 
 int JsonHelper::insert(const QString &key, const QString &value)
+{
+	QMutexLocker locker(&lock);
+	/* unchanged values must not wake the disk */
+	if (hasKey(key) && rawValue(key) == value)
+		return 0;
+	apply(key, value);
+	if (!dirty.contains(key))
+		dirty << key;
+	/* callers may live in card worker threads, the timer does not */
+	if (timer)
+		QMetaObject::invokeMethod(timer, "start", Qt::QueuedConnection);
+	return 0;
+}
+
+void JsonHelper::apply(const QString &key, const QString &value)
 {
 	if (key.contains(".")) {
 		QStringList flds = key.split(".");
@@ -85,10 +217,8 @@ int JsonHelper::insert(const QString &key, const QString &value)
 		stats_obj = obj.value(flds.at(0)).toObject();
 		stats_obj[flds.at(1)] = value;
 		obj.insert(flds.at(0), stats_obj);
-		return 0;
 	} else {
 		obj.insert(key, value);
-		return 0;
 	}
 }
 
@@ -3,24 +3,51 @@
 
 #include "qjsonmodel.h"
 
+#include <QMutex>
+#include <QStringList>
+
+class QTimer;
+
+/*
+ * Config store behind creater.json. Changes are appended to a small
+ * journal next to it (creater.journal) shortly after the last insert and
+ * folded back into the json file once the journal grows; nothing is
+ * written while nothing changes.
+ */
 class JsonHelper : public QObject
 {
 	Q_OBJECT
 public:
 	JsonHelper(const QString &file);
+	~JsonHelper();
 	int save();
+	int flush();
 	QString value(QString key);
 	QJsonObject valueObject(QString key);
 	int insert(const QString &key, const QString &value);
+
+	static const int flushDelay = 200;
+	static const int compactRecords = 256;
 protected:
 	QString replaceVariable(QString str);
 	QJsonObject jsonRead(const QString &filename);
+	QString rawValue(const QString &key);
+	bool hasKey(const QString &key);
+	void apply(const QString &key, const QString &value);
+	int replayJournal();
+	int writeJournal();
+	int compact();
+	void syncDirectory();
 protected slots:
 	void saveAll();
 private:
 	QJsonObject obj;
 	QString filename;
+	QString journalname;
 	QTimer *timer;
+	QMutex lock;
+	QStringList dirty;
+	int journalRecords;
 };
 
 #endif // JSONHELPER_H
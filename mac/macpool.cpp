@@ -0,0 +1,252 @@
+#include "macpool.h"
+#include "util/tracer.h"
+
+#include <QDir>
+#include <QSet>
+#include <QMap>
+#include <QDebug>
+#include <QRegExp>
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+
+#define POOL_MAGIC "BMACPOOL"
+
+MacPool::MacPool(const QString &dir)
+{
+	this->dir = dir;
+	data = NULL;
+	header = NULL;
+	file.setFileName(QDir(dir).filePath("macs.pool"));
+}
+
+MacPool::~MacPool()
+{
+	close();
+}
+
+int MacPool::open()
+{
+	if (data)
+		return 0;
+	if (!file.open(QIODevice::ReadWrite))
+		return setError(QString("open %1: %2").arg(file.fileName()).arg(file.errorString()));
+	/*
+	 * the gui and the cli batch may lease on the same station: the pool is
+	 * held exclusively until close(), header and journal are only read
+	 * once the lock is ours
+	 */
+	if (flock(file.handle(), LOCK_EX)) {
+		QString err = strerror(errno);
+		file.close();
+		return setError(QString("lock %1: %2").arg(file.fileName()).arg(err));
+	}
+	if (file.size() == 0) {
+		Header h;
+		memset(&h, 0, sizeof(h));
+		memcpy(h.magic, POOL_MAGIC, 8);
+		h.version = 1;
+		if (file.write((const char *)&h, sizeof(h)) != sizeof(h))
+			return setError(QString("write %1: %2").arg(file.fileName()).arg(file.errorString()));
+		file.flush();
+		fdatasync(file.handle());
+	}
+	int err = map();
+	if (err)
+		return err;
+	if (memcmp(header->magic, POOL_MAGIC, 8) ||
+			file.size() < (qint64)(sizeof(Header) + header->count * recordSize)) {
+		close();
+		return setError(QString("%1 is corrupt").arg(file.fileName()));
+	}
+	return recover();
+}
+
+void MacPool::close()
+{
+	if (data)
+		file.unmap(data);
+	data = NULL;
+	header = NULL;
+	file.close();
+}
+
+int MacPool::map()
+{
+	if (data)
+		file.unmap(data);
+	data = file.map(0, file.size());
+	if (!data)
+		return setError(QString("mmap %1: %2").arg(file.fileName()).arg(file.errorString()));
+	header = (Header *)data;
+	return 0;
+}
+
+qint64 MacPool::size()
+{
+	return header ? header->count : 0;
+}
+
+qint64 MacPool::available()
+{
+	return header ? header->count - header->cursor : 0;
+}
+
+/*
+ * A "lease" without its "done" means the program died while writing the
+ * mgen files. Those addresses may be on a card already, keep them
+ * consumed.
+ */
+int MacPool::recover()
+{
+	QFile j(QDir(dir).filePath("macs.journal"));
+	if (!j.open(QIODevice::ReadOnly))
+		return 0;
+	QMap<quint64, quint64> pending;
+	foreach (QByteArray line, j.readAll().split('\n')) {
+		QList<QByteArray> flds = line.split(' ');
+		if (flds.size() == 3 && flds.at(0) == "lease")
+			pending.insert(flds.at(1).toULongLong(), flds.at(2).toULongLong());
+		else if (flds.size() >= 2 && flds.at(0) == "done")
+			pending.remove(flds.at(1).toULongLong());
+	}
+	j.close();
+
+	foreach (quint64 start, pending.keys()) {
+		quint64 end = qMin<quint64>(start + pending.value(start), header->count);
+		if (header->cursor < end)
+			header->cursor = end;
+		qDebug() << "MacPool: unfinished lease" << start << "kept consumed";
+	}
+	if (msync(data, sizeof(Header), MS_SYNC))
+		return setError("msync failed");
+	/* every lease is settled in the header now */
+	j.remove();
+	return 0;
+}
+
+int MacPool::journal(const QByteArray &record)
+{
+	QFile j(QDir(dir).filePath("macs.journal"));
+	if (!j.open(QIODevice::WriteOnly | QIODevice::Append))
+		return setError(QString("open %1: %2").arg(j.fileName()).arg(j.errorString()));
+	if (j.write(record) != record.size())
+		return setError(QString("write %1: %2").arg(j.fileName()).arg(j.errorString()));
+	j.flush();
+	fdatasync(j.handle());
+	return 0;
+}
+
+/*
+ * Appends the addresses of a downloaded list (one per line) that are not
+ * already waiting in the pool, then renames the list away.
+ */
+int MacPool::importText(const QString &path)
+{
+	TRACE_SPAN("mac_import");
+	if (!data)
+		return setError("pool is not open");
+	QFile text(path);
+	if (!text.open(QIODevice::ReadOnly))
+		return setError(QString("open %1: %2").arg(path).arg(text.errorString()));
+
+	QSet<QByteArray> waiting;
+	for (quint64 i = header->cursor; i < header->count; i++)
+		waiting.insert(QByteArray((const char *)data + sizeof(Header) + i * recordSize, recordSize - 1));
+
+	QRegExp mac("^[0-9A-Fa-f]{2}([:-][0-9A-Fa-f]{2}){5}$");
+	QByteArray records;
+	while (!text.atEnd()) {
+		QByteArray line = text.readLine().trimmed();
+		if (line.isEmpty())
+			continue;
+		if (!mac.exactMatch(line)) {
+			qDebug() << "MacPool: skipping" << line;
+			continue;
+		}
+		if (waiting.contains(line))
+			continue;
+		waiting.insert(line);
+		records.append(line).append('\n');
+	}
+	text.close();
+
+	if (!records.isEmpty()) {
+		quint64 count = header->count;
+		qint64 end = sizeof(Header) + count * recordSize;
+		file.unmap(data);
+		data = NULL;
+		header = NULL;
+		if (!file.resize(end + records.size()) || !file.seek(end) ||
+				file.write(records) != records.size())
+			return setError(QString("write %1: %2").arg(file.fileName()).arg(file.errorString()));
+		file.flush();
+		fdatasync(file.handle());
+		int err = map();
+		if (err)
+			return err;
+		/* records are durable before the count covers them */
+		header->count = count + records.size() / recordSize;
+		msync(data, sizeof(Header), MS_SYNC);
+	}
+
+	QString done = path + ".imported";
+	QFile::remove(done);
+	if (!QFile::rename(path, done))
+		QFile::remove(path);
+	return records.size() / recordSize;
+}
+
+int MacPool::lease(int files, int perFile, const QString &outdir, const QString &pattern)
+{
+	TRACE_SPAN("mac_lease");
+	if (!data)
+		return setError("pool is not open");
+	quint64 count = (quint64)files * perFile;
+	if (files <= 0 || perFile <= 0)
+		return setError("nothing to lease");
+	if ((quint64)available() < count)
+		return -6;
+
+	quint64 start = header->cursor;
+	int err = journal(QString("lease %1 %2\n").arg(start).arg(count).toLatin1());
+	if (err)
+		return err;
+	header->cursor = start + count;
+	if (msync(data, sizeof(Header), MS_SYNC))
+		return setError("msync failed");
+
+	if (!QDir().mkpath(outdir))
+		return setError(QString("mkdir %1").arg(outdir));
+	const char *block = (const char *)data + sizeof(Header) + start * recordSize;
+	for (int i = 0; i < files; i++) {
+		QFile f(QDir(outdir).filePath(QString(pattern).arg(i + 1)));
+		if (!f.open(QIODevice::WriteOnly | QIODevice::Truncate))
+			return setError(QString("open %1: %2").arg(f.fileName()).arg(f.errorString()));
+		qint64 len = (qint64)perFile * recordSize;
+		if (f.write(block + i * len, len) != len)
+			return setError(QString("write %1: %2").arg(f.fileName()).arg(f.errorString()));
+	}
+
+	/* the old shell flow kept every handed out address in oldmacs.txt */
+	QFile old(QDir(dir).filePath("oldmacs.txt"));
+	if (old.open(QIODevice::WriteOnly | QIODevice::Append))
+		old.write(block, count * recordSize);
+
+	return journal(QString("done %1\n").arg(start).toLatin1());
+}
+
+QString MacPool::errorString()
+{
+	return error;
+}
+
+int MacPool::setError(const QString &err)
+{
+	error = err;
+	qDebug() << "MacPool:" << err;
+	return -2;
+}
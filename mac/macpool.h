@@ -0,0 +1,50 @@
+#ifndef MACPOOL_H
+#define MACPOOL_H
+
+#include <QFile>
+#include <QString>
+
+/*
+ * MAC address pool kept in a memory mapped file (macs.pool) with fixed
+ * 18 byte records ("00:11:22:33:44:55\n") behind a small header holding
+ * the consumed cursor. Leasing a block is O(1) in the pool size: journal
+ * the lease, move the cursor, write the mgen files. The cursor is moved
+ * before any file is written, so a crash can lose addresses but never
+ * hand the same one out twice. An open pool holds an flock on macs.pool,
+ * other processes of the station wait in open().
+ */
+class MacPool
+{
+public:
+	MacPool(const QString &dir);
+	~MacPool();
+	int open();
+	void close();
+	int importText(const QString &path);
+	qint64 size();
+	qint64 available();
+	int lease(int files, int perFile, const QString &outdir, const QString &pattern);
+	QString errorString();
+
+	static const int recordSize = 18;
+protected:
+	struct Header {
+		char magic[8];
+		quint64 version;
+		quint64 count;
+		quint64 cursor;
+		char reserved[32];
+	};
+	int map();
+	int recover();
+	int journal(const QByteArray &record);
+	int setError(const QString &err);
+private:
+	QString dir;
+	QFile file;
+	uchar *data;
+	Header *header;
+	QString error;
+};
+
+#endif // MACPOOL_H
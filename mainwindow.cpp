@@ -1,7 +1,9 @@
 #include "mainwindow.h"
 #include "ui_mainwindow.h"
+#include "util/tracer.h"
 
 #include <QDebug>
+#include <QStatusBar>
 #include <QMessageBox>
 #include <QInputDialog>
 
@@ -22,26 +24,48 @@ MainWindow::MainWindow(QWidget *parent) :
 	ui->statusTypes->setStyleSheet(gray);
 	ui->statusVersion->setStyleSheet(gray);
 	card = new CardAssistant();
+	/* "trace": file the chrome trace is written to after every batch */
+	traceFile = card->jsonHelper()->value("trace");
+	Tracer::setEnabled(!traceFile.isEmpty());
 	if (waitForPassword())
 		return;
-	card->getProgressBar(ui->progressBar);
+	connect(card, SIGNAL(progressRange(int,int)), SLOT(progressRange(int,int)));
+	connect(card, SIGNAL(progressChanged(int)), ui->progressBar, SLOT(setValue(int)));
+	connect(card, SIGNAL(releaseListReady(QStringList)), SLOT(releaseListReady(QStringList)));
+	connect(card, SIGNAL(releaseDownloaded(QString,int)), SLOT(releaseDownloaded(QString,int)));
+	jobs = new CardJobManager(card->jsonHelper(), this);
+	connect(jobs, SIGNAL(jobStarted(QString,CardJob*)), SLOT(jobStarted(QString,CardJob*)));
+	connect(jobs, SIGNAL(jobFinished(QString,int)), SLOT(jobFinished(QString,int)));
+	connect(jobs, SIGNAL(allFinished()), SLOT(allJobsFinished()));
+	connect(jobs, SIGNAL(queueChanged(int,int)), SLOT(queueChanged(int,int)));
 	ui->mediatypes->addItems(card->insertMediaInit());
 	ui->cardtypes->addItems(card->SDCardTypesInit());
 	ui->versionList->addItems(card->versionTypesInit());
 
+	monitor = new HotplugMonitor(this);
+	connect(monitor, SIGNAL(changed()), SLOT(timeout()));
 	timer = new QTimer();
 	connect(timer, SIGNAL(timeout()), SLOT(timeout()));
-	timer->start(2000);
+	/* without a netlink socket fall back to polling */
+	if (monitor->start())
+		timer->start(2000);
 }
 
 MainWindow::~MainWindow()
 {
+	if (!traceFile.isEmpty())
+		Tracer::exportChrome(traceFile);
 	delete ui;
 }
 
 void MainWindow::timeout()
 {
 	timer->setInterval(2000);
+	/* a step is still streaming its output, refresh once it is done */
+	if (card->isBusy()) {
+		QTimer::singleShot(2000, this, SLOT(timeout()));
+		return;
+	}
 	ui->mediatypes->clear();
 	ui->mediatypes->addItems(card->insertMediaInit());
 }
@@ -87,6 +111,30 @@ void MainWindow::menuReleaseDownload()
 	card->downloadReleaseList();
 }
 
+void MainWindow::progressRange(int min, int max)
+{
+	ui->progressBar->setVisible(true);
+	ui->progressBar->setRange(min, max);
+}
+
+void MainWindow::releaseListReady(const QStringList &releases)
+{
+	bool ok = false;
+	QString release = QInputDialog::getItem(this, "Select Release File", "Releases", releases, 0, false, &ok);
+	if (ok && !release.isEmpty())
+		card->downloadRelease(release.trimmed());
+}
+
+void MainWindow::releaseDownloaded(const QString &release, int err)
+{
+	if (err) {
+		QMessageBox::warning(this, "Download Release", trUtf8("%1 indirilemedi.").arg(release));
+		return;
+	}
+	ui->versionList->clear();
+	ui->versionList->addItems(card->versionTypesInit());
+}
+
 void MainWindow::menuMacUpdate()
 {
 	card->downloadMac();
@@ -109,21 +157,7 @@ void MainWindow::on_cardtypes_activated(const QString &arg1)
 		ui->statusTypes->setStyleSheet(red);
 	} else
 		ui->statusTypes->setStyleSheet(green);
-	if(ui->statusTypes->styleSheet() == green) {
-		if (arg1.contains("poe")) {
-			QString numOfMacFiles = QInputDialog::getText(this, tr("Yapmak istediğiniz Sd kart sayısını giriniz"),
-														  tr(" SD Kart Sayısı"));
-			err = card->createMacfile(numOfMacFiles);
-			if (err == -6){
-				QMessageBox::warning(this, "Error", "Yetersiz MAC addresi");
-				return;
-			}
-			if (err == -2){
-				QMessageBox::warning(this, "Error", "Komut Çalıştırma hatası");
-				return;
-			}
-		}
-	}
+	/* poe cards lease their mac files in the prepare stage, one card at a time */
 }
 void MainWindow::on_versionList_activated(const QString &arg1)
 {
@@ -144,25 +178,120 @@ void MainWindow::on_buttonFormat_clicked()
 	}
 	else ui->statusMedia->setStyleSheet(gray);
 
-	if (mediatypes.contains("1") | mediatypes.contains("2") | mediatypes.contains("3")) {
+	/* partitions can not be formatted, whatever digits the size has */
+	if (!CardJobManager::isWholeDisk(mediatypes)) {
 		QMessageBox::warning(this, trUtf8("SD KART FORMAT"), trUtf8("Format tamamlanamadı: Lütfen düzgün bir kart tipi seçiniz."));
 		ui->statusMedia->setStyleSheet(red);
 		return;
 	}
 
-	int err = card->runFormat(ui->statusMedia->styleSheet(), mediatypes);
-	if (err != 0){
-		ui->statusMedia->setStyleSheet(red);
-	} else {
-		QMessageBox::about(this, trUtf8("SD KART FORMAT"), trUtf8("Format tamamlandı."));
-		ui->statusMedia->setStyleSheet(green);
+	/* a job like any card, the gui thread never writes the card */
+	QString media = mediatypes.split(" ").first();
+	if (jobs->format(media)) {
+		QMessageBox::warning(this, trUtf8("SD KART FORMAT"), trUtf8("%1 programlanıyor, format yapılamaz.").arg(media));
+		return;
 	}
+	formatMedias << media;
 }
 
 
 void MainWindow::on_pushButton_3_clicked()
 {
+	/* a busy reader takes the card as its next one */
+	if (jobs->isRunning()) {
+		QMessageBox::StandardButton reply = QMessageBox::question(this, "Açıklama",
+				trUtf8("Kartlar programlanıyor (%1). Yeni kart sıraya alınsın mı?")
+				.arg(jobs->runningMedias().join(", ")));
+		if (reply != QMessageBox::Yes)
+			return;
+	}
+
+	QStringList medias;
+	for (int i = 0; i < ui->mediatypes->count(); i++) {
+		QString media = ui->mediatypes->itemText(i);
+		if (CardJobManager::isWholeDisk(media))
+			medias << media.split(" ").first();
+	}
+
 	QMessageBox::StandardButton reply = QMessageBox::question(this, "Açıklama", card->getInformation());
-	if (reply == QMessageBox::Yes)
-		qDebug() << card->runProgramLoader(card->getScriptTypes());
+	if (reply != QMessageBox::Yes)
+		return;
+
+	if (medias.size() > 1) {
+		reply = QMessageBox::question(this, "Açıklama",
+									  trUtf8("%1 kart takılı (%2). Hepsi programlansın mı?")
+									  .arg(medias.size()).arg(medias.join(", ")));
+		if (reply != QMessageBox::Yes)
+			medias.clear();
+	}
+	/* a single card takes the same job path, the gui thread never runs a stage */
+	if (medias.size() <= 1) {
+		QString media = card->jsonHelper()->value("current.media");
+		if (media.isEmpty())
+			return;
+		medias = QStringList() << media;
+	}
+	if (!jobs->isRunning())
+		jobResults.clear();
+	jobs->start(medias, card->getScriptTypes());
+}
+
+void MainWindow::jobStarted(const QString &media, CardJob *job)
+{
+	QProgressBar *pbar = jobBars.value(media);
+	if (!pbar) {
+		pbar = new QProgressBar(ui->groupBox);
+		pbar->setFormat(QString("%1 %p%").arg(media));
+		ui->gridLayout_5->addWidget(pbar, ui->gridLayout_5->rowCount(), 0, 1, 2);
+		jobBars.insert(media, pbar);
+	}
+	pbar->setVisible(true);
+	pbar->setValue(0);
+	connect(job, SIGNAL(progressRange(int,int)), pbar, SLOT(setRange(int,int)));
+	connect(job, SIGNAL(progressChanged(int)), pbar, SLOT(setValue(int)));
+}
+
+void MainWindow::jobFinished(const QString &media, int err)
+{
+	if (formatMedias.removeOne(media)) {
+		ui->statusMedia->setStyleSheet(err ? red : green);
+		if (err)
+			QMessageBox::warning(this, trUtf8("SD KART FORMAT"), trUtf8("Format tamamlanamadı (%1).").arg(err));
+		else
+			QMessageBox::about(this, trUtf8("SD KART FORMAT"), trUtf8("Format tamamlandı."));
+		return;
+	}
+	jobResults.insert(media, err);
+	QProgressBar *pbar = jobBars.value(media);
+	if (pbar && err)
+		pbar->setFormat(QString("%1 HATA (%2)").arg(media).arg(err));
+	qDebug() << media << err;
+}
+
+void MainWindow::queueChanged(int host, int device)
+{
+	statusBar()->showMessage(trUtf8("Hazırlanan kart: %1, okuyucu kuyruğu: %2").arg(host).arg(device));
+}
+
+void MainWindow::allJobsFinished()
+{
+	if (!traceFile.isEmpty() && Tracer::exportChrome(traceFile))
+		qDebug() << "trace not written to" << traceFile;
+	/* busy share of the host pool, every reader and every stage */
+	QStringList busy;
+	QMap<QString, double> u = jobs->utilization();
+	foreach (QString resource, u.keys())
+		busy << QString("%1 %2%").arg(resource).arg(qRound(u.value(resource) * 100));
+	statusBar()->showMessage(busy.join(", "));
+	/* only formats ran */
+	if (jobResults.isEmpty())
+		return;
+	QStringList failed;
+	foreach (QString media, jobResults.keys())
+		if (jobResults.value(media))
+			failed << media;
+	if (failed.isEmpty())
+		QMessageBox::about(this, "Açıklama", trUtf8("%1 kart programlandı.").arg(jobResults.size()));
+	else
+		QMessageBox::warning(this, "Açıklama", trUtf8("Hatalı kartlar: %1").arg(failed.join(", ")));
 }
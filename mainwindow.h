@@ -2,7 +2,10 @@
 #define MAINWINDOW_H
 
 #include <QMainWindow>
+#include <QProgressBar>
 #include <cardassistant.h>
+#include <cardjob.h>
+#include <device/hotplugmonitor.h>
 
 namespace Ui {
 class MainWindow;
@@ -24,6 +27,13 @@ protected slots:
 	void timeout();
 	void menuMacUpdate();
 	void menuReleaseDownload();
+	void progressRange(int min, int max);
+	void releaseListReady(const QStringList &releases);
+	void releaseDownloaded(const QString &release, int err);
+	void jobStarted(const QString &media, CardJob *job);
+	void jobFinished(const QString &media, int err);
+	void queueChanged(int host, int device);
+	void allJobsFinished();
 private slots:
 	void on_mediatypes_activated(const QString &arg1);
 
@@ -38,8 +48,14 @@ private slots:
 private:
 	Ui::MainWindow *ui;
 	CardAssistant *card;
+	CardJobManager *jobs;
+	QMap<QString, QProgressBar *> jobBars;
+	QMap<QString, int> jobResults;
+	QStringList formatMedias;	/* format jobs, reported on their own */
 	QString mediatypes;
+	QString traceFile;
 	QTimer *timer;
+	HotplugMonitor *monitor;
 	QMenu *menuFile;
 	QMenu *menuEdit;
 	QAction *actMacUpdate;
@@ -0,0 +1,252 @@
+#include "processrunner.h"
+
+#include <QDebug>
+
+#include <signal.h>
+#include <unistd.h>
+
+/*
+ * Every step gets a process group of its own, kill() takes the script
+ * and whatever it started (dd, mkfs, sudo's child) down with the shell.
+ */
+class GroupProcess : public QProcess
+{
+public:
+	GroupProcess(QObject *parent) : QProcess(parent) {}
+protected:
+	void setupChildProcess()
+	{
+		::setpgid(0, 0);
+	}
+};
+
+ProcessRunner::ProcessRunner(QObject *parent)
+	: QObject(parent)
+{
+	proc = new GroupProcess(this);
+	timer = new QTimer(this);
+	timer->setSingleShot(true);
+	loop = NULL;
+	running = false;
+	timedout = false;
+	failedToStart = false;
+	code = 0;
+	timeoutMs = 30000;
+
+	connect(proc, SIGNAL(readyReadStandardOutput()), SLOT(readStandardOutput()));
+	connect(proc, SIGNAL(readyReadStandardError()), SLOT(readStandardError()));
+	connect(proc, SIGNAL(finished(int,QProcess::ExitStatus)), SLOT(processFinished(int,QProcess::ExitStatus)));
+	connect(proc, SIGNAL(error(QProcess::ProcessError)), SLOT(processError(QProcess::ProcessError)));
+	connect(timer, SIGNAL(timeout()), SLOT(timeout()));
+}
+
+ProcessRunner::~ProcessRunner()
+{
+	kill();
+}
+
+void ProcessRunner::setWorkingDirectory(const QString &dir)
+{
+	proc->setWorkingDirectory(dir);
+}
+
+/* 0 or less: no timeout */
+void ProcessRunner::setTimeout(int msecs)
+{
+	timeoutMs = msecs;
+}
+
+void ProcessRunner::setErrorPatterns(const QStringList &patterns)
+{
+	this->patterns = patterns;
+}
+
+int ProcessRunner::start(const QString &cmd)
+{
+	if (running)
+		return -1;
+	resetState();
+	proc->start(cmd);
+	return startProcess();
+}
+
+int ProcessRunner::start(const QString &program, const QStringList &args)
+{
+	if (running)
+		return -1;
+	resetState();
+	proc->start(program, args);
+	return startProcess();
+}
+
+/* before QProcess::start(), which may already report a failed start */
+void ProcessRunner::resetState()
+{
+	output.clear();
+	pendingOut.clear();
+	pendingErr.clear();
+	firstError.clear();
+	timedout = false;
+	failedToStart = false;
+	code = 0;
+	running = true;
+}
+
+int ProcessRunner::startProcess()
+{
+	if (!running)
+		return failedToStart ? -1 : 0;
+	if (timeoutMs > 0)
+		timer->start(timeoutMs);
+	return 0;
+}
+
+/*
+ * Returns 0 once the process exited, -1 if it could not be started and
+ * -7 if the step timeout killed it. The exit code itself is left to
+ * exitCode(), the scripts we run do not use it consistently.
+ */
+int ProcessRunner::wait()
+{
+	if (running) {
+		QEventLoop l;
+		loop = &l;
+		l.exec(QEventLoop::ExcludeUserInputEvents);
+		loop = NULL;
+	}
+	if (failedToStart)
+		return -1;
+	if (timedout)
+		return -7;
+	return 0;
+}
+
+/*
+ * SIGTERM to the whole group first, sudo passes it on to the script it
+ * runs as root, which this user can not signal itself; then SIGKILL.
+ */
+void ProcessRunner::kill()
+{
+	if (proc->state() == QProcess::NotRunning)
+		return;
+	pid_t group = proc->processId();
+	if (group > 0 && ::kill(-group, SIGTERM) == 0 && proc->waitForFinished(1000))
+		return;
+	if (group > 0)
+		::kill(-group, SIGKILL);
+	proc->kill();
+	proc->waitForFinished(3000);
+}
+
+bool ProcessRunner::isRunning()
+{
+	return running;
+}
+
+bool ProcessRunner::isTimedOut()
+{
+	return timedout;
+}
+
+int ProcessRunner::exitCode()
+{
+	return code;
+}
+
+/* first line that matched an error pattern */
+QString ProcessRunner::errorLine()
+{
+	return firstError;
+}
+
+QByteArray ProcessRunner::readAllStandardOutput()
+{
+	QByteArray data = output;
+	output.clear();
+	return data;
+}
+
+void ProcessRunner::readStandardOutput()
+{
+	QByteArray data = proc->readAllStandardOutput();
+	output.append(data);
+	splitLines(pendingOut, data, false);
+}
+
+void ProcessRunner::readStandardError()
+{
+	splitLines(pendingErr, proc->readAllStandardError(), true);
+}
+
+void ProcessRunner::splitLines(QByteArray &pending, const QByteArray &data, bool stderrChannel)
+{
+	pending.append(data);
+	int pos;
+	while ((pos = pending.indexOf('\n')) >= 0) {
+		QString line = QString::fromUtf8(pending.left(pos));
+		pending.remove(0, pos + 1);
+		if (stderrChannel)
+			emit errorLineReady(line);
+		else
+			emit lineReady(line);
+		checkLine(line);
+	}
+}
+
+void ProcessRunner::checkLine(const QString &line)
+{
+	foreach (QString pattern, patterns) {
+		if (!line.contains(pattern))
+			continue;
+		if (firstError.isEmpty())
+			firstError = line;
+		emit errorDetected(line);
+		return;
+	}
+}
+
+void ProcessRunner::processFinished(int code, QProcess::ExitStatus status)
+{
+	readStandardOutput();
+	readStandardError();
+	/* flush the unterminated last lines */
+	if (!pendingOut.isEmpty())
+		splitLines(pendingOut, "\n", false);
+	if (!pendingErr.isEmpty())
+		splitLines(pendingErr, "\n", true);
+	this->code = status == QProcess::NormalExit ? code : -1;
+	done();
+}
+
+void ProcessRunner::processError(QProcess::ProcessError err)
+{
+	if (err != QProcess::FailedToStart)
+		return;
+	failedToStart = true;
+	code = -1;
+	done();
+}
+
+void ProcessRunner::timeout()
+{
+	qDebug() << "process timeout" << proc->program();
+	timedout = true;
+	emit timedOut();
+	kill();
+	/* kill() normally ends up in processFinished() */
+	if (running) {
+		code = -1;
+		done();
+	}
+}
+
+void ProcessRunner::done()
+{
+	if (!running)
+		return;
+	running = false;
+	timer->stop();
+	emit finished(code);
+	if (loop)
+		loop->quit();
+}
@@ -0,0 +1,70 @@
+#ifndef PROCESSRUNNER_H
+#define PROCESSRUNNER_H
+
+#include <QTimer>
+#include <QProcess>
+#include <QEventLoop>
+#include <QStringList>
+
+/*
+ * Event driven wrapper around QProcess. Output is split into lines and
+ * streamed as it arrives, error patterns are matched on every line and a
+ * per step timeout kills commands that hang. wait() spins a local event
+ * loop that only serves this process; it is meant for the card job
+ * threads, a gui thread caller would still queue every click behind it.
+ */
+class ProcessRunner : public QObject
+{
+	Q_OBJECT
+public:
+	ProcessRunner(QObject *parent = 0);
+	~ProcessRunner();
+	void setWorkingDirectory(const QString &dir);
+	void setTimeout(int msecs);
+	void setErrorPatterns(const QStringList &patterns);
+
+	int start(const QString &cmd);
+	int start(const QString &program, const QStringList &args);
+	int wait();
+	void kill();
+
+	bool isRunning();
+	bool isTimedOut();
+	int exitCode();
+	QString errorLine();
+	QByteArray readAllStandardOutput();
+signals:
+	void lineReady(const QString &line);
+	void errorLineReady(const QString &line);
+	void errorDetected(const QString &line);
+	void timedOut();
+	void finished(int exitCode);
+protected:
+	void resetState();
+	int startProcess();
+	void splitLines(QByteArray &pending, const QByteArray &data, bool stderrChannel);
+	void checkLine(const QString &line);
+	void done();
+protected slots:
+	void readStandardOutput();
+	void readStandardError();
+	void processFinished(int code, QProcess::ExitStatus status);
+	void processError(QProcess::ProcessError err);
+	void timeout();
+private:
+	QProcess *proc;
+	QTimer *timer;
+	QEventLoop *loop;
+	QStringList patterns;
+	QByteArray output;
+	QByteArray pendingOut;
+	QByteArray pendingErr;
+	QString firstError;
+	bool running;
+	bool timedout;
+	bool failedToStart;
+	int code;
+	int timeoutMs;
+};
+
+#endif // PROCESSRUNNER_H
@@ -0,0 +1,66 @@
+#include "bufferpool.h"
+
+#include <stdlib.h>
+
+BufferPool::BufferPool(int count, int size)
+{
+	this->size = (size + 4095) & ~4095;
+	total = qMax(1, count);
+	memory = NULL;
+	if (posix_memalign((void **)&memory, 4096, (size_t)this->size * total))
+		memory = NULL;
+	for (int i = 0; memory && i < total; i++)
+		freeList << memory + (qint64)i * this->size;
+}
+
+BufferPool::~BufferPool()
+{
+	free(memory);
+}
+
+/* NULL when every buffer is in use */
+char *BufferPool::tryAcquire()
+{
+	QMutexLocker locker(&lock);
+	if (freeList.isEmpty())
+		return NULL;
+	return freeList.takeLast();
+}
+
+char *BufferPool::acquire()
+{
+	QMutexLocker locker(&lock);
+	while (freeList.isEmpty())
+		released.wait(&lock);
+	return freeList.takeLast();
+}
+
+void BufferPool::release(char *buf)
+{
+	if (!buf)
+		return;
+	QMutexLocker locker(&lock);
+	freeList << buf;
+	released.wakeOne();
+}
+
+int BufferPool::bufferSize()
+{
+	return size;
+}
+
+int BufferPool::count()
+{
+	return total;
+}
+
+int BufferPool::available()
+{
+	QMutexLocker locker(&lock);
+	return freeList.size();
+}
+
+qint64 BufferPool::capacity()
+{
+	return (qint64)size * total;
+}
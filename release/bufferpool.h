@@ -0,0 +1,34 @@
+#ifndef BUFFERPOOL_H
+#define BUFFERPOOL_H
+
+#include <QList>
+#include <QMutex>
+#include <QWaitCondition>
+
+/*
+ * Fixed set of equally sized, page aligned buffers allocated once. The
+ * pool is the memory budget of a stage: when every buffer is in flight the
+ * producer has to wait (or stop reading) until a consumer gives one back.
+ */
+class BufferPool
+{
+public:
+	BufferPool(int count, int size);
+	~BufferPool();
+	char *tryAcquire();
+	char *acquire();
+	void release(char *buf);
+	int bufferSize();
+	int count();
+	int available();
+	qint64 capacity();
+private:
+	QMutex lock;
+	QWaitCondition released;
+	QList<char *> freeList;
+	char *memory;
+	int size;
+	int total;
+};
+
+#endif // BUFFERPOOL_H
@@ -0,0 +1,80 @@
+#include "chunkqueue.h"
+
+ChunkQueue::ChunkQueue(qint64 maxBytes)
+{
+	bytes = 0;
+	limit = maxBytes;
+	closed = false;
+	aborted = false;
+}
+
+bool ChunkQueue::push(const QByteArray &chunk)
+{
+	QMutexLocker locker(&lock);
+	/* a single chunk bigger than the limit still has to get through */
+	while (!aborted && bytes > 0 && bytes + chunk.size() > limit)
+		notFull.wait(&lock);
+	if (aborted || closed)
+		return false;
+	if (chunk.isEmpty())
+		return true;
+	chunks.enqueue(chunk);
+	bytes += chunk.size();
+	notEmpty.wakeAll();
+	return true;
+}
+
+QByteArray ChunkQueue::pop()
+{
+	QMutexLocker locker(&lock);
+	while (!aborted && !closed && chunks.isEmpty())
+		notEmpty.wait(&lock);
+	if (aborted || chunks.isEmpty())
+		return QByteArray();
+	QByteArray chunk = chunks.dequeue();
+	bytes -= chunk.size();
+	notFull.wakeAll();
+	return chunk;
+}
+
+void ChunkQueue::close()
+{
+	QMutexLocker locker(&lock);
+	closed = true;
+	notEmpty.wakeAll();
+}
+
+void ChunkQueue::abort(const QString &err)
+{
+	QMutexLocker locker(&lock);
+	aborted = true;
+	if (error.isEmpty())
+		error = err;
+	chunks.clear();
+	bytes = 0;
+	notEmpty.wakeAll();
+	notFull.wakeAll();
+}
+
+bool ChunkQueue::isAborted()
+{
+	QMutexLocker locker(&lock);
+	return aborted;
+}
+
+QString ChunkQueue::errorString()
+{
+	QMutexLocker locker(&lock);
+	return error;
+}
+
+qint64 ChunkQueue::pending()
+{
+	QMutexLocker locker(&lock);
+	return bytes;
+}
+
+qint64 ChunkQueue::maxBytes()
+{
+	return limit;
+}
@@ -0,0 +1,39 @@
+#ifndef CHUNKQUEUE_H
+#define CHUNKQUEUE_H
+
+#include <QMutex>
+#include <QQueue>
+#include <QByteArray>
+#include <QWaitCondition>
+
+/*
+ * Bounded byte queue between two pipeline stages. push() blocks while more
+ * than maxBytes are waiting, pop() blocks until data arrives and returns
+ * an empty array once the producer closed the queue or either side
+ * aborted it.
+ */
+class ChunkQueue
+{
+public:
+	ChunkQueue(qint64 maxBytes = 16 * 1024 * 1024);
+	bool push(const QByteArray &chunk);
+	QByteArray pop();
+	void close();
+	void abort(const QString &err);
+	bool isAborted();
+	QString errorString();
+	qint64 pending();
+	qint64 maxBytes();
+private:
+	QMutex lock;
+	QWaitCondition notFull;
+	QWaitCondition notEmpty;
+	QQueue<QByteArray> chunks;
+	qint64 bytes;
+	qint64 limit;
+	bool closed;
+	bool aborted;
+	QString error;
+};
+
+#endif // CHUNKQUEUE_H
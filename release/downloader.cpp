@@ -0,0 +1,643 @@
+#include "downloader.h"
+#include "bufferpool.h"
+#include "chunkqueue.h"
+
+#include <QDebug>
+#include <QQueue>
+#include <QMutex>
+#include <QThread>
+#include <QWaitCondition>
+#include <QRegExp>
+#include <QFileInfo>
+#include <QJsonArray>
+#include <QJsonObject>
+#include <QJsonDocument>
+#include <QNetworkRequest>
+#include <QCryptographicHash>
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+/*
+ * Puts filled pool buffers on disk at their offsets and hands them back,
+ * so a slow card reader or disk never blocks the network event loop.
+ * With a pipe every buffer is also passed downstream once it is on disk,
+ * bytes already on disk from an earlier session go first.
+ */
+class DiskWriter : public QThread
+{
+public:
+	DiskWriter(int fd, BufferPool *pool, QObject *notify, ChunkQueue *pipe, qint64 prefix)
+	{
+		this->fd = fd;
+		this->pool = pool;
+		this->notify = notify;
+		this->pipe = pipe;
+		this->prefix = prefix;
+		written = prefix;
+		busy = false;
+		stopping = false;
+		err = 0;
+	}
+	void push(char *buf, int len, qint64 offset)
+	{
+		Pending p = { buf, len, offset };
+		QMutexLocker locker(&lock);
+		queue.enqueue(p);
+		wake.wakeOne();
+	}
+	/* returns once everything pushed so far is written */
+	int drain()
+	{
+		QMutexLocker locker(&lock);
+		while (!queue.isEmpty() || busy)
+			idle.wait(&lock);
+		return err;
+	}
+	int error()
+	{
+		QMutexLocker locker(&lock);
+		return err;
+	}
+	/* end of the data on disk, for the single ordered stream of a pipe */
+	qint64 writtenEnd()
+	{
+		QMutexLocker locker(&lock);
+		return written;
+	}
+	void stop()
+	{
+		lock.lock();
+		stopping = true;
+		wake.wakeOne();
+		lock.unlock();
+		wait();
+	}
+protected:
+	void run()
+	{
+		if (pipe)
+			feedPrefix();
+		forever {
+			lock.lock();
+			while (queue.isEmpty() && !stopping)
+				wake.wait(&lock);
+			if (queue.isEmpty()) {
+				lock.unlock();
+				break;
+			}
+			Pending p = queue.dequeue();
+			busy = true;
+			lock.unlock();
+
+			int ret = 0;
+			int off = 0;
+			while (off < p.len) {
+				ssize_t n = pwrite(fd, p.buf + off, p.len - off, p.offset + off);
+				if (n < 0 && errno == EINTR)
+					continue;
+				if (n <= 0) {
+					ret = n < 0 ? errno : EIO;
+					break;
+				}
+				off += n;
+			}
+			if (pipe && !ret && !pipe->isAborted())
+				pipe->push(QByteArray(p.buf, p.len));
+			pool->release(p.buf);
+			QMetaObject::invokeMethod(notify, "resumeReading", Qt::QueuedConnection);
+
+			lock.lock();
+			busy = false;
+			written = qMax(written, p.offset + off);
+			if (ret && !err)
+				err = ret;
+			if (queue.isEmpty())
+				idle.wakeAll();
+			lock.unlock();
+		}
+	}
+	void feedPrefix()
+	{
+		QByteArray buf(pool->bufferSize(), Qt::Uninitialized);
+		for (qint64 pos = 0; pos < prefix && !pipe->isAborted(); ) {
+			ssize_t n = pread(fd, buf.data(), qMin<qint64>(buf.size(), prefix - pos), pos);
+			if (n <= 0) {
+				pipe->abort(QString("read back: %1").arg(strerror(n < 0 ? errno : EIO)));
+				return;
+			}
+			pipe->push(QByteArray(buf.constData(), n));
+			pos += n;
+		}
+	}
+private:
+	struct Pending {
+		char *buf;
+		int len;
+		qint64 offset;
+	};
+	QMutex lock;
+	QWaitCondition wake;
+	QWaitCondition idle;
+	QQueue<Pending> queue;
+	BufferPool *pool;
+	QObject *notify;
+	ChunkQueue *pipe;
+	qint64 prefix;
+	qint64 written;
+	bool busy;
+	bool stopping;
+	int err;
+	int fd;
+};
+
+Downloader::Downloader(QObject *parent)
+	: QObject(parent)
+{
+	total = -1;
+	resumed = 0;
+	segmentCount = 4;
+	running = false;
+	stalled = false;
+	pool = NULL;
+	writer = NULL;
+	pipe = NULL;
+	memoryLimit = 32 * 1024 * 1024;
+	stateTimer.setInterval(1000);
+	connect(&stateTimer, SIGNAL(timeout()), SLOT(saveTimeout()));
+}
+
+Downloader::~Downloader()
+{
+	if (writer)
+		writer->stop();
+	delete writer;
+	delete pool;
+}
+
+void Downloader::setSegments(int count)
+{
+	segmentCount = qMax(1, count);
+}
+
+/*
+ * "<hex digest>  <name>" as written by sha1sum/sha256sum/md5sum, the
+ * digest length selects the algorithm.
+ */
+void Downloader::setChecksumUrl(const QUrl &url)
+{
+	checksumUrl = url;
+}
+
+/*
+ * Upper bound for download data in memory: half goes to the buffer pool,
+ * the rest is shared by the replies as their read buffers.
+ */
+void Downloader::setMemoryLimit(qint64 bytes)
+{
+	memoryLimit = qMax<qint64>(4 * poolBufferSize, bytes);
+}
+
+/*
+ * Hands the downloaded bytes in order to the next pipeline stage while
+ * they are written. Ordering needs a single stream, so the download is
+ * not split into segments. The queue is closed at the end or aborted
+ * when the download fails.
+ */
+void Downloader::setPipe(ChunkQueue *queue)
+{
+	pipe = queue;
+}
+
+int Downloader::start(const QUrl &url, const QString &target)
+{
+	if (running)
+		return -1;
+	this->url = url;
+	this->target = target;
+	error.clear();
+	expected.clear();
+	segments.clear();
+	total = -1;
+	resumed = 0;
+	running = true;
+
+	QNetworkReply *reply = manager.head(QNetworkRequest(url));
+	connect(reply, SIGNAL(finished()), SLOT(headFinished()));
+	return 0;
+}
+
+void Downloader::abort()
+{
+	if (!running)
+		return;
+	error = "aborted";
+	finish(-1);
+}
+
+bool Downloader::isRunning()
+{
+	return running;
+}
+
+qint64 Downloader::size()
+{
+	return total;
+}
+
+qint64 Downloader::received()
+{
+	qint64 sum = 0;
+	foreach (Segment s, segments)
+		sum += s.done;
+	return sum;
+}
+
+/* MB/s of this session, resumed bytes do not count */
+double Downloader::throughput()
+{
+	qint64 ms = elapsed.isValid() ? elapsed.elapsed() : 0;
+	if (ms <= 0)
+		return 0;
+	return ((received() - resumed) / (1024.0 * 1024.0)) / (ms / 1000.0);
+}
+
+/* high water mark of the process resident set in bytes */
+qint64 Downloader::peakRss()
+{
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage))
+		return -1;
+	return (qint64)usage.ru_maxrss * 1024;
+}
+
+QString Downloader::errorString()
+{
+	return error;
+}
+
+void Downloader::headFinished()
+{
+	QNetworkReply *reply = qobject_cast<QNetworkReply *>(sender());
+	reply->deleteLater();
+	if (!running)
+		return;
+	if (reply->error() != QNetworkReply::NoError) {
+		error = reply->errorString();
+		finish(-2);
+		return;
+	}
+	total = reply->header(QNetworkRequest::ContentLengthHeader).toLongLong();
+	bool ranges = reply->rawHeader("Accept-Ranges").toLower() == "bytes";
+	validator = reply->rawHeader("ETag");
+	if (validator.isEmpty())
+		validator = reply->rawHeader("Last-Modified");
+	if (total <= 0)
+		total = -1;
+
+	file.setFileName(target + ".part");
+	/* a piped resume is only usable as one ordered prefix */
+	if (!ranges || total < 0 || loadState() ||
+			(pipe && (segments.size() != 1 || segments[0].start != 0))) {
+		/* fresh start: one stream without ranges, otherwise N equal slices */
+		segments.clear();
+		int count = (ranges && total > 0 && !pipe) ? segmentCount : 1;
+		qint64 slice = total > 0 ? (total + count - 1) / count : -1;
+		for (int i = 0; i < count; i++) {
+			Segment s;
+			s.start = slice > 0 ? i * slice : 0;
+			s.end = slice > 0 ? qMin(total, (i + 1) * slice) - 1 : -1;
+			s.done = 0;
+			s.retries = 0;
+			s.replyDone = false;
+			s.reply = NULL;
+			if (slice > 0 && s.start > s.end)
+				continue;
+			segments << s;
+		}
+		QFile::remove(file.fileName());
+	}
+	if (!file.open(QIODevice::ReadWrite)) {
+		error = QString("open %1: %2").arg(file.fileName()).arg(file.errorString());
+		finish(-2);
+		return;
+	}
+	/* allocate up front, segments write at their own offsets */
+	if (total > 0 && file.size() != total)
+		file.resize(total);
+	delete pool;
+	pool = new BufferPool(qMax<qint64>(2, memoryLimit / 2 / poolBufferSize), poolBufferSize);
+	if (!pool->available()) {
+		error = "no memory for download buffers";
+		finish(-2);
+		return;
+	}
+	stalled = false;
+	resumed = received();
+	writer = new DiskWriter(file.handle(), pool, this, pipe, pipe ? resumed : 0);
+	writer->start();
+
+	if (resumed)
+		qDebug() << "download: resuming" << url.toString() << "at" << resumed << "of" << total;
+
+	if (checksumUrl.isValid()) {
+		QNetworkReply *sum = manager.get(QNetworkRequest(checksumUrl));
+		connect(sum, SIGNAL(finished()), SLOT(checksumFinished()));
+		return;
+	}
+	elapsed.start();
+	stateTimer.start();
+	for (int i = 0; i < segments.size(); i++)
+		startSegment(i);
+}
+
+void Downloader::checksumFinished()
+{
+	QNetworkReply *reply = qobject_cast<QNetworkReply *>(sender());
+	reply->deleteLater();
+	if (!running)
+		return;
+	if (reply->error() == QNetworkReply::NoError)
+		expected = QString(reply->readAll()).split(QRegExp("\\s+")).first().toLower();
+	else
+		qDebug() << "download: no checksum at" << checksumUrl.toString();
+
+	elapsed.start();
+	stateTimer.start();
+	for (int i = 0; i < segments.size(); i++)
+		startSegment(i);
+}
+
+void Downloader::startSegment(int index)
+{
+	if (!running)
+		return;
+	Segment &s = segments[index];
+	s.reply = NULL;
+	s.replyDone = false;
+	if (s.end >= 0 && s.start + s.done > s.end) {
+		segmentDone(-1);
+		return;
+	}
+	QNetworkRequest req(url);
+	if (s.end >= 0)
+		req.setRawHeader("Range", QString("bytes=%1-%2").arg(s.start + s.done).arg(s.end).toLatin1());
+	if (!validator.isEmpty() && s.end >= 0)
+		req.setRawHeader("If-Range", validator.toLatin1());
+	s.reply = manager.get(req);
+	s.reply->setProperty("segment", index);
+	/* what Qt keeps unread per reply, beyond that the socket is not read */
+	s.reply->setReadBufferSize(qMax<qint64>(64 * 1024, (memoryLimit - pool->capacity()) / segments.size()));
+	connect(s.reply, SIGNAL(readyRead()), SLOT(segmentReadyRead()));
+	connect(s.reply, SIGNAL(finished()), SLOT(segmentFinished()));
+}
+
+void Downloader::segmentReadyRead()
+{
+	QNetworkReply *reply = qobject_cast<QNetworkReply *>(sender());
+	if (!running || !reply)
+		return;
+	int index = reply->property("segment").toInt();
+	/* a server that ignores Range would hand us the file from byte 0 */
+	if (segments[index].end >= 0 && reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt() != 206) {
+		error = "server ignored the range request";
+		finish(-2);
+		return;
+	}
+	readSegment(index);
+}
+
+/*
+ * Moves what the reply has into pool buffers. Without a free buffer the
+ * rest stays in the reply until the writer gives one back.
+ */
+void Downloader::readSegment(int index)
+{
+	Segment &s = segments[index];
+	QNetworkReply *reply = s.reply;
+	if (!reply)
+		return;
+	qint64 before = s.done;
+	while (reply->bytesAvailable() > 0) {
+		char *buf = pool->tryAcquire();
+		if (!buf) {
+			stalled = true;
+			break;
+		}
+		qint64 n = reply->read(buf, pool->bufferSize());
+		if (n <= 0) {
+			pool->release(buf);
+			break;
+		}
+		writer->push(buf, n, s.start + s.done);
+		s.done += n;
+	}
+	if (writer->error()) {
+		error = QString("write %1: %2").arg(file.fileName()).arg(strerror(writer->error()));
+		finish(-2);
+		return;
+	}
+	if (s.done != before)
+		emit progress(received(), total);
+	if (s.replyDone && !reply->bytesAvailable())
+		segmentDone(index);
+}
+
+void Downloader::resumeReading()
+{
+	if (!running || !stalled)
+		return;
+	stalled = false;
+	for (int i = 0; i < segments.size() && running; i++)
+		readSegment(i);
+}
+
+void Downloader::segmentFinished()
+{
+	QNetworkReply *reply = qobject_cast<QNetworkReply *>(sender());
+	if (!running || !reply)
+		return;
+	int index = reply->property("segment").toInt();
+	Segment &s = segments[index];
+	if (reply->error() != QNetworkReply::NoError) {
+		/* unread data is dropped, the retry asks for it again */
+		reply->deleteLater();
+		s.reply = NULL;
+		if (++s.retries > maxRetries) {
+			error = reply->errorString();
+			finish(-2);
+			return;
+		}
+		qDebug() << "download: segment" << index << "retry" << s.retries << reply->errorString();
+		saveState();
+		startSegment(index);
+		return;
+	}
+	/* the tail may still wait for a free buffer */
+	s.replyDone = true;
+	readSegment(index);
+}
+
+/* index -1 only checks whether every segment is complete */
+void Downloader::segmentDone(int index)
+{
+	if (index >= 0) {
+		Segment &s = segments[index];
+		s.reply->deleteLater();
+		s.reply = NULL;
+		/* unknown size: the single stream ends the download */
+		if (s.end < 0)
+			s.end = s.done - 1;
+	}
+	foreach (Segment s, segments)
+		if (s.reply || s.start + s.done <= s.end)
+			return;
+	finish(verify());
+}
+
+int Downloader::verify()
+{
+	if (writer->drain()) {
+		error = QString("write %1: %2").arg(file.fileName()).arg(strerror(writer->error()));
+		return -2;
+	}
+	if (total > 0 && received() != total) {
+		error = QString("got %1 of %2 bytes").arg(received()).arg(total);
+		return -2;
+	}
+	if (expected.isEmpty())
+		return 0;
+
+	QCryptographicHash::Algorithm algo;
+	if (expected.size() == 32)
+		algo = QCryptographicHash::Md5;
+	else if (expected.size() == 40)
+		algo = QCryptographicHash::Sha1;
+	else
+		algo = QCryptographicHash::Sha256;
+	QCryptographicHash h(algo);
+	file.seek(0);
+	h.addData(&file);
+	if (QString(h.result().toHex()) != expected) {
+		error = "checksum mismatch";
+		/* the data is bad, do not resume from it */
+		file.close();
+		QFile::remove(file.fileName());
+		QFile::remove(target + ".part.json");
+		return -5;
+	}
+	return 0;
+}
+
+void Downloader::finish(int err)
+{
+	running = false;
+	stateTimer.stop();
+	for (int i = 0; i < segments.size(); i++) {
+		if (!segments[i].reply)
+			continue;
+		segments[i].reply->disconnect(this);
+		segments[i].reply->abort();
+		segments[i].reply->deleteLater();
+		segments[i].reply = NULL;
+	}
+	/* unblocks a writer waiting on a stalled pipe */
+	if (pipe && err)
+		pipe->abort(error);
+	if (writer) {
+		writer->stop();
+		delete writer;
+		writer = NULL;
+	}
+	if (file.isOpen())
+		fdatasync(file.handle());
+	if (pipe && !err)
+		pipe->close();
+	qDebug() << "download: peak rss" << peakRss() / 1024 << "KiB";
+	if (!err) {
+		file.close();
+		QFile::remove(target);
+		if (rename(QFile::encodeName(file.fileName()).constData(), QFile::encodeName(target).constData())) {
+			error = QString("rename %1").arg(file.fileName());
+			err = -2;
+		} else
+			QFile::remove(target + ".part.json");
+	} else if (err != -5) {
+		saveState();
+		file.close();
+	}
+	emit finished(err);
+}
+
+/* only valid for the same url, size and server validator */
+int Downloader::loadState()
+{
+	QFile f(target + ".part.json");
+	if (!f.open(QIODevice::ReadOnly) || !QFile::exists(file.fileName()))
+		return -1;
+	QJsonObject state = QJsonDocument::fromJson(f.readAll()).object();
+	if (state.value("url").toString() != url.toString() ||
+			state.value("size").toString().toLongLong() != total ||
+			state.value("validator").toString() != validator)
+		return -1;
+	segments.clear();
+	foreach (QJsonValue v, state.value("segments").toArray()) {
+		QJsonObject o = v.toObject();
+		Segment s;
+		s.start = o.value("start").toString().toLongLong();
+		s.end = o.value("end").toString().toLongLong();
+		s.done = o.value("done").toString().toLongLong();
+		s.retries = 0;
+		s.replyDone = false;
+		s.reply = NULL;
+		segments << s;
+	}
+	return segments.isEmpty() ? -1 : 0;
+}
+
+int Downloader::saveState()
+{
+	if (total < 0 || !file.isOpen())
+		return -1;
+	/*
+	 * never claim bytes that are not on disk yet. A piped writer may wait
+	 * for the extractor, so the ordered stream saves what it wrote instead
+	 * of draining.
+	 */
+	if (writer && !pipe)
+		writer->drain();
+	fdatasync(file.handle());
+
+	QJsonArray list;
+	foreach (Segment s, segments) {
+		QJsonObject o;
+		qint64 done = s.done;
+		if (writer && pipe)
+			done = qMin(s.done, writer->writtenEnd() - s.start);
+		o.insert("start", QString::number(s.start));
+		o.insert("end", QString::number(s.end));
+		o.insert("done", QString::number(done));
+		list << o;
+	}
+	QJsonObject state;
+	state.insert("url", url.toString());
+	state.insert("size", QString::number(total));
+	state.insert("validator", validator);
+	state.insert("segments", list);
+
+	QString name = target + ".part.json";
+	QFile f(name + ".tmp");
+	if (!f.open(QIODevice::WriteOnly | QIODevice::Truncate))
+		return -2;
+	f.write(QJsonDocument(state).toJson(QJsonDocument::Compact));
+	f.close();
+	return rename(QFile::encodeName(f.fileName()).constData(), QFile::encodeName(name).constData()) ? -2 : 0;
+}
+
+void Downloader::saveTimeout()
+{
+	saveState();
+}
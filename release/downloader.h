@@ -0,0 +1,98 @@
+#ifndef DOWNLOADER_H
+#define DOWNLOADER_H
+
+#include <QUrl>
+#include <QMap>
+#include <QFile>
+#include <QTimer>
+#include <QVector>
+#include <QElapsedTimer>
+#include <QNetworkReply>
+#include <QNetworkAccessManager>
+
+class BufferPool;
+class ChunkQueue;
+class DiskWriter;
+
+/*
+ * Release tarball download in parallel HTTP Range segments. Progress is
+ * kept in a <target>.part.json sidecar, so an interrupted download picks
+ * up where every segment stopped. Data goes to <target>.part and is
+ * renamed into place once the optional checksum matched.
+ *
+ * Memory stays flat whatever the release size: replies buffer at most
+ * their read buffer size, data is copied into a fixed buffer pool and a
+ * writer thread puts it on disk. When the pool runs dry reading stops and
+ * TCP flow control slows the server down.
+ */
+class Downloader : public QObject
+{
+	Q_OBJECT
+public:
+	Downloader(QObject *parent = 0);
+	~Downloader();
+	void setSegments(int count);
+	void setChecksumUrl(const QUrl &url);
+	void setMemoryLimit(qint64 bytes);
+	void setPipe(ChunkQueue *queue);
+	int start(const QUrl &url, const QString &target);
+	void abort();
+	bool isRunning();
+	qint64 size();
+	qint64 received();
+	double throughput();
+	QString errorString();
+	static qint64 peakRss();
+
+	static const int maxRetries = 3;
+	static const int poolBufferSize = 256 * 1024;
+signals:
+	void progress(qint64 received, qint64 total);
+	void finished(int err);
+protected:
+	struct Segment {
+		qint64 start;
+		qint64 end;		/* inclusive */
+		qint64 done;
+		int retries;
+		bool replyDone;
+		QNetworkReply *reply;
+	};
+	int loadState();
+	int saveState();
+	void startSegment(int index);
+	void readSegment(int index);
+	void segmentDone(int index);
+	void finish(int err);
+	int verify();
+protected slots:
+	void headFinished();
+	void segmentReadyRead();
+	void segmentFinished();
+	void checksumFinished();
+	void saveTimeout();
+	void resumeReading();
+private:
+	QNetworkAccessManager manager;
+	QUrl url;
+	QUrl checksumUrl;
+	QString target;
+	QString validator;
+	QFile file;
+	BufferPool *pool;
+	DiskWriter *writer;
+	ChunkQueue *pipe;
+	qint64 memoryLimit;
+	QVector<Segment> segments;
+	QTimer stateTimer;
+	QElapsedTimer elapsed;
+	qint64 total;
+	qint64 resumed;
+	int segmentCount;
+	bool running;
+	bool stalled;
+	QString expected;
+	QString error;
+};
+
+#endif // DOWNLOADER_H
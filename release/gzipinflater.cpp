@@ -0,0 +1,158 @@
+#include "gzipinflater.h"
+#include "chunkqueue.h"
+
+#include <QFile>
+
+#include <zlib.h>
+#include <string.h>
+
+GzipInflater::GzipInflater(const QString &file, ChunkQueue *output)
+	: hash(QCryptographicHash::Sha1)
+{
+	this->file = file;
+	input = NULL;
+	this->output = output;
+	source = NULL;
+	hashInput = false;
+}
+
+GzipInflater::GzipInflater(ChunkQueue *input, ChunkQueue *output)
+	: hash(QCryptographicHash::Sha1)
+{
+	this->input = input;
+	this->output = output;
+	source = NULL;
+	hashInput = false;
+}
+
+qint64 GzipInflater::bytesIn()
+{
+	return in.load();
+}
+
+qint64 GzipInflater::bytesOut()
+{
+	return out.load();
+}
+
+/* sha1 of the compressed input, for the release index */
+void GzipInflater::setHashInput(bool enable)
+{
+	hashInput = enable;
+}
+
+/* only valid once the thread finished */
+QByteArray GzipInflater::inputHash()
+{
+	if (!hashInput)
+		return QByteArray();
+	return hash.result();
+}
+
+/* compressed size when reading from a file, -1 for a stream */
+qint64 GzipInflater::inputSize()
+{
+	if (file.isEmpty())
+		return -1;
+	return QFile(file).size();
+}
+
+QByteArray GzipInflater::nextInput()
+{
+	QByteArray data;
+	if (input)
+		data = input->pop();
+	else
+		data = ((QFile *)source)->read(chunkSize);
+	in.fetchAndAddRelaxed(data.size());
+	if (hashInput)
+		hash.addData(data);
+	return data;
+}
+
+void GzipInflater::run()
+{
+	QFile f(file);
+	if (!input) {
+		if (!f.open(QIODevice::ReadOnly)) {
+			output->abort(QString("open %1: %2").arg(file).arg(f.errorString()));
+			return;
+		}
+		source = &f;
+	}
+	if (!inflateAll())
+		output->close();
+	if (input && output->isAborted())
+		input->abort(output->errorString());
+	source = NULL;
+}
+
+int GzipInflater::inflateAll()
+{
+	z_stream zs;
+	memset(&zs, 0, sizeof(zs));
+	/* 15 + 32: zlib or gzip header, detected automatically */
+	if (inflateInit2(&zs, 15 + 32) != Z_OK) {
+		output->abort("inflateInit failed");
+		return -1;
+	}
+
+	QByteArray data = nextInput();
+	bool gzip = data.size() >= 2 && (uchar)data.at(0) == 0x1f && (uchar)data.at(1) == 0x8b;
+	QByteArray buf(chunkSize, Qt::Uninitialized);
+	bool member = false;
+	int ret = Z_OK;
+	while (!data.isEmpty()) {
+		if (!gzip) {
+			out.fetchAndAddRelaxed(data.size());
+			if (!output->push(data))
+				break;
+			data = nextInput();
+			continue;
+		}
+		zs.next_in = (Bytef *)data.data();
+		zs.avail_in = data.size();
+		while (zs.avail_in > 0) {
+			zs.next_out = (Bytef *)buf.data();
+			zs.avail_out = buf.size();
+			ret = inflate(&zs, Z_NO_FLUSH);
+			/* garbage after the last member, gzip ignores it too */
+			if (ret == Z_DATA_ERROR && !member && out.load() > 0) {
+				zs.avail_in = 0;
+				break;
+			}
+			if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+				inflateEnd(&zs);
+				output->abort(QString("inflate: %1").arg(zs.msg ? zs.msg : "corrupt data"));
+				return -1;
+			}
+			int len = buf.size() - zs.avail_out;
+			if (len > 0) {
+				out.fetchAndAddRelaxed(len);
+				if (!output->push(QByteArray(buf.constData(), len))) {
+					inflateEnd(&zs);
+					return -1;
+				}
+			}
+			member = ret != Z_STREAM_END;
+			/* concatenated members, as written by pigz or cat a.gz b.gz */
+			if (ret == Z_STREAM_END)
+				inflateReset(&zs);
+			else if (ret == Z_BUF_ERROR && len == 0)
+				break;
+		}
+		data = nextInput();
+	}
+	inflateEnd(&zs);
+	if (input && input->isAborted()) {
+		output->abort(input->errorString());
+		return -1;
+	}
+	if (output->isAborted())
+		return -1;
+	if (gzip && member) {
+		output->abort("truncated gzip stream");
+		return -1;
+	}
+	return 0;
+}
@@ -0,0 +1,43 @@
+#ifndef GZIPINFLATER_H
+#define GZIPINFLATER_H
+
+#include <QThread>
+#include <QAtomicInteger>
+#include <QCryptographicHash>
+
+class ChunkQueue;
+
+/*
+ * Inflate stage of the release pipeline. Reads a .tar.gz either from a
+ * file or from an upstream queue and pushes plain tar data downstream.
+ * Input that is not gzip is passed through untouched, concatenated gzip
+ * members are handled.
+ */
+class GzipInflater : public QThread
+{
+public:
+	GzipInflater(const QString &file, ChunkQueue *output);
+	GzipInflater(ChunkQueue *input, ChunkQueue *output);
+	qint64 bytesIn();
+	qint64 bytesOut();
+	qint64 inputSize();
+	void setHashInput(bool enable);
+	QByteArray inputHash();
+
+	static const int chunkSize = 1024 * 1024;
+protected:
+	void run();
+	QByteArray nextInput();
+	int inflateAll();
+private:
+	QString file;
+	ChunkQueue *input;
+	ChunkQueue *output;
+	void *source;
+	bool hashInput;
+	QCryptographicHash hash;
+	QAtomicInteger<qint64> in;
+	QAtomicInteger<qint64> out;
+};
+
+#endif // GZIPINFLATER_H
@@ -0,0 +1,144 @@
+#include "releaseindex.h"
+
+#include <QDir>
+#include <QFile>
+#include <QDebug>
+#include <QDateTime>
+#include <QFileInfo>
+#include <QJsonDocument>
+#include <QCryptographicHash>
+
+#include <stdio.h>
+#include <unistd.h>
+
+const char *ReleaseIndex::fileName = "release_index.json";
+
+ReleaseIndex::ReleaseIndex(const QString &dir)
+{
+	this->dir = dir;
+	load();
+}
+
+int ReleaseIndex::load()
+{
+	QFile f(QDir(dir).filePath(fileName));
+	if (!f.open(QIODevice::ReadOnly))
+		return -1;
+	QJsonDocument doc = QJsonDocument::fromJson(f.readAll());
+	if (!doc.isObject())
+		return -2;
+	index = doc.object();
+	return 0;
+}
+
+int ReleaseIndex::save()
+{
+	QString name = QDir(dir).filePath(fileName);
+	QString tmpname = name + ".tmp";
+	QFile f(tmpname);
+	if (!f.open(QIODevice::WriteOnly | QIODevice::Truncate))
+		return -2;
+	f.write(QJsonDocument(index).toJson());
+	f.flush();
+	fsync(f.handle());
+	f.close();
+	if (rename(QFile::encodeName(tmpname).constData(), QFile::encodeName(name).constData()))
+		return -2;
+	return 0;
+}
+
+QJsonObject ReleaseIndex::tarballStat(const QString &tarball)
+{
+	QFileInfo info(QDir(dir).filePath(tarball));
+	QJsonObject stat;
+	if (!info.exists())
+		return stat;
+	stat.insert("size", QString::number(info.size()));
+	stat.insert("mtime", QString::number(info.lastModified().toMSecsSinceEpoch()));
+	return stat;
+}
+
+/*
+ * Entry of a release, or an empty object when the tarball changed since it
+ * was indexed or an extracted member is missing or has the wrong size.
+ * Only stat() is used here, verify() rehashes.
+ */
+QJsonObject ReleaseIndex::lookup(const QString &tarball)
+{
+	QJsonObject entry = index.value(tarball).toObject();
+	if (entry.isEmpty())
+		return QJsonObject();
+	QJsonObject stat = tarballStat(tarball);
+	if (stat.value("size") != entry.value("size") || stat.value("mtime") != entry.value("mtime"))
+		return QJsonObject();
+
+	QJsonObject members = entry.value("members").toObject();
+	foreach (QString name, members.keys()) {
+		QFileInfo info(QDir(dir).filePath(name));
+		qint64 size = members.value(name).toObject().value("size").toString().toLongLong();
+		if (!info.exists() || info.size() != size)
+			return QJsonObject();
+	}
+	return entry;
+}
+
+int ReleaseIndex::record(const QString &tarball, const QByteArray &sha1,
+						 const QMap<QString, TarExtractor::Member> &members,
+						 const QString &firmware, const QString &date)
+{
+	QJsonObject entry = tarballStat(tarball);
+	if (entry.isEmpty())
+		return -1;
+	entry.insert("sha1", QString(sha1.toHex()));
+	entry.insert("firmware_version", firmware);
+	entry.insert("date", date);
+
+	QJsonObject list;
+	QMap<QString, TarExtractor::Member>::const_iterator it;
+	for (it = members.constBegin(); it != members.constEnd(); ++it) {
+		QJsonObject m;
+		m.insert("size", QString::number(it.value().size));
+		m.insert("sha1", QString(it.value().sha1.toHex()));
+		list.insert(QDir::cleanPath(it.key()), m);
+	}
+	entry.insert("members", list);
+	index.insert(tarball, entry);
+	return save();
+}
+
+int ReleaseIndex::remove(const QString &tarball)
+{
+	index.remove(tarball);
+	return save();
+}
+
+/* full rehash of the extracted members, 0 when all of them match */
+int ReleaseIndex::verify(const QString &tarball)
+{
+	QJsonObject entry = lookup(tarball);
+	if (entry.isEmpty())
+		return -1;
+	QJsonObject members = entry.value("members").toObject();
+	foreach (QString name, members.keys()) {
+		QFile f(QDir(dir).filePath(name));
+		if (!f.open(QIODevice::ReadOnly))
+			return -1;
+		QCryptographicHash h(QCryptographicHash::Sha1);
+		h.addData(&f);
+		if (QString(h.result().toHex()) != members.value(name).toObject().value("sha1").toString()) {
+			qDebug() << "release index: hash mismatch" << name;
+			return -2;
+		}
+	}
+	return 0;
+}
+
+/* absolute path of <release>/<file> if the index knows it */
+QString ReleaseIndex::memberPath(const QString &tarball, const QString &file)
+{
+	QJsonObject entry = index.value(tarball).toObject();
+	QString member = QString("%1/%2").arg(tarball.split(".").first()).arg(file);
+	if (!entry.value("members").toObject().contains(member))
+		return QString();
+	return QDir(dir).filePath(member);
+}
@@ -0,0 +1,37 @@
+#ifndef RELEASEINDEX_H
+#define RELEASEINDEX_H
+
+#include <QMap>
+#include <QJsonObject>
+
+#include "tarextractor.h"
+
+/*
+ * Persistent record of every extracted release under folder.binaries:
+ * tarball size, mtime and sha1, the extracted members with their sizes
+ * and hashes, and the firmware version/date shown to the operator. A
+ * release is only trusted once it is in here.
+ */
+class ReleaseIndex
+{
+public:
+	ReleaseIndex(const QString &dir);
+	int load();
+	int save();
+	QJsonObject lookup(const QString &tarball);
+	int record(const QString &tarball, const QByteArray &sha1,
+			   const QMap<QString, TarExtractor::Member> &members,
+			   const QString &firmware, const QString &date);
+	int remove(const QString &tarball);
+	int verify(const QString &tarball);
+	QString memberPath(const QString &tarball, const QString &file);
+
+	static const char *fileName;
+protected:
+	QJsonObject tarballStat(const QString &tarball);
+private:
+	QString dir;
+	QJsonObject index;
+};
+
+#endif // RELEASEINDEX_H
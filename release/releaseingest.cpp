@@ -0,0 +1,144 @@
+#include "releaseingest.h"
+#include "downloader.h"
+#include "gzipinflater.h"
+
+#include <QDebug>
+#include <QThread>
+
+/* runs the tar stage, TarExtractor::extract() blocks until the end */
+class ExtractThread : public QThread
+{
+public:
+	ExtractThread(TarExtractor *tar, ChunkQueue *input)
+	{
+		this->tar = tar;
+		this->input = input;
+		err = 0;
+	}
+	int result()
+	{
+		return err;
+	}
+protected:
+	void run()
+	{
+		err = tar->extract(input);
+	}
+private:
+	TarExtractor *tar;
+	ChunkQueue *input;
+	int err;
+};
+
+ReleaseIngest::ReleaseIngest(const QString &destination, QObject *parent)
+	: QObject(parent),
+	  compressed(queueSize),
+	  plain(queueSize),
+	  tar(QString(), destination)
+{
+	loader = new Downloader(this);
+	loader->setPipe(&compressed);
+	inflater = new GzipInflater(&compressed, &plain);
+	inflater->setHashInput(true);
+	thread = new ExtractThread(&tar, &plain);
+	downloadErr = 0;
+	extractErr = 0;
+	downloading = false;
+	extracting = false;
+	connect(loader, SIGNAL(progress(qint64,qint64)), SIGNAL(progress(qint64,qint64)));
+	connect(loader, SIGNAL(finished(int)), SLOT(downloadFinished(int)));
+	connect(thread, SIGNAL(finished()), SLOT(extractFinished()));
+}
+
+ReleaseIngest::~ReleaseIngest()
+{
+	abort();
+	compressed.abort("destroyed");
+	inflater->wait();
+	thread->wait();
+	delete inflater;
+	delete thread;
+}
+
+/* for segment count and memory limit, the pipe forces a single stream */
+Downloader *ReleaseIngest::downloader()
+{
+	return loader;
+}
+
+/* the stages are single use, one ingest per release */
+int ReleaseIngest::start(const QUrl &url, const QString &target)
+{
+	if (downloading || extracting || inflater->isFinished())
+		return -1;
+	int err = loader->start(url, target);
+	if (err)
+		return err;
+	downloading = true;
+	extracting = true;
+	inflater->start();
+	thread->start();
+	return 0;
+}
+
+void ReleaseIngest::abort()
+{
+	if (loader->isRunning())
+		loader->abort();
+	plain.abort("aborted");
+}
+
+bool ReleaseIngest::isRunning()
+{
+	return downloading || extracting;
+}
+
+TarExtractor *ReleaseIngest::extractor()
+{
+	return &tar;
+}
+
+/* sha1 of the compressed tarball, hashed on its way to the inflater */
+QByteArray ReleaseIngest::archiveHash()
+{
+	return hash;
+}
+
+QString ReleaseIngest::errorString()
+{
+	return error;
+}
+
+void ReleaseIngest::downloadFinished(int err)
+{
+	downloading = false;
+	downloadErr = err;
+	if (err && error.isEmpty())
+		error = loader->errorString();
+	done();
+}
+
+void ReleaseIngest::extractFinished()
+{
+	extracting = false;
+	extractErr = thread->result();
+	if (extractErr) {
+		if (error.isEmpty())
+			error = tar.errorString();
+		/* nothing left to feed, stop the network side too */
+		if (loader->isRunning())
+			loader->abort();
+	}
+	done();
+}
+
+void ReleaseIngest::done()
+{
+	if (downloading || extracting)
+		return;
+	inflater->wait();
+	hash = inflater->inputHash();
+	int err = downloadErr ? downloadErr : extractErr;
+	qDebug() << "ingest: done" << err << "in" << inflater->bytesIn() << "out" << inflater->bytesOut();
+	emit finished(err);
+}
@@ -0,0 +1,58 @@
+#ifndef RELEASEINGEST_H
+#define RELEASEINGEST_H
+
+#include <QUrl>
+#include <QObject>
+
+#include "release/chunkqueue.h"
+#include "release/tarextractor.h"
+
+class Downloader;
+class GzipInflater;
+class ExtractThread;
+
+/*
+ * Download, inflate and untar of a release running at the same time:
+ * network bytes go to the tarball on disk and through bounded queues into
+ * the gzip and tar stages, so the release is extracted about when its
+ * last byte arrives. finished() comes once every stage is done.
+ */
+class ReleaseIngest : public QObject
+{
+	Q_OBJECT
+public:
+	ReleaseIngest(const QString &destination, QObject *parent = 0);
+	~ReleaseIngest();
+	Downloader *downloader();
+	int start(const QUrl &url, const QString &target);
+	void abort();
+	bool isRunning();
+	TarExtractor *extractor();
+	QByteArray archiveHash();
+	QString errorString();
+
+	static const qint64 queueSize = 16 * 1024 * 1024;
+signals:
+	void progress(qint64 received, qint64 total);
+	void finished(int err);
+protected:
+	void done();
+protected slots:
+	void downloadFinished(int err);
+	void extractFinished();
+private:
+	Downloader *loader;
+	ChunkQueue compressed;
+	ChunkQueue plain;
+	GzipInflater *inflater;
+	TarExtractor tar;
+	ExtractThread *thread;
+	QByteArray hash;
+	QString error;
+	int downloadErr;
+	int extractErr;
+	bool downloading;
+	bool extracting;
+};
+
+#endif // RELEASEINGEST_H
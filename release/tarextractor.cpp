@@ -0,0 +1,432 @@
+#include "tarextractor.h"
+#include "chunkqueue.h"
+#include "gzipinflater.h"
+#include "util/tracer.h"
+
+#include <QDir>
+#include <QFile>
+#include <QDebug>
+#include <QMutex>
+#include <QRunnable>
+#include <QFileInfo>
+#include <QCryptographicHash>
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/* small members are written off the parser thread */
+class WriteJob : public QRunnable
+{
+public:
+	WriteJob(TarExtractor *owner, const QString &path, const QByteArray &data, int mode)
+	{
+		this->owner = owner;
+		this->path = path;
+		this->data = data;
+		this->mode = mode;
+	}
+	void run()
+	{
+		QFile f(path);
+		if (!f.open(QIODevice::WriteOnly | QIODevice::Truncate) ||
+				f.write(data) != data.size()) {
+			owner->writeFailed(QString("write %1: %2").arg(path).arg(f.errorString()));
+			return;
+		}
+		f.close();
+		::chmod(QFile::encodeName(path).constData(), mode & 07777);
+	}
+private:
+	TarExtractor *owner;
+	QString path;
+	QByteArray data;
+	int mode;
+};
+
+static qint64 parseNumber(const char *field, int len)
+{
+	/* gnu base-256 for members over 8 GB */
+	if ((uchar)field[0] & 0x80) {
+		qint64 value = field[0] & 0x7f;
+		for (int i = 1; i < len; i++)
+			value = (value << 8) | (uchar)field[i];
+		return value;
+	}
+	qint64 value = 0;
+	for (int i = 0; i < len && field[i]; i++) {
+		if (field[i] == ' ')
+			continue;
+		if (field[i] < '0' || field[i] > '7')
+			break;
+		value = value * 8 + (field[i] - '0');
+	}
+	return value;
+}
+
+static QString parseString(const char *field, int len)
+{
+	return QString::fromUtf8(field, qstrnlen(field, len));
+}
+
+TarExtractor::TarExtractor(const QString &archive, const QString &destination, QObject *parent)
+	: QObject(parent)
+{
+	this->archive = archive;
+	this->destination = destination;
+	currentPos = 0;
+	consumed = 0;
+	total = 0;
+	extracted = 0;
+	inflater = NULL;
+}
+
+TarExtractor::~TarExtractor()
+{
+	writers.waitForDone();
+}
+
+int TarExtractor::extract()
+{
+	TRACE_SPAN("tar_extract");
+	ChunkQueue queue;
+	GzipInflater gz(archive, &queue);
+	inflater = &gz;
+	gz.setHashInput(true);
+	total = gz.inputSize();
+	gz.start();
+	int err = parse(&queue);
+	if (err)
+		queue.abort(error);
+	gz.wait();
+	inflater = NULL;
+	tarballHash = gz.inputHash();
+	writers.waitForDone();
+	if (!err && queue.isAborted())
+		err = setError(queue.errorString());
+	return err;
+}
+
+/* plain tar data coming from an earlier pipeline stage */
+int TarExtractor::extract(ChunkQueue *input)
+{
+	TRACE_SPAN("tar_extract_stream");
+	total = -1;
+	int err = parse(input);
+	if (err)
+		input->abort(error);
+	writers.waitForDone();
+	if (!err && input->isAborted())
+		err = setError(input->errorString());
+	return err;
+}
+
+QStringList TarExtractor::members()
+{
+	return list;
+}
+
+/* size and sha1 of every regular file, hashed while it was written */
+QMap<QString, TarExtractor::Member> TarExtractor::memberInfo()
+{
+	return info;
+}
+
+/* sha1 of the compressed archive, empty when fed from a queue */
+QByteArray TarExtractor::archiveHash()
+{
+	return tarballHash;
+}
+
+qint64 TarExtractor::bytesExtracted()
+{
+	return extracted;
+}
+
+QString TarExtractor::errorString()
+{
+	return error;
+}
+
+int TarExtractor::read(ChunkQueue *queue, char *data, qint64 len)
+{
+	while (len > 0) {
+		if (currentPos >= current.size()) {
+			current = queue->pop();
+			currentPos = 0;
+			if (current.isEmpty())
+				return -1;
+		}
+		int n = qMin<qint64>(len, current.size() - currentPos);
+		memcpy(data, current.constData() + currentPos, n);
+		currentPos += n;
+		data += n;
+		len -= n;
+		consumed += n;
+	}
+	return 0;
+}
+
+int TarExtractor::skip(ChunkQueue *queue, qint64 len)
+{
+	char buf[blockSize];
+	while (len > 0) {
+		int n = qMin<qint64>(len, sizeof(buf));
+		if (read(queue, buf, n))
+			return -1;
+		len -= n;
+	}
+	return 0;
+}
+
+static qint64 padded(qint64 size)
+{
+	return (size + TarExtractor::blockSize - 1) / TarExtractor::blockSize * TarExtractor::blockSize;
+}
+
+int TarExtractor::parse(ChunkQueue *queue)
+{
+	writeLock.lock();
+	writeError.clear();
+	writeLock.unlock();
+	list.clear();
+	info.clear();
+	queued.clear();
+	QDir().mkpath(destination);
+	realDestination = QFileInfo(destination).canonicalFilePath();
+	if (realDestination.isEmpty())
+		return setError(QString("mkdir %1").arg(destination));
+
+	QString longName;
+	QString longLink;
+	qint64 paxSize = -1;
+	char header[blockSize];
+	while (true) {
+		if (read(queue, header, blockSize))
+			return setError(queue->isAborted() ? queue->errorString() : "unexpected end of archive");
+
+		bool zero = true;
+		for (int i = 0; i < blockSize && zero; i++)
+			zero = !header[i];
+		if (zero)
+			break;
+
+		unsigned int sum = 0;
+		for (int i = 0; i < blockSize; i++)
+			sum += (i >= 148 && i < 156) ? ' ' : (uchar)header[i];
+		if (sum != parseNumber(header + 148, 8))
+			return setError("tar header checksum mismatch");
+
+		char type = header[156];
+		qint64 size = parseNumber(header + 124, 12);
+		if (paxSize >= 0)
+			size = paxSize;
+		int mode = parseNumber(header + 100, 8);
+
+		/* gnu long names and pax records describe the next member */
+		if (type == 'L' || type == 'K' || type == 'x') {
+			QByteArray data(padded(size), Qt::Uninitialized);
+			if (read(queue, data.data(), data.size()))
+				return setError("unexpected end of archive");
+			data.truncate(size);
+			if (type == 'L')
+				longName = QString::fromUtf8(data.constData(), qstrnlen(data.constData(), data.size()));
+			else if (type == 'K')
+				longLink = QString::fromUtf8(data.constData(), qstrnlen(data.constData(), data.size()));
+			else {
+				int pos = 0;
+				while (pos < data.size()) {
+					int space = data.indexOf(' ', pos);
+					int len = data.mid(pos, space - pos).toInt();
+					if (space < 0 || len <= 0)
+						break;
+					QByteArray record = data.mid(space + 1, len - (space - pos) - 2);
+					if (record.startsWith("path="))
+						longName = QString::fromUtf8(record.mid(5));
+					else if (record.startsWith("linkpath="))
+						longLink = QString::fromUtf8(record.mid(9));
+					else if (record.startsWith("size="))
+						paxSize = record.mid(5).toLongLong();
+					pos += len;
+				}
+			}
+			continue;
+		}
+
+		QString name = longName;
+		if (name.isEmpty()) {
+			name = parseString(header, 100);
+			if (!memcmp(header + 257, "ustar", 5) && header[345])
+				name = parseString(header + 345, 155) + "/" + name;
+		}
+		QString link = longLink.isEmpty() ? parseString(header + 157, 100) : longLink;
+		longName.clear();
+		longLink.clear();
+		paxSize = -1;
+
+		int err = extractMember(queue, name, type, mode, size, link);
+		if (err)
+			return err;
+		/* compressed bytes when reading a file, tar bytes otherwise */
+		emit progress(inflater ? inflater->bytesIn() : consumed, total);
+	}
+
+	/* let the inflater finish instead of blocking on a full queue */
+	while (!queue->pop().isEmpty())
+		;
+	writers.waitForDone();
+	QMutexLocker locker(&writeLock);
+	if (!writeError.isEmpty())
+		return setError(writeError);
+	return 0;
+}
+
+/* members must stay below the destination */
+QString TarExtractor::safePath(const QString &name)
+{
+	QString clean = QDir::cleanPath(name);
+	while (clean.startsWith("./"))
+		clean.remove(0, 2);
+	if (clean.isEmpty() || clean == "." || clean.startsWith("/") ||
+			clean == ".." || clean.startsWith("../"))
+		return QString();
+	return QDir(destination).filePath(clean);
+}
+
+/*
+ * The name is clean, but a directory on the way may be a symlink an
+ * earlier member made: the deepest existing parent has to resolve below
+ * the destination too.
+ */
+bool TarExtractor::insideDestination(const QString &path)
+{
+	QFileInfo parent(QFileInfo(path).path());
+	while (!parent.exists() && parent.filePath() != destination)
+		parent = QFileInfo(parent.path());
+	QString real = parent.canonicalFilePath();
+	return real == realDestination || real.startsWith(realDestination + "/");
+}
+
+/* writes to one path happen in archive order */
+void TarExtractor::waitForWrite(const QString &path)
+{
+	if (!queued.contains(path))
+		return;
+	writers.waitForDone();
+	queued.clear();
+}
+
+int TarExtractor::extractMember(ChunkQueue *queue, const QString &name, char type, int mode,
+								qint64 size, const QString &link)
+{
+	QString path = safePath(name);
+	if (path.isEmpty() || !insideDestination(path)) {
+		qDebug() << "tar: skipping" << name;
+		return skip(queue, padded(size)) ? setError("unexpected end of archive") : 0;
+	}
+	QByteArray cpath = QFile::encodeName(path);
+	waitForWrite(path);
+
+	if (type == '5') {
+		if (!QDir().mkpath(path))
+			return setError(QString("mkdir %1").arg(path));
+		::chmod(cpath.constData(), mode & 07777);
+		list << name;
+		return skip(queue, padded(size)) ? setError("unexpected end of archive") : 0;
+	}
+
+	QDir().mkpath(QFileInfo(path).path());
+	if (type == '2' || type == '1') {
+		int ret;
+		if (type == '2') {
+			/* a link may only point at something inside the destination */
+			QString target = QDir::cleanPath(QFileInfo(name).path() + "/" + link);
+			while (target.startsWith("./"))
+				target.remove(0, 2);
+			if (link.isEmpty() || link.startsWith("/") || target == ".." || target.startsWith("../")) {
+				qDebug() << "tar: skipping" << name << "->" << link;
+				return skip(queue, padded(size)) ? setError("unexpected end of archive") : 0;
+			}
+			::unlink(cpath.constData());
+			ret = ::symlink(QFile::encodeName(link).constData(), cpath.constData());
+		} else {
+			QString target = safePath(link);
+			if (target.isEmpty() || !insideDestination(target)) {
+				qDebug() << "tar: skipping" << name << "=>" << link;
+				return skip(queue, padded(size)) ? setError("unexpected end of archive") : 0;
+			}
+			/* the target may still be in the pool */
+			writers.waitForDone();
+			queued.clear();
+			::unlink(cpath.constData());
+			ret = ::link(QFile::encodeName(target).constData(), cpath.constData());
+		}
+		if (ret)
+			return setError(QString("link %1: %2").arg(path).arg(strerror(errno)));
+		list << name;
+		return skip(queue, padded(size)) ? setError("unexpected end of archive") : 0;
+	}
+
+	if (type != '0' && type != '\0' && type != '7') {
+		/* devices, fifos: the release never carries them */
+		return skip(queue, padded(size)) ? setError("unexpected end of archive") : 0;
+	}
+
+	/* replaced, never written through: an old member of this name may be a link */
+	::unlink(cpath.constData());
+	Member m;
+	m.size = size;
+	if (size < smallFile) {
+		QByteArray data(size, Qt::Uninitialized);
+		if (read(queue, data.data(), size) || skip(queue, padded(size) - size))
+			return setError("unexpected end of archive");
+		m.sha1 = QCryptographicHash::hash(data, QCryptographicHash::Sha1);
+		queued.insert(path);
+		writers.start(new WriteJob(this, path, data, mode));
+	} else {
+		QCryptographicHash hash(QCryptographicHash::Sha1);
+		QFile f(path);
+		if (!f.open(QIODevice::WriteOnly | QIODevice::Truncate))
+			return setError(QString("open %1: %2").arg(path).arg(f.errorString()));
+		qint64 left = size;
+		while (left > 0) {
+			if (currentPos >= current.size()) {
+				current = queue->pop();
+				currentPos = 0;
+				if (current.isEmpty())
+					return setError("unexpected end of archive");
+			}
+			int n = qMin<qint64>(left, current.size() - currentPos);
+			if (f.write(current.constData() + currentPos, n) != n)
+				return setError(QString("write %1: %2").arg(path).arg(f.errorString()));
+			hash.addData(current.constData() + currentPos, n);
+			currentPos += n;
+			consumed += n;
+			left -= n;
+		}
+		f.close();
+		::chmod(cpath.constData(), mode & 07777);
+		if (skip(queue, padded(size) - size))
+			return setError("unexpected end of archive");
+		m.sha1 = hash.result();
+	}
+	extracted += size;
+	list << name;
+	info.insert(name, m);
+	return 0;
+}
+
+void TarExtractor::writeFailed(const QString &err)
+{
+	QMutexLocker locker(&writeLock);
+	if (writeError.isEmpty())
+		writeError = err;
+}
+
+int TarExtractor::setError(const QString &err)
+{
+	error = err;
+	qDebug() << "TarExtractor:" << err;
+	return -2;
+}
@@ -0,0 +1,74 @@
+#ifndef TAREXTRACTOR_H
+#define TAREXTRACTOR_H
+
+#include <QSet>
+#include <QMap>
+#include <QMutex>
+#include <QObject>
+#include <QStringList>
+#include <QThreadPool>
+
+class ChunkQueue;
+class GzipInflater;
+
+/*
+ * In process replacement for "tar xf". Inflating runs on its own thread
+ * and feeds the tar parser through a bounded queue; small members are
+ * written by a thread pool, big ones are streamed to disk by the parser
+ * so memory stays flat.
+ */
+class TarExtractor : public QObject
+{
+	Q_OBJECT
+public:
+	struct Member {
+		qint64 size;
+		QByteArray sha1;
+	};
+
+	TarExtractor(const QString &archive, const QString &destination, QObject *parent = 0);
+	~TarExtractor();
+	int extract();
+	int extract(ChunkQueue *input);
+	QStringList members();
+	QMap<QString, Member> memberInfo();
+	QByteArray archiveHash();
+	qint64 bytesExtracted();
+	QString errorString();
+	void writeFailed(const QString &err);
+
+	static const int blockSize = 512;
+	static const int smallFile = 1024 * 1024;
+signals:
+	void progress(qint64 done, qint64 total);
+protected:
+	int parse(ChunkQueue *queue);
+	int read(ChunkQueue *queue, char *data, qint64 len);
+	int skip(ChunkQueue *queue, qint64 len);
+	int extractMember(ChunkQueue *queue, const QString &name, char type, int mode,
+					  qint64 size, const QString &link);
+	QString safePath(const QString &name);
+	bool insideDestination(const QString &path);
+	void waitForWrite(const QString &path);
+	int setError(const QString &err);
+private:
+	QString archive;
+	QString destination;
+	QStringList list;
+	QMap<QString, Member> info;
+	QByteArray tarballHash;
+	QByteArray current;
+	int currentPos;
+	qint64 consumed;
+	qint64 total;
+	qint64 extracted;
+	QString error;
+	GzipInflater *inflater;
+	QThreadPool writers;
+	QSet<QString> queued;	/* paths with a WriteJob that may not have run yet */
+	QString realDestination;
+	QMutex writeLock;
+	QString writeError;
+};
+
+#endif // TAREXTRACTOR_H
@@ -0,0 +1,173 @@
+#include "ubootscript.h"
+#include "util/tracer.h"
+
+#include <QDir>
+#include <QFile>
+#include <QDebug>
+#include <QDateTime>
+#include <QFileInfo>
+#include <QJsonDocument>
+#include <QCryptographicHash>
+
+#include <zlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#define CACHE_FILE ".scr_cache.json"
+
+/* image header values, see u-boot include/image.h */
+#define IH_OS_LINUX		5
+#define IH_ARCH_ARM		2
+#define IH_TYPE_SCRIPT	6
+#define IH_COMP_NONE	0
+
+static void put32(uchar *p, quint32 v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+static quint32 get32(const uchar *p)
+{
+	return ((quint32)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+UbootScript::UbootScript(const QString &dir)
+{
+	this->dir = dir;
+	loadCache();
+}
+
+/* boot_zero_sd.txt -> boot_zero_sd.scr, the same rename the shell flow did */
+QString UbootScript::scriptName(const QString &txt)
+{
+	return QString(txt).replace("txt", "scr");
+}
+
+QByteArray UbootScript::image(const QByteArray &script, quint32 time, const QString &name)
+{
+	/* multi-file payload: length table terminated by 0, then the data */
+	QByteArray data(8, 0);
+	put32((uchar *)data.data(), script.size());
+	data.append(script);
+
+	QByteArray img(headerSize, 0);
+	uchar *h = (uchar *)img.data();
+	put32(h, magic);
+	put32(h + 8, time);
+	put32(h + 12, data.size());
+	put32(h + 16, 0);		/* load address */
+	put32(h + 20, 0);		/* entry point */
+	put32(h + 24, crc32(0, (const Bytef *)data.constData(), data.size()));
+	h[28] = IH_OS_LINUX;
+	h[29] = IH_ARCH_ARM;
+	h[30] = IH_TYPE_SCRIPT;
+	h[31] = IH_COMP_NONE;
+	QByteArray n = name.toLatin1().left(32);
+	memcpy(h + 32, n.constData(), n.size());
+	put32(h + 4, crc32(0, h, headerSize));
+	img.append(data);
+	return img;
+}
+
+bool UbootScript::isValid(const QByteArray &image)
+{
+	if (image.size() < headerSize)
+		return false;
+	QByteArray header = image.left(headerSize);
+	uchar *h = (uchar *)header.data();
+	if (get32(h) != magic || h[30] != IH_TYPE_SCRIPT)
+		return false;
+	quint32 hcrc = get32(h + 4);
+	put32(h + 4, 0);
+	if (crc32(0, h, headerSize) != hcrc)
+		return false;
+	quint32 size = get32(h + 12);
+	if ((quint32)image.size() - headerSize != size)
+		return false;
+	return crc32(0, (const Bytef *)image.constData() + headerSize, size) == get32(h + 24);
+}
+
+int UbootScript::loadCache()
+{
+	QFile f(QDir(dir).filePath(CACHE_FILE));
+	if (!f.open(QIODevice::ReadOnly))
+		return -1;
+	cache = QJsonDocument::fromJson(f.readAll()).object();
+	return 0;
+}
+
+int UbootScript::saveCache()
+{
+	QString name = QDir(dir).filePath(CACHE_FILE);
+	QFile f(name + ".tmp");
+	if (!f.open(QIODevice::WriteOnly | QIODevice::Truncate))
+		return -2;
+	f.write(QJsonDocument(cache).toJson());
+	f.close();
+	if (rename(QFile::encodeName(f.fileName()).constData(), QFile::encodeName(name).constData()))
+		return -2;
+	return 0;
+}
+
+/*
+ * Compiles <dir>/<txt> into its .scr unless the cache says the same
+ * source already produced the .scr on disk.
+ */
+int UbootScript::compile(const QString &txt)
+{
+	TRACE_SPAN("uboot_compile");
+	QFile src(QDir(dir).filePath(txt));
+	if (!src.open(QIODevice::ReadOnly))
+		return setError(QString("open %1: %2").arg(src.fileName()).arg(src.errorString()));
+	QByteArray script = src.readAll();
+	src.close();
+
+	QString scr = scriptName(txt);
+	QString hash = QCryptographicHash::hash(script, QCryptographicHash::Sha1).toHex();
+	QFileInfo out(QDir(dir).filePath(scr));
+	QJsonObject entry = cache.value(txt).toObject();
+	if (entry.value("sha1").toString() == hash && out.exists() &&
+			QString::number(out.size()) == entry.value("size").toString())
+		return 0;
+
+	QByteArray img = image(script, QDateTime::currentDateTime().toTime_t());
+	QString tmpname = out.filePath() + ".tmp";
+	QFile f(tmpname);
+	if (!f.open(QIODevice::WriteOnly | QIODevice::Truncate) || f.write(img) != img.size())
+		return setError(QString("write %1: %2").arg(tmpname).arg(f.errorString()));
+	f.close();
+	if (rename(QFile::encodeName(tmpname).constData(), QFile::encodeName(out.filePath()).constData()))
+		return setError(QString("rename %1").arg(tmpname));
+
+	entry.insert("sha1", hash);
+	entry.insert("size", QString::number(img.size()));
+	cache.insert(txt, entry);
+	if (saveCache())
+		qDebug() << "UbootScript: cache not saved";
+	return 0;
+}
+
+int UbootScript::compileAll(const QStringList &txts)
+{
+	int err = 0;
+	foreach (QString txt, txts) {
+		if (compile(txt))
+			err = -1;
+	}
+	return err;
+}
+
+QString UbootScript::errorString()
+{
+	return error;
+}
+
+int UbootScript::setError(const QString &err)
+{
+	error = err;
+	qDebug() << "UbootScript:" << err;
+	return -2;
+}
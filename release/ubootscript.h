@@ -0,0 +1,39 @@
+#ifndef UBOOTSCRIPT_H
+#define UBOOTSCRIPT_H
+
+#include <QMap>
+#include <QJsonObject>
+#include <QStringList>
+
+/*
+ * Builds u-boot script images (.scr) in process, byte for byte what
+ * "mkimage -A arm -O linux -T script -d x.txt x.scr" writes: a legacy
+ * 64 byte image header followed by a one entry multi-file table and the
+ * script text. Compiled scripts are remembered by the sha1 of their
+ * source, so an unchanged .txt is never rebuilt.
+ */
+class UbootScript
+{
+public:
+	UbootScript(const QString &dir);
+	int compile(const QString &txt);
+	int compileAll(const QStringList &txts);
+	QString errorString();
+
+	static QString scriptName(const QString &txt);
+	static QByteArray image(const QByteArray &script, quint32 time, const QString &name = QString());
+	static bool isValid(const QByteArray &image);
+
+	static const quint32 magic = 0x27051956;
+	static const int headerSize = 64;
+protected:
+	int loadCache();
+	int saveCache();
+	int setError(const QString &err);
+private:
+	QString dir;
+	QJsonObject cache;
+	QString error;
+};
+
+#endif // UBOOTSCRIPT_H
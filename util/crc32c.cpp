@@ -0,0 +1,87 @@
+#include "crc32c.h"
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#define HAVE_SSE42_CRC
+#endif
+
+static quint32 table[8][256];
+
+static bool initTable()
+{
+	for (int i = 0; i < 256; i++) {
+		quint32 crc = i;
+		for (int j = 0; j < 8; j++)
+			crc = (crc >> 1) ^ (0x82f63b78 & (0 - (crc & 1)));
+		table[0][i] = crc;
+	}
+	for (int i = 0; i < 256; i++)
+		for (int t = 1; t < 8; t++)
+			table[t][i] = (table[t - 1][i] >> 8) ^ table[0][table[t - 1][i] & 0xff];
+	return true;
+}
+
+/* built before main(), no locking needed in the workers */
+static const bool tableReady = initTable();
+
+static quint32 crc32cTable(quint32 crc, const uchar *p, qint64 len)
+{
+	Q_UNUSED(tableReady);
+	while (len && ((quintptr)p & 7)) {
+		crc = (crc >> 8) ^ table[0][(crc ^ *p++) & 0xff];
+		len--;
+	}
+	while (len >= 8) {
+		quint64 v;
+		memcpy(&v, p, 8);
+		v ^= crc;
+		crc = table[7][v & 0xff] ^ table[6][(v >> 8) & 0xff] ^
+				table[5][(v >> 16) & 0xff] ^ table[4][(v >> 24) & 0xff] ^
+				table[3][(v >> 32) & 0xff] ^ table[2][(v >> 40) & 0xff] ^
+				table[1][(v >> 48) & 0xff] ^ table[0][v >> 56];
+		p += 8;
+		len -= 8;
+	}
+	while (len--)
+		crc = (crc >> 8) ^ table[0][(crc ^ *p++) & 0xff];
+	return crc;
+}
+
+#ifdef HAVE_SSE42_CRC
+__attribute__((target("sse4.2")))
+static quint32 crc32cHw(quint32 crc, const uchar *p, qint64 len)
+{
+	while (len && ((quintptr)p & 7)) {
+		crc = _mm_crc32_u8(crc, *p++);
+		len--;
+	}
+#ifdef __x86_64__
+	quint64 c = crc;
+	while (len >= 8) {
+		quint64 v;
+		memcpy(&v, p, 8);
+		c = _mm_crc32_u64(c, v);
+		p += 8;
+		len -= 8;
+	}
+	crc = c;
+#endif
+	while (len--)
+		crc = _mm_crc32_u8(crc, *p++);
+	return crc;
+}
+#endif
+
+quint32 crc32c(quint32 crc, const void *data, qint64 len)
+{
+	const uchar *p = (const uchar *)data;
+	crc = ~crc;
+#ifdef HAVE_SSE42_CRC
+	static const bool hw = __builtin_cpu_supports("sse4.2");
+	if (hw)
+		return ~crc32cHw(crc, p, len);
+#endif
+	return ~crc32cTable(crc, p, len);
+}
@@ -0,0 +1,13 @@
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <QtGlobal>
+
+/*
+ * CRC32C (Castagnoli). Uses the SSE4.2 crc32 instruction when the cpu has
+ * it, slice-by-8 tables otherwise. Pass the previous result to continue a
+ * running checksum, 0 to start one.
+ */
+quint32 crc32c(quint32 crc, const void *data, qint64 len);
+
+#endif // CRC32C_H
@@ -0,0 +1,216 @@
+#include "logger.h"
+
+#include <QFile>
+#include <QMutex>
+#include <QThread>
+#include <QDateTime>
+#include <QAtomicPointer>
+#include <QAtomicInteger>
+#include <QCoreApplication>
+
+struct LogEntry {
+	QAtomicPointer<LogEntry> next;
+	qint64 time;
+	QString device;
+	QString recipe;
+	QString message;
+	QVariantMap fields;
+};
+
+/*
+ * Multi producer single consumer list: producers swap themselves in as
+ * the new head and link the old one, the writer walks from the tail.
+ * The entry the tail points at has already been written.
+ */
+static LogEntry stub;
+static QAtomicPointer<LogEntry> head(&stub);
+static LogEntry *tail = &stub;
+static QAtomicInt pending;
+static QAtomicInteger<qint64> droppedLines;
+
+static thread_local QString contextDevice;
+static thread_local QString contextRecipe;
+
+static QMutex configLock;
+static QString logPath;
+static qint64 rotateBytes = 16 * 1024 * 1024;
+static int rotateKeep = 4;
+
+class LogWriter : public QThread
+{
+public:
+	LogWriter() : size(0), reported(0) {}
+protected:
+	void run();
+	void write(const LogEntry *e);
+	void rotate();
+	QString format(const LogEntry *e);
+private:
+	QFile file;
+	qint64 size;
+	qint64 reported;
+};
+
+static QAtomicPointer<LogWriter> writer;
+
+static void startWriter()
+{
+	if (writer.load())
+		return;
+	LogWriter *w = new LogWriter;
+	if (!writer.testAndSetOrdered(NULL, w)) {
+		delete w;
+		return;
+	}
+	w->start(QThread::LowPriority);
+	/* whatever is still queued when the application object goes away */
+	if (QCoreApplication::instance())
+		qAddPostRoutine(Logger::flush);
+}
+
+void Logger::setPath(const QString &path)
+{
+	QMutexLocker locker(&configLock);
+	logPath = path;
+}
+
+void Logger::setRotation(qint64 maxBytes, int keep)
+{
+	QMutexLocker locker(&configLock);
+	if (maxBytes > 0)
+		rotateBytes = maxBytes;
+	if (keep >= 0)
+		rotateKeep = keep;
+}
+
+/* tags every line this thread logs from now on */
+void Logger::setContext(const QString &device, const QString &recipe)
+{
+	contextDevice = device;
+	contextRecipe = recipe;
+}
+
+/* never blocks, a full queue drops the line and counts it */
+void Logger::log(const QString &message, const QVariantMap &fields)
+{
+	if (pending.fetchAndAddRelaxed(1) >= maxPending) {
+		pending.fetchAndAddRelaxed(-1);
+		droppedLines.fetchAndAddRelaxed(1);
+		return;
+	}
+	LogEntry *e = new LogEntry;
+	e->time = QDateTime::currentMSecsSinceEpoch();
+	e->device = contextDevice;
+	e->recipe = contextRecipe;
+	e->message = message;
+	e->fields = fields;
+	LogEntry *prev = head.fetchAndStoreOrdered(e);
+	prev->next.storeRelease(e);
+	startWriter();
+}
+
+/* waits until every line logged so far is on disk */
+void Logger::flush()
+{
+	if (!writer.load())
+		return;
+	while (pending.load() > 0)
+		QThread::msleep(5);
+}
+
+qint64 Logger::dropped()
+{
+	return droppedLines.load();
+}
+
+void LogWriter::run()
+{
+	int written = 0;
+	while (true) {
+		LogEntry *next = tail->next.loadAcquire();
+		/* lines only count as done once they left the file buffer */
+		if (!next || written == 256) {
+			if (file.isOpen())
+				file.flush();
+			pending.fetchAndAddRelaxed(-written);
+			written = 0;
+		}
+		if (!next) {
+			QThread::msleep(20);
+			continue;
+		}
+		write(next);
+		if (tail != &stub)
+			delete tail;
+		tail = next;
+		next->message.clear();
+		next->fields.clear();
+		written++;
+	}
+}
+
+QString LogWriter::format(const LogEntry *e)
+{
+	QString line = QDateTime::fromMSecsSinceEpoch(e->time).toString("yyyy-MM-dd hh:mm:ss.zzz");
+	line += QString(" [%1]").arg(e->device.isEmpty() ? "-" : e->device);
+	if (!e->recipe.isEmpty())
+		line += QString(" [%1]").arg(e->recipe);
+	line += " " + e->message;
+	QVariantMap::const_iterator i;
+	for (i = e->fields.constBegin(); i != e->fields.constEnd(); ++i)
+		line += QString(" %1=%2").arg(i.key()).arg(i.value().toString());
+	return line + "\n";
+}
+
+void LogWriter::write(const LogEntry *e)
+{
+	configLock.lock();
+	QString path = logPath;
+	qint64 limit = rotateBytes;
+	configLock.unlock();
+	if (path.isEmpty())
+		return;
+	if (file.fileName() != path) {
+		file.close();
+		file.setFileName(path);
+	}
+	if (!file.isOpen()) {
+		if (!file.open(QIODevice::WriteOnly | QIODevice::Append))
+			return;
+		size = file.size();
+	}
+
+	QByteArray data;
+	qint64 lost = droppedLines.load();
+	if (lost != reported) {
+		data = QString("%1 [-] logger: %2 lines dropped\n")
+				.arg(QDateTime::currentDateTime().toString("yyyy-MM-dd hh:mm:ss.zzz"))
+				.arg(lost - reported).toUtf8();
+		reported = lost;
+	}
+	data += format(e).toUtf8();
+	if (size && size + data.size() > limit)
+		rotate();
+	if (file.write(data) > 0)
+		size += data.size();
+}
+
+/* log -> log.1 -> ... -> log.<keep>, the oldest one is removed */
+void LogWriter::rotate()
+{
+	configLock.lock();
+	int keep = rotateKeep;
+	configLock.unlock();
+	QString path = file.fileName();
+	file.close();
+	if (keep > 0) {
+		QFile::remove(QString("%1.%2").arg(path).arg(keep));
+		for (int i = keep - 1; i > 0; i--)
+			QFile::rename(QString("%1.%2").arg(path).arg(i), QString("%1.%2").arg(path).arg(i + 1));
+		QFile::rename(path, path + ".1");
+	} else {
+		QFile::remove(path);
+	}
+	size = 0;
+	file.open(QIODevice::WriteOnly | QIODevice::Append);
+}
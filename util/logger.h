@@ -0,0 +1,27 @@
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#include <QString>
+#include <QVariantMap>
+
+/*
+ * Process wide log file written by a background thread. log() only
+ * pushes the line onto a lock free queue, so card jobs never wait for the
+ * disk or for each other. Lines carry a timestamp, the device and recipe
+ * of the calling thread and optional key=value fields. The file is rotated
+ * to <path>.1 ... <path>.<keep> once it grows past the size limit.
+ */
+class Logger
+{
+public:
+	static void setPath(const QString &path);
+	static void setRotation(qint64 maxBytes, int keep);
+	static void setContext(const QString &device, const QString &recipe);
+	static void log(const QString &message, const QVariantMap &fields = QVariantMap());
+	static void flush();
+	static qint64 dropped();
+
+	static const int maxPending = 65536;
+};
+
+#endif // LOGGER_H
@@ -0,0 +1,169 @@
+#include "tracer.h"
+
+#include <QHash>
+#include <QFile>
+#include <QMutex>
+#include <QJsonArray>
+#include <QJsonObject>
+#include <QJsonDocument>
+#include <QAtomicInteger>
+
+#include <time.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include <algorithm>
+
+struct TraceEvent {
+	/* 0 empty, odd while written, 2 * (n + 1) once event n is complete */
+	QAtomicInteger<quint64> seq;
+	const char *name;
+	const char *device;
+	const char *recipe;
+	qint64 start;
+	qint64 duration;
+	int status;
+	int tid;
+};
+
+QAtomicInt Tracer::enabled;
+static QAtomicInteger<quint64> head;
+static TraceEvent ring[Tracer::ringSize];
+
+static thread_local const char *contextDevice = "";
+static thread_local const char *contextRecipe = "";
+static thread_local int threadId = 0;
+
+void Tracer::setEnabled(bool on)
+{
+	enabled.store(on);
+}
+
+/* tags every span this thread records from now on */
+void Tracer::setContext(const QString &device, const QString &recipe)
+{
+	contextDevice = intern(device);
+	contextRecipe = intern(recipe);
+}
+
+/*
+ * Stable copy of str for span names and tags. Takes a lock, so call it
+ * once per job or per spawned command, not per block.
+ */
+const char *Tracer::intern(const QString &str)
+{
+	static QMutex lock;
+	static QHash<QByteArray, const char *> strings;
+	QByteArray key = str.toUtf8();
+	QMutexLocker locker(&lock);
+	const char *s = strings.value(key);
+	if (!s) {
+		s = strdup(key.constData());
+		strings.insert(key, s);
+	}
+	return s;
+}
+
+/* monotonic microseconds */
+qint64 Tracer::now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+void Tracer::record(const char *name, qint64 start, qint64 duration, int status)
+{
+	if (!isEnabled())
+		return;
+	if (!threadId)
+		threadId = syscall(SYS_gettid);
+	quint64 n = head.fetchAndAddRelaxed(1);
+	TraceEvent &e = ring[n & (ringSize - 1)];
+	e.seq.storeRelease(2 * n + 1);
+	e.name = name;
+	e.device = contextDevice;
+	e.recipe = contextRecipe;
+	e.start = start;
+	e.duration = duration;
+	e.status = status;
+	e.tid = threadId;
+	e.seq.storeRelease(2 * n + 2);
+}
+
+static bool byStart(const TraceEvent *a, const TraceEvent *b)
+{
+	return a->start < b->start;
+}
+
+/*
+ * Writes what the ring holds right now. Slots rewritten while they are
+ * copied are skipped, recording goes on meanwhile.
+ */
+int Tracer::exportChrome(const QString &path)
+{
+	static TraceEvent copy[ringSize];
+	QList<const TraceEvent *> events;
+	for (int i = 0; i < ringSize; i++) {
+		quint64 before = ring[i].seq.loadAcquire();
+		if (!before || (before & 1))
+			continue;
+		copy[i].name = ring[i].name;
+		copy[i].device = ring[i].device;
+		copy[i].recipe = ring[i].recipe;
+		copy[i].start = ring[i].start;
+		copy[i].duration = ring[i].duration;
+		copy[i].status = ring[i].status;
+		copy[i].tid = ring[i].tid;
+		if (ring[i].seq.loadAcquire() != before)
+			continue;
+		events << &copy[i];
+	}
+	std::sort(events.begin(), events.end(), byStart);
+
+	QJsonArray list;
+	QHash<int, QString> threads;
+	foreach (const TraceEvent *e, events) {
+		QJsonObject args;
+		if (*e->device)
+			args.insert("device", QString::fromUtf8(e->device));
+		if (*e->recipe)
+			args.insert("recipe", QString::fromUtf8(e->recipe));
+		args.insert("status", e->status);
+		QJsonObject o;
+		o.insert("name", QString::fromUtf8(e->name));
+		o.insert("cat", QString("card"));
+		o.insert("ph", QString("X"));
+		o.insert("ts", (double)e->start);
+		o.insert("dur", (double)e->duration);
+		o.insert("pid", (int)getpid());
+		o.insert("tid", e->tid);
+		o.insert("args", args);
+		list << o;
+		if (*e->device)
+			threads.insert(e->tid, QString::fromUtf8(e->device));
+	}
+	/* one track per card in the viewer */
+	foreach (int tid, threads.keys()) {
+		QJsonObject args;
+		args.insert("name", threads.value(tid));
+		QJsonObject o;
+		o.insert("name", QString("thread_name"));
+		o.insert("ph", QString("M"));
+		o.insert("pid", (int)getpid());
+		o.insert("tid", tid);
+		o.insert("args", args);
+		list << o;
+	}
+	QJsonObject doc;
+	doc.insert("traceEvents", list);
+	doc.insert("displayTimeUnit", QString("ms"));
+
+	QFile f(path);
+	if (!f.open(QIODevice::WriteOnly | QIODevice::Truncate))
+		return -2;
+	if (f.write(QJsonDocument(doc).toJson(QJsonDocument::Compact)) < 0)
+		return -2;
+	return 0;
+}
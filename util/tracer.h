@@ -0,0 +1,53 @@
+#ifndef TRACER_H
+#define TRACER_H
+
+#include <QString>
+#include <QAtomicInt>
+
+/*
+ * Span tracing into a fixed in-memory ring, exported as Chrome trace json
+ * (chrome://tracing, ui.perfetto.dev). Recording a span is one atomic
+ * increment and a few stores, no lock and no allocation; with tracing off
+ * a span costs a single relaxed load. Names must outlive the process,
+ * string literals or intern()ed strings. Device and recipe tags come from
+ * the per thread context set by whoever drives a card.
+ */
+class Tracer
+{
+public:
+	static void setEnabled(bool on);
+	static inline bool isEnabled() { return enabled.load(); }
+	static void setContext(const QString &device, const QString &recipe);
+	static const char *intern(const QString &str);
+	static qint64 now();
+	static void record(const char *name, qint64 start, qint64 duration, int status);
+	static int exportChrome(const QString &path);
+
+	static const int ringSize = 16384;	/* power of two */
+private:
+	static QAtomicInt enabled;
+};
+
+/* measures its own lifetime, see TRACE_SPAN */
+class TraceSpan
+{
+public:
+	inline TraceSpan(const char *name)
+		: name(name), start(Tracer::isEnabled() ? Tracer::now() : -1), status(0) {}
+	inline ~TraceSpan()
+	{
+		if (start >= 0)
+			Tracer::record(name, start, Tracer::now() - start, status);
+	}
+	inline void setStatus(int err) { status = err; }
+private:
+	const char *name;
+	qint64 start;
+	int status;
+};
+
+#define TRACE_CONCAT2(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT2(a, b)
+#define TRACE_SPAN(name) TraceSpan TRACE_CONCAT(traceSpan, __LINE__)(name)
+
+#endif // TRACER_H